@@ -4,17 +4,20 @@
 #include <pthread.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <time.h>
+#include <math.h>
 
 #include "analog.h"
 #include "beaglebone.h"
 #include "mendel.h"
 #include "debug.h"
+#include "seqlock.h"
 
 
 struct analog_channel_record {
   channel_tag              id;
   const char*           device_path;
-  channel_tag              update_channel;
+  channel_handle        update_channel;
   update_callback*      callback;
   unsigned int          value;          // last value
   int                   filter_length;  // set to value > 0 for running average
@@ -23,6 +26,18 @@ struct analog_channel_record {
     unsigned int        remainder;      // remainder
     unsigned int        count;          // divisor for average
   } average;      
+  int                   median_length;  // odd, > 1 for median filter
+  struct median_data {
+    unsigned int        history[ MAX_MEDIAN_LENGTH];
+    unsigned int        ix;
+    unsigned int        count;
+  } median;
+  double                iir_alpha;      // > 0.0 for IIR filter
+  double                iir_value;
+  int                   iir_primed;
+  float                 delay;          // group delay of the filters [s]
+  seqlatch              latch;          // publishes 'sample' to the readers
+  analog_sample         sample[ 2];
 };
 
 static struct analog_channel_record* analog_channels = NULL;
@@ -46,10 +61,10 @@ static int analog_index_lookup( channel_tag analog_channel)
  * can be registered. Any previous value will be overwritten.
  * Set a callback to NULL to disable it.
  */
-int analog_set_update_callback( channel_tag analog_channel, update_callback* ptemp_update, channel_tag update_channel)
+int analog_set_update_callback( channel_tag analog_channel, update_callback* ptemp_update, channel_handle update_channel)
 {
   if (debug_flags & DEBUG_ANALOG) {
-    printf( "analog_set_update_callback from '%s' to '%s'\n", analog_channel, update_channel);
+    printf( "analog_set_update_callback from '%s' to channel %d\n", analog_channel, update_channel);
   }
   int ix = analog_index_lookup( analog_channel);
   if (ix >= 0) {
@@ -63,6 +78,91 @@ int analog_set_update_callback( channel_tag analog_channel, update_callback* pte
   return -1;
 }
 
+static unsigned int median_filter( struct median_data* m, int length, unsigned int val)
+{
+  unsigned int sorted[ MAX_MEDIAN_LENGTH];
+  m->history[ m->ix] = val;
+  if (++m->ix >= length) {
+    m->ix = 0;
+  }
+  if (m->count < length) {
+    ++m->count;
+  }
+  // insertion sort, the window is small
+  for (int i = 0 ; i < m->count ; ++i) {
+    unsigned int v = m->history[ i];
+    int j;
+    for (j = i ; j > 0 && sorted[ j - 1] > v ; --j) {
+      sorted[ j] = sorted[ j - 1];
+    }
+    sorted[ j] = v;
+  }
+  return sorted[ m->count / 2];
+}
+
+static unsigned int filter_sample( struct analog_channel_record* p, unsigned int val)
+{
+  if (p->iir_alpha > 0.0 || p->median_length > 1) {
+    if (p->median_length > 1) {
+      val = median_filter( &p->median, p->median_length, val);
+    }
+    if (p->iir_alpha > 0.0) {
+      if (!p->iir_primed) {
+        // start at the first value instead of slowly rising from zero
+        p->iir_value  = val;
+        p->iir_primed = 1;
+      }
+      p->iir_value += p->iir_alpha * (val - p->iir_value);
+      val = (unsigned int)(p->iir_value + 0.5);
+    }
+    return val;
+  } else if (p->filter_length > 0) {
+    int avg = p->average.value;
+    int rem = p->average.remainder;
+    int cnt = p->average.count;
+    if (cnt < p->filter_length) {
+      ++cnt;
+      p->average.count = cnt;
+    }
+    val = (cnt - 1) * avg + val + rem;
+    p->average.value = val / cnt;
+    p->average.remainder = val % cnt;
+    return (val + rem + cnt / 2) / cnt;
+  }
+  return val;
+}
+
+/*
+ * Setup the filters of a channel and determine their group delay at
+ * low frequencies: (N - 1) / 2 samples for a median or running average
+ * of N samples and (1 - alpha) / alpha samples for the IIR filter.
+ */
+static void filter_init( struct analog_channel_record* pd, analog_config_record* ps)
+{
+  const double dt = 1.0E-6 * ANALOG_CYCLE_TIME;
+  pd->median_length = ps->median_length;
+  if (pd->median_length > MAX_MEDIAN_LENGTH) {
+    pd->median_length = MAX_MEDIAN_LENGTH;
+  }
+  pd->median.ix    = 0;
+  pd->median.count = 0;
+  pd->iir_alpha    = 0.0;
+  pd->iir_primed   = 0;
+  pd->delay        = 0.0;
+  if (ps->filter_time_constant > 0) {
+    pd->iir_alpha = 1.0 - exp( -dt / (1.0E-3 * ps->filter_time_constant));
+    pd->delay     = dt * (1.0 - pd->iir_alpha) / pd->iir_alpha;
+  }
+  if (pd->median_length > 1) {
+    pd->delay    += dt * (pd->median_length - 1) / 2;
+  } else if (pd->iir_alpha == 0.0 && pd->filter_length > 1) {
+    pd->delay     = dt * (pd->filter_length - 1) / 2;
+  }
+  if (debug_flags & DEBUG_ANALOG) {
+    printf( "analog channel '%s' filter delay is %1.3f [s]\n", tag_name( pd->id), pd->delay);
+  }
+}
+
 /*
  * This is the worker thread that reads the analog inputs and
  * calls the callbacks to export the read values.
@@ -95,21 +195,13 @@ void* analog_worker( void* arg)
     if (ret > 0) {
       int val = atoi( buf);
       struct analog_channel_record* p = &analog_channels[ i];
-      if (p->filter_length > 0) {
-        int avg = p->average.value;
-        int rem = p->average.remainder;
-        int cnt = p->average.count;
-        if (cnt < p->filter_length) {
-          ++cnt;
-          p->average.count = cnt;
-        }
-        val = (cnt - 1) * avg + val + rem;
-        p->average.value = val / cnt;
-        p->average.remainder = val % cnt;
-        p->value = (val + rem + cnt / 2) / cnt;
-      } else {
-        p->value = val;
-      }
+      analog_sample sample;
+      clock_gettime( CLOCK_MONOTONIC, &sample.timestamp);
+      sample.raw = val;
+      p->value = filter_sample( p, val);
+      sample.filtered = p->value;
+      sample.delay = p->delay;
+      seqlatch_write( &p->latch, p->sample, &sample, sizeof( sample));
       lseek( fd[ i], 0, SEEK_SET);
     } else if (ret < 0) {
       perror( "analog thread: ADC read failed -");
@@ -124,8 +216,8 @@ void* analog_worker( void* arg)
           struct analog_channel_record* p = &analog_channels[ ch];
           if (p->callback != NULL) {
             if (debug_flags & DEBUG_ANALOG) {
-              fprintf( stderr, "analog_worker, calling temp_update for %s with value %d\n",
-                      p->update_channel, p->value);
+              fprintf( stderr, "analog_worker, calling temp_update for '%s' with value %d\n",
+                      tag_name( p->id), p->value);
             }
             (void) (p->callback)( p->update_channel, p->value);
           }
@@ -190,6 +282,8 @@ int analog_init( void)
       pd->average.count     = 0;
       pd->average.value     = 0;
       pd->average.remainder = 0;
+      pd->latch.seq         = 0;
+      filter_init( pd, ps);
       ++num_analog_channels;
     }
     if (mendel_thread_create( "analog", &worker, NULL, &analog_worker, NULL) != 0) {
@@ -210,9 +304,36 @@ int analog_get_raw_value( channel_tag analog_channel, int* pvalue)
   if (pvalue != NULL) {
     int ix = analog_index_lookup( analog_channel);
     if (ix >= 0) {
-      // TODO: lock?
-      *pvalue = analog_channels[ ix].value;
-      // TODO: unlock?
+      analog_sample sample;
+      struct analog_channel_record* p = &analog_channels[ ix];
+      seqlatch_read( &p->latch, p->sample, &sample, sizeof( sample));
+      *pvalue = sample.filtered;
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Get the last sample of an analog channel, the reader never blocks
+ * the sampling thread. Before the first ADC read, the timestamp is zero.
+ */
+int analog_get_sample( channel_tag analog_channel, analog_sample* psample)
+{
+  return analog_get_sample_by_handle( analog_index_lookup( analog_channel), psample);
+}
+
+channel_handle analog_get_handle( channel_tag analog_channel)
+{
+  return analog_index_lookup( analog_channel);
+}
+
+int analog_get_sample_by_handle( channel_handle ix, analog_sample* psample)
+{
+  if (psample != NULL) {
+    if (ix >= 0 && ix < num_analog_channels) {
+      struct analog_channel_record* p = &analog_channels[ ix];
+      seqlatch_read( &p->latch, p->sample, psample, sizeof( *psample));
       return 0;
     }
   }
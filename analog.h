@@ -1,23 +1,48 @@
 #ifndef	_ANALOG_H
 #define	_ANALOG_H
 
+#include <time.h>
+
 #include "beaglebone.h"
 
 #define ANALOG_CYCLE_TIME         20000 /* usecs, sensor readout cycle */
 #define ANALOG_UPDATE_CYCLE_TIME 200000 /* usecs, update interval callbacks */
 
+#define MAX_MEDIAN_LENGTH	9
+
+/*
+ * Each channel has either a running average of 'filter_length' samples,
+ * or a median of 'median_length' samples (spike rejection) followed by
+ * a single pole IIR low-pass with time constant 'filter_time_constant'.
+ * Both filters of the latter are optional.
+ */
 typedef const struct {
   channel_tag		tag;
   const char*		device_path;
-  unsigned int		filter_length;
+  unsigned int		filter_length;		// running average, if no time constant set
+  unsigned int		median_length;		// odd, at most MAX_MEDIAN_LENGTH, 0: none
+  unsigned int		filter_time_constant;	// IIR [ms], 0: none
 } analog_config_record;
 
-typedef int (update_callback)( channel_tag channel, int new_value);
+typedef int (update_callback)( channel_handle channel, int new_value);
+
+/*
+ * A coherent, timestamped sample of an analog input.
+ */
+typedef struct {
+  unsigned int		raw;		// last value read from the ADC
+  unsigned int		filtered;	// filter output (equals raw if unfiltered)
+  struct timespec	timestamp;	// CLOCK_MONOTONIC time of the ADC read
+  float			delay;		// group delay of the filter [s]
+} analog_sample;
 
 extern int analog_init( void);
-extern int analog_set_update_callback( channel_tag analog_channel, update_callback* pupdate, channel_tag update_channel);
+extern int analog_set_update_callback( channel_tag analog_channel, update_callback* pupdate, channel_handle update_channel);
 extern int analog_config( analog_config_record* pconfig_data, int nr_config_items);
 // Do not use this, for debugging only!
 extern int analog_get_raw_value( channel_tag analog_channel, int* pvalue);
+extern int analog_get_sample( channel_tag analog_channel, analog_sample* psample);
+extern channel_handle analog_get_handle( channel_tag analog_channel);
+extern int analog_get_sample_by_handle( channel_handle analog_channel, analog_sample* psample);
 
 #endif
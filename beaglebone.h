@@ -36,6 +36,15 @@
 #define HOME_PRIO	ELEV_PRIO
 #define HOME_SCHED	SCHED_RR
 
+#define SPOOL_PRIO	ELEV_PRIO	/* keeps the PRU queue filled */
+#define SPOOL_SCHED	SCHED_FIFO
+
+#define DRAIN_PRIO	ELEV_PRIO
+#define DRAIN_SCHED	SCHED_FIFO
+
+#define LOG_PRIO	0		/* log writer must not disturb the others */
+#define LOG_SCHED	SCHED_OTHER
+
 #define NR_ITEMS( x) (sizeof( (x)) / sizeof( *(x)))
 
 /* convert [mm/min] into [m/s] */
@@ -59,4 +68,12 @@
 typedef const char* channel_tag;
 static inline const char* tag_name( channel_tag tag) { return (char*)tag; }
 
+/*
+ * A channel_tag is resolved once (at configuration time) into a handle,
+ * the index into the channel table of a subsystem. The per-sample and
+ * per-cycle code paths use the handle for direct access.
+ */
+typedef int channel_handle;
+#define INVALID_HANDLE	(-1)
+
 #endif
@@ -19,6 +19,13 @@ extern int bebopr_post_init( void);
 
 extern int config_e_axis_is_always_relative( void);
 extern char config_keep_alive_char( void);
+extern int config_ok_ahead_depth( void);
+extern int config_comm_tcp_port( void);
+extern int config_comm_tcp_public( void);
+extern const char* config_comm_socket_path( void);
+extern double config_heater_power_budget( void);
+extern long config_heater_log_max_size( void);
+extern int config_heater_log_compress( void);
 
 // determines stepper driver control
 extern int config_use_pololu_drivers( void);
@@ -44,6 +51,17 @@ extern double config_get_max_accel( axis_e axis);
 // these return preferred settings
 extern double config_get_home_max_feed( axis_e axis);
 extern double config_get_home_release_feed( axis_e axis);
+extern double config_get_home_probe_feed( axis_e axis);
+extern double config_get_home_search_distance( axis_e axis);
+extern double config_get_home_backoff_distance( axis_e axis);
+extern double config_limsw_debounce_time( void);
+
+// bed probing with the Z minimum switch, see G29
+extern int config_probe_grid( double* x0, double* y0, double* x1, double* y1, int* nx, int* ny);
+extern double config_probe_feed( void);
+extern double config_probe_travel_feed( void);
+extern double config_probe_clearance( void);
+extern double config_probe_depth( void);
 
 // recalibrate reference sensor position
 extern int config_set_cal_pos( axis_e axis, double pos);
@@ -24,6 +24,14 @@
 
 #define PWM_PATH_PREFIX "/sys/class/pwm/"
 
+/*
+ * Host GPIO access: e_gpio_mmap reads and writes the bank registers
+ * directly (needs access to /dev/mem), e_gpio_sysfs uses the value files.
+ * Set GPIO_ROOT to a directory to run with a file-backed stand-in for sysfs.
+ */
+#define GPIO_BACKEND	e_gpio_sysfs
+#define GPIO_ROOT	NULL
+
 /*
  * Note, for the ease of implementation, the string addresses are used.
  * This means one cannot use identical strings, but must use pointers
@@ -45,11 +53,17 @@ GENERATE_TAG( pwm_bed);
 GENERATE_TAG( pwm_fan);
 #endif
 
+/*
+ * The thermistors use a median of 5 to reject spikes followed by a
+ * low-pass, the group delay is much lower than that of a running
+ * average with the same noise reduction.
+ */
 static const analog_config_record analog_config_data[] = {
   {
     .tag                = bed_thermistor,
     .device_path	= AIN_PATH_PREFIX "ain2",	// BEBOPR_R2_J6 - THRM0 (hardware ain1)
-    .filter_length	= 50,
+    .median_length	= 5,
+    .filter_time_constant = 500,
   },
   {
     .tag                = spare_ain,
@@ -59,7 +73,8 @@ static const analog_config_record analog_config_data[] = {
   {
     .tag                = extruder_thermistor,
     .device_path	= AIN_PATH_PREFIX "ain6",	// BEBOPR_R2_J8 - THRM2 (hardware ain5)
-    .filter_length	= 50,
+    .median_length	= 5,
+    .filter_time_constant = 150,
   },
 };
 
@@ -120,6 +135,15 @@ static const heater_config_record heater_config_data[] = {
 	    .D = 0.0,
 	    .I_limit = 10.0,
     },
+    /*
+     * No model is configured (gain 0), use M306 to identify one.
+     * The load factor is the extra power per mm/s filament (1.75 mm).
+     */
+    .model =
+    {
+	    .load_factor = 4.0,
+    },
+    .power = 40.0,
   },
   {
     .tag		= heater_bed,
@@ -134,6 +158,7 @@ static const heater_config_record heater_config_data[] = {
 	    .D = 0.0,
 	    .I_limit = 0.0,
     },
+    .power = 180.0,
   },
 #endif
 };
@@ -144,6 +169,16 @@ int bebopr_pre_init( void)
 {
   int result = -1;
 
+  result = gpio_init( GPIO_BACKEND, GPIO_ROOT);
+  if (result < 0) {
+    fprintf( stderr, "gpio_init failed!\n");
+    goto done;
+  }
+  result = thermistor_init();
+  if (result < 0) {
+    fprintf( stderr, "thermistor_init failed!\n");
+    goto done;
+  }
   result = analog_config( analog_config_data, NR_ITEMS( analog_config_data));
   if (result < 0) {
     fprintf( stderr, "analog_config failed!\n");
@@ -384,6 +419,105 @@ double config_get_home_max_feed( axis_e axis)
   }
 }
 
+/*
+ *  Specify the feed for the slow second approach of the home
+ *  switch that determines the home position. Set to zero to
+ *  home with a single approach at the maximum home feed.
+ */
+double config_get_home_probe_feed( axis_e axis)
+{
+  switch (axis) {
+  case x_axis:	return   60.0;
+  case y_axis:	return   60.0;
+  case z_axis:	return   30.0;
+  default:	return    0.0;
+  }
+}
+
+/*
+ *  Specify the maximum distance [m] traveled while searching
+ *  the home switch.
+ */
+double config_get_home_search_distance( axis_e axis)
+{
+  switch (axis) {
+  case x_axis:	return 0.500;
+  case y_axis:	return 0.500;
+  case z_axis:	return 0.500;
+  default:	return 0.0;
+  }
+}
+
+/*
+ *  Specify the distance [m] to back off from the released home
+ *  switch before the slow second approach.
+ */
+double config_get_home_backoff_distance( axis_e axis)
+{
+  switch (axis) {
+  case x_axis:	return 0.002;
+  case y_axis:	return 0.002;
+  case z_axis:	return 0.001;
+  default:	return 0.0;
+  }
+}
+
+/*
+ *  Specify the time [s] a limit switch must be stable
+ *  after its last change before its state is used.
+ */
+double config_limsw_debounce_time( void)
+{
+  return 0.010;
+}
+
+/*
+ *  Specify the grid [m] for bed probing with G29, in machine
+ *  coordinates. Return 0 if the bed cannot be probed.
+ */
+int config_probe_grid( double* x0, double* y0, double* x1, double* y1, int* nx, int* ny)
+{
+  *x0 = 0.010;
+  *y0 = 0.010;
+  *x1 = 0.190;
+  *y1 = 0.190;
+  *nx = 3;
+  *ny = 3;
+  return 1;
+}
+
+/*
+ *  Specify the feed used to probe the bed.
+ */
+double config_probe_feed( void)
+{
+  return 120.0;
+}
+
+/*
+ *  Specify the feed used to travel between probe points.
+ */
+double config_probe_travel_feed( void)
+{
+  return 3000.0;
+}
+
+/*
+ *  Specify the height [m] above Z=0 to travel between probe points.
+ */
+double config_probe_clearance( void)
+{
+  return 0.003;
+}
+
+/*
+ *  Specify how far [m] below the clearance height to search for the bed.
+ */
+double config_probe_depth( void)
+{
+  return 0.008;
+}
+
 static int e_axis_rel_mode = 1;
 
 int config_set_e_axis_mode( int relative)
@@ -414,6 +548,69 @@ char config_keep_alive_char( void)
   return '\n';
 }
 
+/*
+ *  Specify the number of commands the host may send ahead of the
+ *  responses (ok-ahead flow control). With a non-zero value, each
+ *  line is acknowledged with 'ok B:n' as soon as it has been entered
+ *  into the command buffer, where n is the number of free entries.
+ *  That 'ok' only means the line took a buffer entry: a line that
+ *  fails its checksum is answered later with 'rs N', and the host
+ *  must resend it (and the lines after it), each taking a new entry.
+ *  Zero selects the traditional protocol that sends the 'ok' when
+ *  the command is being executed.
+ */
+int config_ok_ahead_depth( void)
+{
+  return 0;
+}
+
+/*
+ *  The host can connect through a TCP port or a Unix domain socket,
+ *  this replaces the socat relay. The first connection gets the
+ *  motion stream, additional connections are read-only monitors.
+ *  A port of zero or an empty path disables that listener.
+ *  There is no authentication, so TCP is disabled by default and
+ *  only listens on the loopback interface unless made public.
+ */
+int config_comm_tcp_port( void)
+{
+  return 0;
+}
+
+int config_comm_tcp_public( void)
+{
+  return 0;
+}
+
+const char* config_comm_socket_path( void)
+{
+  return "/var/run/bebopr.sock";
+}
+
+/*
+ *  Power [W] the supply can deliver to the heaters together. If the
+ *  heaters' combined power exceeds this, their outputs are limited,
+ *  highest priority heater first. Zero disables the budget.
+ */
+double config_heater_power_budget( void)
+{
+  return 0.0;
+}
+
+/*
+ *  Heater logs that grow beyond this size [bytes] are renamed to
+ *  'pid-<channel>.log.1' and optionally gzip'ed. Zero: never rotate.
+ */
+long config_heater_log_max_size( void)
+{
+  return 4 * 1024 * 1024;
+}
+
+int config_heater_log_compress( void)
+{
+  return 1;
+}
+
 
 /*
  *  Late initialization enables I/O power.
@@ -426,13 +623,11 @@ int bebopr_post_init( void)
    *  IO_PWR_ON  = R9 / GPIO1[6] / gpio38 /  gpmc_ad6
    *  !IO_PWR_ON = R8 / GPIO1[2] / gpio34 /  gpmc_ad2
    */
-  gpio_write_int_value_to_file( "export", 38);
-  gpio_write_value_to_pin_file( 38, "direction", "out");
-  gpio_write_value_to_pin_file( 38, "value", "1");
+  gpio_pin_open( 38, 1);
+  gpio_pin_write( 38, 1);
 
-  gpio_write_int_value_to_file( "export", 34);
-  gpio_write_value_to_pin_file( 34, "direction", "out");
-  gpio_write_value_to_pin_file( 34, "value", "0");
+  gpio_pin_open( 34, 1);
+  gpio_pin_write( 34, 0);
 
   fprintf( stderr, "Turned BEBOPR I/O power on\n");
   result = 0;
@@ -0,0 +1,229 @@
+#include <stdio.h>
+#include <math.h>
+
+#include "bed_mesh.h"
+
+/*
+ * The probed heights and, per cell, the coefficients of the bilinear
+ * surface z = a + b * u + c * v + d * u * v with u and v relative to
+ * the lower left grid point of the cell. The coefficients are computed
+ * once when the mesh is complete, so an offset costs a few multiplies.
+ */
+struct cell {
+  double		a;
+  double		b;
+  double		c;
+  double		d;
+};
+
+struct mesh {
+  double		x0;
+  double		y0;
+  double		dx;		// grid spacing
+  double		dy;
+  int			nx;
+  int			ny;
+  double		z[ BED_MESH_MAX_POINTS][ BED_MESH_MAX_POINTS];	// [iy][ix]
+  struct cell		cell[ BED_MESH_MAX_POINTS - 1][ BED_MESH_MAX_POINTS - 1];
+  int			valid;
+  int			enabled;
+};
+
+static struct mesh mesh;
+static struct mesh previous;	// saved by bed_mesh_setup
+
+/*
+ * Start a new mesh, this disables compensation until bed_mesh_finish.
+ * The mesh in use is saved, bed_mesh_restore brings it back.
+ */
+int bed_mesh_setup( double x0, double y0, double x1, double y1, int nx, int ny)
+{
+  if (nx < 2 || ny < 2 || nx > BED_MESH_MAX_POINTS || ny > BED_MESH_MAX_POINTS ||
+      x1 <= x0 || y1 <= y0) {
+    return -1;
+  }
+  previous     = mesh;
+  mesh.valid   = 0;
+  mesh.enabled = 0;
+  mesh.x0 = x0;
+  mesh.y0 = y0;
+  mesh.dx = (x1 - x0) / (nx - 1);
+  mesh.dy = (y1 - y0) / (ny - 1);
+  mesh.nx = nx;
+  mesh.ny = ny;
+  return 0;
+}
+
+void bed_mesh_get_point( int ix, int iy, double* x, double* y)
+{
+  *x = mesh.x0 + ix * mesh.dx;
+  *y = mesh.y0 + iy * mesh.dy;
+}
+
+void bed_mesh_set_point( int ix, int iy, double z)
+{
+  if (ix >= 0 && ix < mesh.nx && iy >= 0 && iy < mesh.ny) {
+    mesh.z[ iy][ ix] = z;
+  }
+}
+
+/*
+ * All points are measured: calculate the cell coefficients and enable compensation.
+ */
+int bed_mesh_finish( void)
+{
+  int ix;
+  int iy;
+
+  if (mesh.nx < 2 || mesh.ny < 2) {
+    return -1;
+  }
+  for (iy = 0 ; iy < mesh.ny - 1 ; ++iy) {
+    for (ix = 0 ; ix < mesh.nx - 1 ; ++ix) {
+      double z00 = mesh.z[ iy][ ix];
+      double z10 = mesh.z[ iy][ ix + 1];
+      double z01 = mesh.z[ iy + 1][ ix];
+      double z11 = mesh.z[ iy + 1][ ix + 1];
+      struct cell* c = &mesh.cell[ iy][ ix];
+      c->a = z00;
+      c->b = (z10 - z00) / mesh.dx;
+      c->c = (z01 - z00) / mesh.dy;
+      c->d = (z11 - z10 - z01 + z00) / (mesh.dx * mesh.dy);
+    }
+  }
+  mesh.valid   = 1;
+  mesh.enabled = 1;
+  return 0;
+}
+
+/*
+ * Measuring the new mesh failed: return to the mesh saved by bed_mesh_setup.
+ */
+void bed_mesh_restore( void)
+{
+  mesh = previous;
+}
+
+int bed_mesh_enable( int enable)
+{
+  if (enable && !mesh.valid) {
+    return -1;
+  }
+  mesh.enabled = (enable) ? 1 : 0;
+  return 0;
+}
+
+int bed_mesh_active( void)
+{
+  return mesh.valid && mesh.enabled;
+}
+
+/*
+ * Select the cell for one coordinate, outside the grid the nearest
+ * cell is used with the coordinate clipped to its edge.
+ */
+static int locate( double p, double p0, double dp, int n, double* u)
+{
+  int i = (int) floor( (p - p0) / dp);
+  if (i < 0) {
+    i = 0;
+  } else if (i > n - 2) {
+    i = n - 2;
+  }
+  *u = p - (p0 + i * dp);
+  if (*u < 0.0) {
+    *u = 0.0;
+  } else if (*u > dp) {
+    *u = dp;
+  }
+  return i;
+}
+
+double bed_mesh_offset( double x, double y)
+{
+  double u;
+  double v;
+
+  if (!bed_mesh_active()) {
+    return 0.0;
+  }
+  int ix = locate( x, mesh.x0, mesh.dx, mesh.nx, &u);
+  int iy = locate( y, mesh.y0, mesh.dy, mesh.ny, &v);
+  const struct cell* c = &mesh.cell[ iy][ ix];
+  return c->a + c->b * u + c->c * v + c->d * u * v;
+}
+
+static int add_crossings( double ps, double pe, double p0, double dp, int n, double* t, int count, int max)
+{
+  int i;
+
+  if (pe == ps) {
+    return count;
+  }
+  for (i = 0 ; i < n && count < max ; ++i) {
+    double f = (p0 + i * dp - ps) / (pe - ps);
+    if (f > 1.0E-9 && f < 1.0 - 1.0E-9) {
+      t[ count++] = f;
+    }
+  }
+  return count;
+}
+
+/*
+ * Find where the move from (xs, ys) to (xe, ye) crosses grid lines.
+ * The fractions of the move length are stored sorted in t[], the
+ * number of fractions is returned. Within a cell the Z offset changes
+ * (nearly) linearly, so the move is compensated by splitting it there.
+ */
+int bed_mesh_split( double xs, double ys, double xe, double ye, double* t, int max)
+{
+  int count = 0;
+  int i;
+  int j;
+
+  if (!bed_mesh_active()) {
+    return 0;
+  }
+  count = add_crossings( xs, xe, mesh.x0, mesh.dx, mesh.nx, t, count, max);
+  count = add_crossings( ys, ye, mesh.y0, mesh.dy, mesh.ny, t, count, max);
+  // insertion sort, drop (near) duplicates from crossing a grid point
+  for (i = 1 ; i < count ; ++i) {
+    double f = t[ i];
+    for (j = i ; j > 0 && t[ j - 1] > f ; --j) {
+      t[ j] = t[ j - 1];
+    }
+    t[ j] = f;
+  }
+  for (i = 1, j = 0 ; i < count ; ++i) {
+    if (t[ i] - t[ j] > 1.0E-9) {
+      t[ ++j] = t[ i];
+    }
+  }
+  return (count > 0) ? j + 1 : 0;
+}
+
+/*
+ * Report the mesh as 'nx x ny' followed by the heights in mm, row by row.
+ */
+int bed_mesh_format( char* s, int size)
+{
+  int len;
+  int ix;
+  int iy;
+
+  if (!mesh.valid) {
+    return snprintf( s, size, "no bed mesh");
+  }
+  len = snprintf( s, size, "mesh %s %dx%d from (%1.3lf, %1.3lf) step (%1.3lf, %1.3lf):",
+		  (mesh.enabled) ? "on" : "off", mesh.nx, mesh.ny,
+		  1000.0 * mesh.x0, 1000.0 * mesh.y0, 1000.0 * mesh.dx, 1000.0 * mesh.dy);
+  for (iy = 0 ; iy < mesh.ny && len < size ; ++iy) {
+    for (ix = 0 ; ix < mesh.nx && len < size ; ++ix) {
+      len += snprintf( s + len, size - len, "%s%1.3lf", (ix == 0) ? " [" : " ", 1000.0 * mesh.z[ iy][ ix]);
+    }
+    if (len < size) {
+      len += snprintf( s + len, size - len, "]");
+    }
+  }
+  return len;
+}
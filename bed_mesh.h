@@ -0,0 +1,28 @@
+#ifndef _BED_MESH_H
+#define _BED_MESH_H
+
+/*
+ * Height map of the bed, measured with G29 on a regular grid. While
+ * enabled, the Z offset at any X-Y position is interpolated bilinearly
+ * from the four grid points around it. All dimensions are in [m] and
+ * machine coordinates.
+ */
+
+#define BED_MESH_MAX_POINTS	16	// per direction
+// upper limit for the number of split points of one move
+#define BED_MESH_MAX_SPLITS	(2 * BED_MESH_MAX_POINTS)
+// buffer size for bed_mesh_format: header, then up to 12 characters per height
+#define BED_MESH_REPORT_SIZE	(100 + BED_MESH_MAX_POINTS * (4 + 12 * BED_MESH_MAX_POINTS))
+
+extern int bed_mesh_setup( double x0, double y0, double x1, double y1, int nx, int ny);
+extern void bed_mesh_get_point( int ix, int iy, double* x, double* y);
+extern void bed_mesh_set_point( int ix, int iy, double z);
+extern int bed_mesh_finish( void);
+extern void bed_mesh_restore( void);
+extern int bed_mesh_enable( int enable);
+extern int bed_mesh_active( void);
+extern double bed_mesh_offset( double x, double y);
+extern int bed_mesh_split( double xs, double ys, double xe, double ye, double* t, int max);
+extern int bed_mesh_format( char* s, int size);
+
+#endif
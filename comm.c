@@ -1,90 +1,628 @@
 
-#define _GNU_SOURCE     /* for pipe2 */
+#define _GNU_SOURCE     /* for pipe2, accept4 */
 
 #include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
-#include <poll.h>
+#include <signal.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #include "comm.h"
 #include "mendel.h"
 #include "bebopr.h"
 #include "debug.h"
 #include "beaglebone.h"
+#include "gcode_process.h"
 
 #define LL_DEBUG 0	/* low level, very verbose debugging of comm code */
 
 /*
- * Simple keep alive implementation needed until I find out
- * how to keep the socat connection alive otherwise
+ * The comm thread relays all data between the clients and the pipes
+ * that replace the program's stdin and stdout. Clients are the console
+ * (the program's original stdin / stdout) and connections accepted on
+ * the TCP port and Unix socket. A single epoll loop serves them all.
+ *
+ * One client holds the motion stream: its input is forwarded to the
+ * parser and all program output is sent to it. Initially this is the
+ * console, if that reaches EOF, the first client that connects takes
+ * over. All other connections are read-only monitors that can only
+ * query status, these queries are answered directly by this thread
+ * so monitoring does not interfere with the stream.
  */
 
-static struct pollfd fds[ 4];
+#define COMM_BUFFER_SIZE 4096	/* must be a power of 2 */
+#define MAX_CLIENTS 8
+#define COMMAND_LINE_SIZE 128
+
+struct comm_buffer {
+  char data[ COMM_BUFFER_SIZE];
+  unsigned int head;	/* free running count of bytes put into the buffer */
+  unsigned int tail;	/* free running count of bytes taken from the buffer */
+};
+
+/*
+ * Registration of a file descriptor with the epoll set. Some fds
+ * (regular files, /dev/null) can't be polled, these are always ready.
+ */
+struct comm_watch {
+  int fd;
+  uint32_t tag;
+  uint32_t events;
+  int registered;
+  int unpollable;
+};
+
+typedef enum {
+  e_role_free = 0,
+  e_role_stream,
+  e_role_monitor,
+} client_role;
+
+struct comm_client {
+  client_role role;
+  int fd_in;
+  int fd_out;
+  struct comm_watch watch_in;
+  struct comm_watch watch_out;	/* only used if fd_out differs from fd_in */
+  int eof;
+  int out_at_bol;		/* output buffer ends at the start of a line */
+  unsigned int scan;		/* start of the first input line not yet checked */
+  struct comm_buffer in;
+  struct comm_buffer out;
+};
+
+/* epoll tags, the lower byte holds the client index */
+#define TAG_APP_OUTPUT	0x0100
+#define TAG_APP_INPUT	0x0200
+#define TAG_DONE_EVENT	0x0300
+#define TAG_LISTEN	0x0400
+#define TAG_CLIENT_IN	0x0500
+#define TAG_CLIENT_OUT	0x0600
+#define TAG_CONSOLE	0xFF
+
+static struct comm_client console;
+static struct comm_client clients[ MAX_CLIENTS];
+static struct comm_client* stream_client;
+
+static int epoll_fd = -1;
+static struct comm_watch app_output;	/* read side of stdout pipe */
+static struct comm_watch app_input;	/* write side of stdin pipe */
+static struct comm_watch done_watch;
+static struct comm_watch listen_watch[ 2];
 
 static int fd_stdin;
 static int fd_stdout;
 static int alt_stdin;
 static int alt_stdout;
 
-typedef enum {
-  e_stdout_readside = 0,
-  e_stdout_writeside,
-  e_stdin_readside,
-  e_stdin_writeside,
-} fds_index;
+/*
+ * Ok-ahead flow control: the input pipe acts as command buffer.
+ * Lines are counted when they're written into the pipe and when
+ * the parser has finished them. The difference is the number of
+ * buffered commands. Input is no longer forwarded when the buffer
+ * is full, the 'done_event' wakes the thread when room becomes available.
+ */
+static int ok_ahead_depth;
+static volatile unsigned int lines_queued;
+static volatile unsigned int lines_done;
+static volatile int input_throttled;
+static int done_event = -1;
+
+/*
+ * Priority lane: complete lines from the stream client are checked for
+ * real-time commands (emergency stop, overrides, pause / resume, status)
+ * as soon as they arrive. These are executed right away and removed from
+ * the input, so they don't wait behind the lines queued for the parser.
+ * Their replies are inserted into the output at the start of a line.
+ */
+static struct comm_buffer priority_replies;
+
+static long ms_elapsed( const struct timespec* since)
+{
+  struct timespec now;
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - since->tv_sec) * 1000 + (now.tv_nsec - since->tv_nsec) / 1000000;
+}
+
+static int is_eol( char c)
+{
+  return (c == '\n' || c == '\r');
+}
+
+static unsigned int buffer_used( const struct comm_buffer* b)
+{
+  return b->head - b->tail;
+}
+
+static unsigned int buffer_free( const struct comm_buffer* b)
+{
+  return COMM_BUFFER_SIZE - buffer_used( b);
+}
+
+static char buffer_peek( const struct comm_buffer* b, unsigned int offset)
+{
+  return b->data[ (b->tail + offset) % COMM_BUFFER_SIZE];
+}
+
+static void buffer_clear( struct comm_buffer* b)
+{
+  b->head = b->tail = 0;
+}
+
+/*
+ * Remove 'len' bytes starting at (free running) index 'start'
+ * by moving the data in front of it up.
+ */
+static void buffer_remove( struct comm_buffer* b, unsigned int start, unsigned int len)
+{
+  for (unsigned int i = start ; i != b->tail ; ) {
+    --i;
+    b->data[ (i + len) % COMM_BUFFER_SIZE] = b->data[ i % COMM_BUFFER_SIZE];
+  }
+  b->tail += len;
+}
+
+/*
+ * Append data to the buffer, returns the number of bytes stored.
+ */
+static int buffer_put( struct comm_buffer* b, const char* s, unsigned int len)
+{
+  unsigned int i;
+  for (i = 0 ; i < len && buffer_free( b) > 0 ; ++i) {
+    b->data[ b->head++ % COMM_BUFFER_SIZE] = s[ i];
+  }
+  return i;
+}
+
+/*
+ * Fill the buffer from 'fd' with a single read() call.
+ */
+static int buffer_fill( struct comm_buffer* b, int fd)
+{
+  unsigned int ix = b->head % COMM_BUFFER_SIZE;
+  unsigned int len = COMM_BUFFER_SIZE - ix;
+  if (len > buffer_free( b)) {
+    len = buffer_free( b);
+  }
+  int cnt = read( fd, &b->data[ ix], len);
+  if (cnt > 0) {
+    b->head += cnt;
+  }
+  return cnt;
+}
+
+/*
+ * Drain at most 'max' bytes from the buffer to 'fd' with a single write() call.
+ */
+static int buffer_drain( struct comm_buffer* b, int fd, unsigned int max)
+{
+  unsigned int ix = b->tail % COMM_BUFFER_SIZE;
+  unsigned int len = COMM_BUFFER_SIZE - ix;
+  if (len > max) {
+    len = max;
+  }
+  int cnt = write( fd, &b->data[ ix], len);
+  if (cnt > 0) {
+    b->tail += cnt;
+  }
+  return cnt;
+}
+
+/*
+ * Update the events an fd is watched for, only calls into the kernel on a change.
+ */
+static void watch_set( struct comm_watch* w, uint32_t events)
+{
+  if (w->fd < 0 || w->unpollable || (w->registered && w->events == events)) {
+    w->events = events;
+    return;
+  }
+  struct epoll_event ev = {
+    .events = events,
+    .data.u32 = w->tag,
+  };
+  if (epoll_ctl( epoll_fd, (w->registered) ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w->fd, &ev) < 0) {
+    if (errno == EPERM) {
+      w->unpollable = 1;
+    } else {
+      perror( "comm: epoll_ctl failed");
+    }
+  } else {
+    w->registered = 1;
+  }
+  w->events = events;
+}
+
+static void watch_init( struct comm_watch* w, int fd, uint32_t tag)
+{
+  w->fd = fd;
+  w->tag = tag;
+  w->events = 0;
+  w->registered = 0;
+  w->unpollable = 0;
+}
+
+static void watch_remove( struct comm_watch* w)
+{
+  if (w->registered) {
+    epoll_ctl( epoll_fd, EPOLL_CTL_DEL, w->fd, NULL);
+  }
+  w->registered = 0;
+  w->fd = -1;
+}
+
+/*
+ * Called by the parser each time a line has been processed.
+ */
+void comm_command_done( void)
+{
+  if (ok_ahead_depth) {
+    __sync_fetch_and_add( &lines_done, 1);
+    if (input_throttled) {
+      uint64_t one = 1;
+      if (write( done_event, &one, sizeof( one)) < 0) {
+        perror( "comm_command_done: eventfd write failed");
+      }
+    }
+  }
+}
+
+int comm_ok_ahead_active( void)
+{
+  return (ok_ahead_depth > 0);
+}
+
+/*
+ * The client that receives the program output.
+ */
+static struct comm_client* output_client( void)
+{
+  return (stream_client) ? stream_client : &console;
+}
+
+/*
+ * Determine how much of the stream input can be forwarded to the parser.
+ * Only complete lines are forwarded, so a client that disconnects halfway
+ * a line can't leave a truncated command behind. With ok-ahead flow control,
+ * forwarding stops in front of the first line that does not fit into the
+ * command buffer, in that case 'throttled' is set.
+ */
+static unsigned int input_scan( const struct comm_buffer* b, char last_input, int* throttled)
+{
+  unsigned int used = buffer_used( b);
+  unsigned int complete = 0;
+  int room = ok_ahead_depth - (int)(lines_queued - lines_done);
+  char prev = last_input;
+  *throttled = 0;
+  for (unsigned int i = 0 ; i < used ; ++i) {
+    char c = buffer_peek( b, i);
+    if (is_eol( c)) {
+      if (!is_eol( prev) && ok_ahead_depth) {
+        if (room <= 0) {
+          *throttled = 1;
+          return complete;
+        }
+        --room;
+      }
+      complete = i + 1;
+    }
+    prev = c;
+  }
+  // don't get stuck on a line that doesn't fit, or on the last line before EOF
+  if (complete == 0 && (buffer_free( b) == 0 || stream_client->eof)) {
+    complete = used;
+  }
+  return complete;
+}
+
+/*
+ * Return the number of input bytes that can be forwarded. If not all
+ * input can be forwarded, flag this so comm_command_done() will signal us.
+ */
+static unsigned int input_forward_count( char last_input)
+{
+  int throttled;
+  if (stream_client == NULL || alt_stdin < 0) {
+    return 0;
+  }
+  unsigned int count = input_scan( &stream_client->in, last_input, &throttled);
+  if (throttled) {
+    input_throttled = 1;
+    __sync_synchronize();
+    // prevent lost wakeup if the parser finished a line meanwhile
+    count = input_scan( &stream_client->in, last_input, &throttled);
+  }
+  input_throttled = throttled;
+  return count;
+}
+
+/*
+ * Queue acknowledgements for lines entered into the command buffer.
+ * These are inserted into the output stream, but only at the start
+ * of a line so they won't end up inside a response.
+ * The line has not been checked yet, if the parser rejects it a resend
+ * request follows. The rejected line still releases its buffer entry
+ * (comm_command_done), so 'B:' stays correct for the resent lines.
+ */
+static void queue_acks( struct comm_client* c, int* acks_pending)
+{
+  while (*acks_pending > 0) {
+    char s[ 20];
+    int free_entries = ok_ahead_depth - (int)(lines_queued - lines_done);
+    int len = snprintf( s, sizeof( s), "ok B:%d\n", (free_entries > 0) ? free_entries : 0);
+    if (buffer_free( &c->out) < (unsigned int)len) {
+      break;
+    }
+    buffer_put( &c->out, s, len);
+    --*acks_pending;
+  }
+}
+
+/*
+ * Copy program output into the client's output buffer. With ok-ahead flow
+ * control the acknowledges are sent by us, the newline the parser emits
+ * after each command only terminates a response. Drop it if the command
+ * did not respond, so the host doesn't get an empty line for each command.
+ */
+static int output_fill( struct comm_client* c, int fd)
+{
+  char s[ 256];
+  unsigned int len = buffer_free( &c->out);
+  if (len > sizeof( s)) {
+    len = sizeof( s);
+  }
+  int cnt = read( fd, s, len);
+  for (int i = 0 ; i < cnt ; ++i) {
+    if (s[ i] == '\n' && c->out_at_bol && ok_ahead_depth) {
+      continue;
+    }
+    buffer_put( &c->out, &s[ i], 1);
+    c->out_at_bol = (s[ i] == '\n');
+  }
+  return cnt;
+}
+
+static void client_update_watch( struct comm_client* c)
+{
+  uint32_t in_events  = (!c->eof && buffer_free( &c->in) > 0) ? EPOLLIN : 0;
+  uint32_t out_events = (buffer_used( &c->out) > 0) ? EPOLLOUT : 0;
+  if (c->fd_in == c->fd_out) {
+    watch_set( &c->watch_in, in_events | out_events);
+  } else {
+    watch_set( &c->watch_in, in_events);
+    watch_set( &c->watch_out, out_events);
+  }
+}
+
+static void client_close( struct comm_client* c)
+{
+  if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
+    fprintf( stderr, "comm_thread: closing %s connection on fd %d\n",
+	     (c->role == e_role_stream) ? "stream" : "monitor", c->fd_in);
+  }
+  watch_remove( &c->watch_in);
+  close( c->fd_in);
+  if (c == stream_client) {
+    stream_client = NULL;
+    buffer_clear( &priority_replies);
+  }
+  c->role = e_role_free;
+  c->fd_in = c->fd_out = -1;
+}
+
+/*
+ * Accept a new connection, it gets the stream role if that's available.
+ */
+static void client_accept( int listen_fd)
+{
+  int fd = accept4( listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+  if (fd < 0) {
+    perror( "comm_thread: accept failed");
+    return;
+  }
+  for (int i = 0 ; i < MAX_CLIENTS ; ++i) {
+    struct comm_client* c = &clients[ i];
+    if (c->role == e_role_free) {
+      c->fd_in = c->fd_out = fd;
+      watch_init( &c->watch_in, fd, TAG_CLIENT_IN | i);
+      c->eof = 0;
+      c->out_at_bol = 1;
+      c->scan = 0;
+      buffer_clear( &c->in);
+      buffer_clear( &c->out);
+      if (stream_client == NULL) {
+        c->role = e_role_stream;
+        stream_client = c;
+      } else {
+        const char* s = "// monitor connection, read-only\n";
+        c->role = e_role_monitor;
+        buffer_put( &c->out, s, strlen( s));
+      }
+      if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
+        fprintf( stderr, "comm_thread: accepted %s connection on fd %d\n",
+		 (c->role == e_role_stream) ? "stream" : "monitor", fd);
+      }
+      client_update_watch( c);
+      return;
+    }
+  }
+  fprintf( stderr, "comm_thread: too many connections, refusing new one\n");
+  close( fd);
+}
+
+/*
+ * Check the new complete lines from the stream client for priority
+ * commands. A line that has been handled is removed from the input
+ * together with any line ends that follow it.
+ */
+static void client_scan_priority( struct comm_client* c)
+{
+  struct comm_buffer* b = &c->in;
+  unsigned int start = ((int)(c->scan - b->tail) < 0) ? b->tail : c->scan;
+  for (unsigned int i = start ; i != b->head ; ++i) {
+    if (!is_eol( b->data[ i % COMM_BUFFER_SIZE])) {
+      continue;
+    }
+    unsigned int len = i - start;
+    if (len > 0 && len < COMMAND_LINE_SIZE) {
+      char line[ COMMAND_LINE_SIZE];
+      char reply[ 128];
+      for (unsigned int j = 0 ; j < len ; ++j) {
+        line[ j] = b->data[ (start + j) % COMM_BUFFER_SIZE];
+      }
+      line[ len] = '\0';
+      int reply_len = gcode_priority_command( line, reply, sizeof( reply));
+      if (reply_len > 0) {
+        while (i + 1 != b->head && is_eol( b->data[ (i + 1) % COMM_BUFFER_SIZE])) {
+          ++i;
+        }
+        buffer_remove( b, start, i + 1 - start);
+        if (buffer_put( &priority_replies, reply, reply_len) != reply_len) {
+          fprintf( stderr, "comm_thread: priority reply lost\n");
+        }
+        if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
+          fprintf( stderr, "comm_thread: priority command '%s' executed\n", line);
+        }
+      }
+    }
+    start = i + 1;
+  }
+  c->scan = start;
+}
+
+/*
+ * Insert the priority replies into the output, only complete lines
+ * and only at the start of a line.
+ */
+static void queue_priority_replies( struct comm_client* c)
+{
+  unsigned int used = buffer_used( &priority_replies);
+  if (used > 0 && c->out_at_bol && buffer_free( &c->out) >= used) {
+    while (buffer_used( &priority_replies) > 0) {
+      char ch = buffer_peek( &priority_replies, 0);
+      buffer_put( &c->out, &ch, 1);
+      ++priority_replies.tail;
+    }
+  }
+}
+
+/*
+ * Answer the complete lines received from a monitor connection.
+ */
+static void client_process_queries( struct comm_client* c)
+{
+  while (buffer_used( &c->in) > 0) {
+    char line[ COMMAND_LINE_SIZE];
+    static char reply[ COMM_BUFFER_SIZE];	// M139 history replies are large
+    unsigned int used = buffer_used( &c->in);
+    unsigned int eol;
+    for (eol = 0 ; eol < used && !is_eol( buffer_peek( &c->in, eol)) ; ++eol) {
+    }
+    if (eol == used) {
+      if (buffer_free( &c->in) == 0) {
+        buffer_clear( &c->in);	// garbage, discard
+      }
+      return;
+    }
+    if (eol > 0) {
+      unsigned int len = (eol < sizeof( line)) ? eol : sizeof( line) - 1;
+      for (unsigned int i = 0 ; i < len ; ++i) {
+        line[ i] = buffer_peek( &c->in, i);
+      }
+      line[ len] = '\0';
+      int reply_len = gcode_monitor_query( line, reply, sizeof( reply));
+      if (buffer_free( &c->out) < (unsigned int)reply_len) {
+        return;	// retry when the reply fits
+      }
+      buffer_put( &c->out, reply, reply_len);
+    }
+    c->in.tail += eol + 1;
+  }
+}
+
+/*
+ * Handle input events for a client, returns -1 on EOF or error.
+ */
+static int client_read( struct comm_client* c)
+{
+  int cnt = buffer_fill( &c->in, c->fd_in);
+#if LL_DEBUG
+  fprintf( stderr, "client fd %d - read %d bytes\n", c->fd_in, cnt);
+#endif
+  if (cnt == 0 || (cnt < 0 && errno != EINTR && errno != EAGAIN)) {
+    return -1;
+  }
+  return 0;
+}
+
+static int client_write( struct comm_client* c)
+{
+  int cnt = buffer_drain( &c->out, c->fd_out, buffer_used( &c->out));
+  if (cnt < 0 && errno != EINTR && errno != EAGAIN) {
+    return -1;
+  }
+  return cnt;
+}
 
 static void* comm_thread( void* arg)
 {
   if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
     printf( "Socket connection keep-alive thread: started.");
   }
-  // read side of stdout pipe
-  fds[ e_stdout_readside].fd = alt_stdout;
-  fds[ e_stdout_readside].events = POLLIN;
-  // write side of system stdout
-  fds[ e_stdout_writeside].fd = fd_stdout;
-  fds[ e_stdout_writeside].events = 0;
-  // read side of system stdin
-  fds[ e_stdin_readside].fd = fd_stdin;
-  fds[ e_stdin_readside].events = POLLIN;
-  // write side of stdin pipe
-  fds[ e_stdin_writeside].fd = alt_stdin;
-  fds[ e_stdin_writeside].events = 0;
-
   const int keep_alive_timeout = 10000; /* 10 sec. in ms */
   const int timeout = 100; /* ms */
-  int output_pending = 0;
-  int input_pending = 0;
-  int eof_on_input = 0;
-  char pending_input;
-  char pending_output;
   int prescaler = 0;
   char keep_alive_char = config_keep_alive_char();
+  char last_input = 0;
+  int acks_pending = 0;
+  int ack_timeouts = 0;
+  int server_active = (listen_watch[ 0].fd >= 0 || listen_watch[ 1].fd >= 0);
+  struct timespec last_tick;
+  clock_gettime( CLOCK_MONOTONIC, &last_tick);
   /*
-   * The data from the stdout pipe does not become available until
-   * stdout is flushed. So the timer is set to a short cycle that
-   * flushes stdout with each timeout.
+   * Stdout is line buffered, so complete lines show up immediately.
+   * Partial lines are flushed by the periodic tick.
    */
   while (1) {
-    /* wait for event */
-    int rc = poll( fds, (eof_on_input) ? 2 : 4, timeout);
-#if LL_DEBUG
-    fprintf( stderr, "<poll result = %d\n", rc);
-    for (int i = 0 ; i < NR_ITEMS( fds) ; ++i) {
-      fprintf( stderr, "<poll result for fd: %d, events = 0x%08x, revents = 0x%08x\n", fds[ i].fd, fds[ i].events, fds[ i].revents);
+    struct epoll_event events[ 16];
+    struct comm_client* out = output_client();
+    unsigned int forward = input_forward_count( last_input);
+    int ready = 0;
+
+    watch_set( &app_output, (buffer_free( &out->out) > 0) ? EPOLLIN : 0);
+    watch_set( &app_input, (forward > 0) ? EPOLLOUT : 0);
+    client_update_watch( &console);
+    for (int i = 0 ; i < MAX_CLIENTS ; ++i) {
+      if (clients[ i].role != e_role_free) {
+        client_update_watch( &clients[ i]);
+      }
     }
-#endif
+    /* fds that can't be polled are always ready */
+    if ((console.watch_in.unpollable && console.watch_in.events) ||
+        (console.watch_out.unpollable && console.watch_out.events)) {
+      ready = 1;
+    }
+    /* wait for event */
+    int rc = epoll_wait( epoll_fd, events, NR_ITEMS( events), (ready) ? 0 : timeout);
     if (rc < 0 && errno != EINTR) {
-      perror( "comm_thread: poll() failed, bailing out!");
+      perror( "comm_thread: epoll_wait() failed, bailing out!");
       break;
-    } else if (rc == 0 || (rc < 0 && errno == EINTR)) {
+    }
+    if (ms_elapsed( &last_tick) >= timeout) {
+      clock_gettime( CLOCK_MONOTONIC, &last_tick);
       // timeout, send dummy character to keep connection alive
-      if (++prescaler > keep_alive_timeout / timeout) {
-        printf( "%c", keep_alive_char);
+      if (++prescaler > keep_alive_timeout / timeout && out->out_at_bol) {
+        buffer_put( &out->out, &keep_alive_char, 1);
         fprintf( stderr, "<KEEP ALIVE SENT>");
         prescaler = 0;
       }
@@ -92,108 +630,185 @@ static void* comm_thread( void* arg)
       fprintf( stderr, "<STDOUT FLUSH>");
 #endif
       fflush( stdout);
-    } else {
-      int events;
-      if (!eof_on_input) {
-      /****************************************
-       ***  I N P U T  -  R E A D  S I D E  ***
-       ****************************************/
-        events = fds[ e_stdin_readside].revents;
-        if (events & POLLIN) {
-          // stdin has input for stdin pipe
-          if (!input_pending) {
-            int cnt = read( fd_stdin, &pending_input, 1);
-            if (cnt == 1) {
-#if LL_DEBUG
-              fprintf( stderr, "stdin - processing '%c'\n", pending_input);
-#endif
-              fds[ e_stdin_readside].events = 0;
-              fds[ e_stdin_writeside].events = POLLOUT;
-              input_pending = 1;
-            } else if (cnt == 0) {
-              // EOF
-              fprintf( stderr, "comm_thread: EOF on STDIN, closing input pipe.\n");
-              close( alt_stdin); 
-              eof_on_input = 1;
-            }
-          }
-        } else if (events & POLLHUP) {
-          /* Ignore POLLHUP if we're not accepting input to prevent
-             characters from being dropped unintentionally */
-          if (fds[ e_stdin_readside].events & POLLIN) {
-            // write end was closed (EOF)
-            if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
-              fprintf( stderr, "comm_thread: HUP on STDIN, closing input pipe.\n");
-            }
-            close( alt_stdin); 
-            eof_on_input = 1;
+      /*
+       * If acknowledges are held back by an unterminated response line
+       * for too long, terminate that line to get the acknowledges out.
+       */
+      if (acks_pending && !out->out_at_bol && ++ack_timeouts > 1) {
+        if (buffer_put( &out->out, "\n", 1) == 1) {
+          out->out_at_bol = 1;
+        }
+      }
+    }
+    if (console.watch_in.unpollable && console.watch_in.events) {
+      events[ (rc > 0) ? rc : 0].events = EPOLLIN;
+      events[ (rc > 0) ? rc : 0].data.u32 = TAG_CLIENT_IN | TAG_CONSOLE;
+      rc = (rc > 0) ? rc + 1 : 1;
+    }
+    if (console.watch_out.unpollable && console.watch_out.events && rc < NR_ITEMS( events)) {
+      events[ (rc > 0) ? rc : 0].events = EPOLLOUT;
+      events[ (rc > 0) ? rc : 0].data.u32 = TAG_CLIENT_OUT | TAG_CONSOLE;
+      rc = (rc > 0) ? rc + 1 : 1;
+    }
+    for (int i = 0 ; i < rc ; ++i) {
+      uint32_t ev = events[ i].events;
+      unsigned int ix = events[ i].data.u32 & 0xFF;
+      struct comm_client* c = (ix == TAG_CONSOLE) ? &console : &clients[ ix];
+      switch (events[ i].data.u32 & ~0xFF) {
+      case TAG_DONE_EVENT: {
+        uint64_t count;
+        if (read( done_event, &count, sizeof( count)) < 0) {
+          perror( "comm_thread: eventfd read failed");
+        }
+        break;
+      }
+      case TAG_LISTEN:
+        client_accept( listen_watch[ ix].fd);
+        break;
+      case TAG_APP_OUTPUT:
+        /* stdout pipe has output (our program did write to stdout) */
+        if (ev & EPOLLIN) {
+          output_fill( out, alt_stdout);
+          if (out == &console && console.watch_out.fd < 0) {
+            buffer_clear( &out->out);	// nobody's listening, discard
           }
-        } else if (events) {
-          fprintf( stderr, "Poll on fd_stdin returns 0x%08x\n", events);
         }
-      /******************************************
-       ***  I N P U T  -  W R I T E  S I D E  ***
-       ******************************************/
-        events = fds[ e_stdin_writeside].revents;
-        if (events & POLLOUT) {
-          if (input_pending) {
-            int cnt = write( alt_stdin, &pending_input, 1);
-            if (cnt == 1) {
-              input_pending = 0;
-              fds[ e_stdin_readside].events = POLLIN;
-              fds[ e_stdin_writeside].events = 0;
+        break;
+      case TAG_APP_INPUT:
+        /* forward stream input to the stdin pipe */
+        if ((ev & EPOLLOUT) && stream_client && alt_stdin >= 0) {
+          struct comm_buffer* b = &stream_client->in;
+          unsigned int start = b->tail;
+          int cnt = buffer_drain( b, alt_stdin, forward);
+          if (cnt > 0 && ok_ahead_depth) {
+            // count the complete lines entered into the command buffer
+            for (unsigned int j = start ; j != b->tail ; ++j) {
+              char ch = b->data[ j % COMM_BUFFER_SIZE];
+              if (is_eol( ch) && !is_eol( last_input)) {
+                __sync_fetch_and_add( &lines_queued, 1);
+                ++acks_pending;
+              }
+              last_input = ch;
             }
           }
-        } else if (events) {
-          fprintf( stderr, "Poll on alt_stdin returns 0x%08x\n", events);
         }
-      }
-      /******************************************
-       ***  O U T P U T  -  R E A D  S I D E  ***
-       ******************************************/
-      events = fds[ e_stdout_readside].revents;
-      if (events & POLLIN) {
-        /* stdout pipe has output for stdout (our program did write to stdout) */
-        if (!output_pending) {
-          int cnt = read( alt_stdout, &pending_output, 1);
-          if (cnt == 1) {
-            output_pending = 1;
-            fds[ e_stdout_writeside].events = POLLOUT;
-            fds[ e_stdout_readside].events = 0;
-          }
+        break;
+      case TAG_CLIENT_IN:
+      case TAG_CLIENT_OUT:
+        if (c->role == e_role_free) {
+          break;	// closed while handling an earlier event
+        }
+        if ((ev & EPOLLOUT) && client_write( c) > 0) {
+          prescaler = 0;	// output acts as keep-alive!
         }
-      } else if (events) {
-        fprintf( stderr, "Poll on alt_stdout returns 0x%08x\n", events);
-      }
-      /********************************************
-       ***  O U T P U T  -  W R I T E  S I D E  ***
-       ********************************************/
-      events = fds[ e_stdout_writeside].revents;
-      if (events & POLLOUT) {
-        if (output_pending) {
-          int cnt = write( fd_stdout, &pending_output, 1);
-          if (cnt == 1) {
-            output_pending = 0;
-            fds[ e_stdout_writeside].events = 0;
-            fds[ e_stdout_readside].events = POLLIN;
-            prescaler = 0;	// output acts as keep-alive!
+        if (ev & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+          if ((events[ i].data.u32 & ~0xFF) == TAG_CLIENT_OUT) {
+            if (ev & (EPOLLHUP | EPOLLERR)) {
+              watch_remove( &c->watch_out);	// console output is gone
+              buffer_clear( &c->out);
+            }
+          } else if (client_read( c) < 0) {
+            if (c == &console) {
+              fprintf( stderr, "comm_thread: EOF on STDIN.\n");
+              c->eof = 1;
+              watch_remove( &c->watch_in);
+            } else if (c == stream_client && buffer_used( &c->in) > 0) {
+              // forward the remaining input before closing the connection
+              c->eof = 1;
+              watch_remove( &c->watch_in);
+            } else {
+              if (c == stream_client) {
+                acks_pending = 0;
+              }
+              client_close( c);
+            }
           }
         }
-      } else if (events) {
-        fprintf( stderr, "Poll on fd_stdout returns 0x%08x\n", events);
+        break;
+      }
+    }
+    for (int i = 0 ; i < MAX_CLIENTS ; ++i) {
+      if (clients[ i].role == e_role_monitor) {
+        client_process_queries( &clients[ i]);
+      }
+    }
+    if (stream_client) {
+      client_scan_priority( stream_client);
+    }
+    queue_priority_replies( output_client());
+    if (acks_pending && output_client()->out_at_bol) {
+      queue_acks( output_client(), &acks_pending);
+      ack_timeouts = 0;
+    }
+    /*
+     * When the stream client reached EOF and all its input has been forwarded,
+     * the stream is released for the next connection. Without a server
+     * the input pipe is closed, so the parser sees EOF too.
+     */
+    if (stream_client && stream_client->eof && buffer_used( &stream_client->in) == 0) {
+      acks_pending = 0;
+      if (stream_client != &console) {
+        client_close( stream_client);
+      } else if (server_active) {
+        stream_client = NULL;
+      } else if (alt_stdin >= 0) {
+        fprintf( stderr, "comm_thread: EOF on STDIN, closing input pipe.\n");
+        watch_remove( &app_input);
+        close( alt_stdin);
+        alt_stdin = -1;
       }
     }
   }
   pthread_exit( NULL);
 }
 
+/*
+ * Create a listening socket for either the TCP port or the Unix socket.
+ */
+static int server_listen( int port, const char* path)
+{
+  int fd;
+  int result;
+  if (path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy( addr.sun_path, path, sizeof( addr.sun_path) - 1);
+    unlink( path);
+    fd = socket( AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror( "comm_init: socket creation failed");
+      return -1;
+    }
+    result = bind( fd, (struct sockaddr*)&addr, sizeof( addr));
+  } else {
+    int one = 1;
+    struct sockaddr_in addr = {
+      .sin_family = AF_INET,
+      .sin_port = htons( port),
+      .sin_addr.s_addr = htonl( config_comm_tcp_public() ? INADDR_ANY : INADDR_LOOPBACK),
+    };
+    fd = socket( AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+      perror( "comm_init: socket creation failed");
+      return -1;
+    }
+    setsockopt( fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof( one));
+    result = bind( fd, (struct sockaddr*)&addr, sizeof( addr));
+  }
+  if (result < 0 || listen( fd, 4) < 0) {
+    perror( "comm_init: socket bind or listen failed");
+    close( fd);
+    return -1;
+  }
+  return fd;
+}
+
 static pthread_t worker;
 
 /*
  *  Fixup file descriptors so that all stdin and stdout of the application
  *  is piped to alt_stdout (for stdout) and alt_stdin (for stdin).
  *  Now we can watch and modify the datastream from and to the application.
- *  That allows us to insert keep-alive characters to keep socat happy!
+ *  That allows us to serve multiple clients and insert keep-alive characters.
  */
 int comm_init( void)
 {
@@ -201,6 +816,7 @@ int comm_init( void)
   int fds[ 2];
 
   // keep a copy of the program's original fds for stdin and stdout
+  fflush( stdout);
   fd_stdin  = fcntl( 0, F_DUPFD);
   fd_stdout = fcntl( 1, F_DUPFD);
   // Note on debug output: Because we're messing with stdout,
@@ -220,10 +836,14 @@ int comm_init( void)
   result = fcntl( fds[ 1], F_DUPFD);
   close( fds[ 1]);
   fds[ 1] = result;
+  // the application must block on a full pipe instead of losing output
+  fcntl( fds[ 1], F_SETFL, fcntl( fds[ 1], F_GETFL) & ~O_NONBLOCK);
   if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
     fprintf( stderr, "output pipe: output/read side fd = %d, input/write side fd = %d\n", fds[ 0], fds[ 1]);
   }
   alt_stdout = fds[ 0];
+  // flush on newline, so responses are sent out immediately
+  setvbuf( stdout, NULL, _IOLBF, BUFSIZ);
 
   // create the input pipe with all new fds
   // replace application's stdin descriptor (0) by read side of input pipe
@@ -237,11 +857,63 @@ int comm_init( void)
     fprintf( stderr, "input  pipe: output/read side fd = %d, input/write side fd = %d\n", fds[ 0], fds[ 1]);
   }
   alt_stdin = fds[ 1];
+  // the relay writes as much as fits
+  fcntl( alt_stdin, F_SETFL, fcntl( alt_stdin, F_GETFL) | O_NONBLOCK);
 
   if (DEBUG_COMM && (debug_flags & DEBUG_COMM)) {
     fprintf( stderr, "alt_stdin = %d, alt_stdout = %d\n", alt_stdin, alt_stdout);
   }
 
+  epoll_fd = epoll_create1( EPOLL_CLOEXEC);
+  if (epoll_fd < 0) {
+    perror( "comm_init: epoll creation failed");
+    return -1;
+  }
+  // a client that disconnects must not terminate the program
+  signal( SIGPIPE, SIG_IGN);
+
+  ok_ahead_depth = config_ok_ahead_depth();
+  if (ok_ahead_depth > 0) {
+    done_event = eventfd( 0, EFD_NONBLOCK);
+    if (done_event < 0) {
+      perror( "comm_init: eventfd creation failed");
+      return -1;
+    }
+    fprintf( stderr, "comm_init: ok-ahead flow control enabled, command buffer depth is %d\n", ok_ahead_depth);
+  }
+  watch_init( &app_output, alt_stdout, TAG_APP_OUTPUT);
+  watch_init( &app_input, alt_stdin, TAG_APP_INPUT);
+  watch_init( &done_watch, done_event, TAG_DONE_EVENT);
+  watch_set( &done_watch, EPOLLIN);
+
+  // the console holds the stream until it reaches EOF
+  console.role = e_role_stream;
+  console.fd_in = fd_stdin;
+  console.fd_out = fd_stdout;
+  console.out_at_bol = 1;
+  watch_init( &console.watch_in, fd_stdin, TAG_CLIENT_IN | TAG_CONSOLE);
+  watch_init( &console.watch_out, fd_stdout, TAG_CLIENT_OUT | TAG_CONSOLE);
+  stream_client = &console;
+  for (int i = 0 ; i < MAX_CLIENTS ; ++i) {
+    clients[ i].role = e_role_free;
+    clients[ i].fd_in = clients[ i].fd_out = -1;
+  }
+
+  int port = config_comm_tcp_port();
+  const char* path = config_comm_socket_path();
+  watch_init( &listen_watch[ 0], (port > 0) ? server_listen( port, NULL) : -1, TAG_LISTEN | 0);
+  watch_init( &listen_watch[ 1], (path && *path) ? server_listen( 0, path) : -1, TAG_LISTEN | 1);
+  for (int i = 0 ; i < 2 ; ++i) {
+    watch_set( &listen_watch[ i], EPOLLIN);
+  }
+  if (listen_watch[ 0].fd >= 0) {
+    fprintf( stderr, "comm_init: listening on TCP port %d (%s)\n", port,
+             config_comm_tcp_public() ? "all interfaces" : "loopback only");
+  }
+  if (listen_watch[ 1].fd >= 0) {
+    fprintf( stderr, "comm_init: listening on Unix socket '%s'\n", path);
+  }
+
   if (mendel_thread_create( "comm", &worker, NULL, &comm_thread, NULL) != 0) {
     return -1;
   }
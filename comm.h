@@ -4,5 +4,9 @@
 
 extern int comm_init( void);
 
+// ok-ahead flow control
+extern int comm_ok_ahead_active( void);
+extern void comm_command_done( void);
+
 
 #endif
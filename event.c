@@ -0,0 +1,56 @@
+#include <errno.h>
+
+#include "event.h"
+
+#define NS_PER_SEC  (1000*1000*1000)
+
+int event_init( event* e)
+{
+  pthread_condattr_t attr;
+  pthread_condattr_init( &attr);
+  pthread_condattr_setclock( &attr, CLOCK_MONOTONIC);
+  pthread_mutex_init( &e->lock, NULL);
+  int result = pthread_cond_init( &e->cond, &attr);
+  pthread_condattr_destroy( &attr);
+  e->seq = 0;
+  return (result == 0) ? 0 : -1;
+}
+
+unsigned int event_sequence( event* e)
+{
+  __sync_synchronize();
+  return e->seq;
+}
+
+void event_signal( event* e)
+{
+  pthread_mutex_lock( &e->lock);
+  ++e->seq;
+  pthread_cond_broadcast( &e->cond);
+  pthread_mutex_unlock( &e->lock);
+}
+
+int event_wait( event* e, unsigned int seq, const struct timespec* timeout)
+{
+  struct timespec deadline;
+  int result = 0;
+  if (timeout != NULL) {
+    clock_gettime( CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec  += timeout->tv_sec;
+    deadline.tv_nsec += timeout->tv_nsec;
+    if (deadline.tv_nsec >= NS_PER_SEC) {
+      deadline.tv_nsec -= NS_PER_SEC;
+      ++deadline.tv_sec;
+    }
+  }
+  pthread_mutex_lock( &e->lock);
+  while (e->seq == seq && result != ETIMEDOUT) {
+    if (timeout != NULL) {
+      result = pthread_cond_timedwait( &e->cond, &e->lock, &deadline);
+    } else {
+      pthread_cond_wait( &e->cond, &e->lock);
+    }
+  }
+  pthread_mutex_unlock( &e->lock);
+  return (result == ETIMEDOUT) ? -1 : 0;
+}
@@ -0,0 +1,30 @@
+#ifndef _EVENT_H
+#define _EVENT_H
+
+#include <pthread.h>
+#include <time.h>
+
+/*
+ * A simple event to wait for a condition that is set by another thread.
+ * Each signal increments a sequence number. A waiter reads the sequence
+ * number before it tests its condition and then waits until the number
+ * changes, so a signal between test and wait can't be missed:
+ *
+ *   unsigned int seq;
+ *   while (seq = event_sequence( &e), !condition) {
+ *     event_wait( &e, seq, NULL);
+ *   }
+ */
+typedef struct {
+  pthread_mutex_t	lock;
+  pthread_cond_t	cond;
+  volatile unsigned int	seq;
+} event;
+
+extern int event_init( event* e);
+extern unsigned int event_sequence( event* e);
+extern void event_signal( event* e);
+// 'timeout' is relative, NULL waits forever; returns -1 on timeout
+extern int event_wait( event* e, unsigned int seq, const struct timespec* timeout);
+
+#endif
@@ -4,11 +4,13 @@
 
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "gcode_parse.h"
 #include "debug.h"
 #include "gcode_process.h"
+#include "comm.h"
 
 
 // stubs that replace code from sersendf and sermsg:
@@ -35,12 +37,44 @@
 /// crude crc macro
 #define crc(a, b)		(a ^ b)
 
+/// CRC-16/XMODEM (polynomial 0x1021, initial value 0), the stronger alternative
+static uint16_t crc16(uint16_t crc, uint8_t c) {
+	crc ^= (uint16_t)c << 8;
+	for (int i = 0 ; i < 8 ; ++i) {
+		crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : (crc << 1);
+	}
+	return crc;
+}
+
 /// crude floating point data storage
 decfloat read_digit;
 
 /// this is where we store all the data for the current command before we work out what to do with it
 GCODE_COMMAND next_target;
 
+/// line number and checksum enforcement, can be changed with M296
+#ifdef	REQUIRE_LINENUMBER
+static uint8_t require_linenumber = 1;
+#else
+static uint8_t require_linenumber = 0;
+#endif
+#ifdef	REQUIRE_CHECKSUM
+static checksum_mode_e checksum_mode = e_checksum_xor;
+#else
+static checksum_mode_e checksum_mode = e_checksum_optional;
+#endif
+
+/// number of accepted lines directly preceding N_expected (at most RESEND_WINDOW)
+static uint32_t lines_in_window;
+/// set after a resend request, until the requested line arrives
+static uint8_t resend_pending;
+
+typedef enum {
+	e_line_accept,		///< process this line
+	e_line_duplicate,	///< line was processed before, acknowledge only
+	e_line_error,		///< corrupted or out of sequence, request resend
+} line_status_e;
+
 
 /*
 	decfloat_to_int() is the weakest subject to variable overflow. For evaluation, we assume a build room of +-1000 mm and NM_PER_MM_x between 1.000 and 4096. Accordingly for metric units:
@@ -73,6 +107,23 @@ GCODE_COMMAND next_target;
 
 /// Convert parsed floating point value (in mm or inch) to an integer in nm.
 
+/*
+	Scale of the S word, depends on the command. Used by both parsers, so
+	a command gives the same value from the ordered and the priority lane.
+*/
+static double s_word_scale( int seen_M, int M)
+{
+	if (seen_M && (M == 220 || M == 221)) {
+		// if this is a scaling factor, scale 1.0 to 1000
+		return 1000.0;
+	} else if (seen_M && M == 113) {
+		// if this is PWM output, scale 1.0 to 100(%)
+		return 100.0;
+	}
+	// if this is temperature, PID setting or anything else, scale 1:1
+	return 1.0;
+}
+
 static int32_t decfloat_to_int( decfloat *df, double multiplicand)
 {
 	double		r = df->mantissa;
@@ -93,6 +144,38 @@ static int32_t decfloat_to_int( decfloat *df, double multiplicand)
 }
 
 
+/// verify the checksum of the line just received, according to the selected mode
+static int checksum_ok(void) {
+	switch (checksum_mode) {
+	case e_checksum_xor:
+		return (next_target.seen_checksum && next_target.checksum_read == next_target.checksum_calculated);
+	case e_checksum_crc:
+		return (next_target.seen_checksum && next_target.checksum_read == next_target.crc_calculated);
+	default:
+		return (!next_target.seen_checksum || next_target.checksum_read == next_target.checksum_calculated);
+	}
+}
+
+/// determine what to do with the line just received
+static line_status_e check_line(void) {
+	if (!checksum_ok())
+		return e_line_error;
+	// without enforcement, N's are only used to track the expected line number
+	if (!require_linenumber)
+		return e_line_accept;
+	// M110 sets a new line number
+	if (next_target.seen_M && next_target.M == 110)
+		return e_line_accept;
+	if (!next_target.seen_N)
+		return e_line_error;
+	if (next_target.N == next_target.N_expected)
+		return e_line_accept;
+	// a host resending from an earlier line repeats lines that have been processed already
+	if (next_target.N < next_target.N_expected && next_target.N_expected - next_target.N <= lines_in_window)
+		return e_line_duplicate;
+	return e_line_error;
+}
+
 /// Character Received - add it to our command
 /// \param c the next character to process
 void gcode_parse_char(uint8_t c) {
@@ -102,6 +185,8 @@ void gcode_parse_char(uint8_t c) {
 	/// current or previous gcode word
 	/// for working out what to do with data just received
 	static uint8_t last_field = 0;
+	/// checksums are calculated over the characters as sent
+	uint8_t raw = c;
 
 	// uppercase
 	if (c >= 'a' && c <= 'z')
@@ -121,7 +206,7 @@ void gcode_parse_char(uint8_t c) {
 				case 'M':
 					next_target.M = read_digit.mantissa;
 					if (DEBUG_ECHO && (debug_flags & DEBUG_ECHO))
-						serwrite_uint8(next_target.M);
+						serwrite_uint16(next_target.M);
 					break;
 				case 'X':
 					if (next_target.option_inches)
@@ -166,16 +251,7 @@ void gcode_parse_char(uint8_t c) {
 						serwrite_uint32(next_target.target.F);
 					break;
 				case 'S':
-					if (next_target.seen_M && (next_target.M == 220 || next_target.M == 221)) {
-						// if this is a scaling factor, scale 1.0 to 1000
-						next_target.S = decfloat_to_int( &read_digit, 1000.0);
-					} else if (next_target.seen_M && (next_target.M == 113)) {
-						// if this is PWM output, scale 1.0 to 100(%)
-						next_target.S = decfloat_to_int( &read_digit, 100.0);
-					} else {
-						// if this is temperature, PID setting or anything else, scale 1:1
-						next_target.S = decfloat_to_int( &read_digit, 1.0);
-					}
+					next_target.S = decfloat_to_int( &read_digit, s_word_scale( next_target.seen_M, next_target.M));
 					if (DEBUG_ECHO && (debug_flags & DEBUG_ECHO))
 						serwrite_uint16(next_target.S);
 					break;
@@ -315,47 +391,53 @@ void gcode_parse_char(uint8_t c) {
 	} else if ( next_target.seen_parens_comment == 1 && c == ')')
 		next_target.seen_parens_comment = 0; // recognize stuff after a (comment)
 
-	if (next_target.seen_checksum == 0)
-		next_target.checksum_calculated = crc(next_target.checksum_calculated, c);
+	if (next_target.seen_checksum == 0) {
+		next_target.checksum_calculated = crc(next_target.checksum_calculated, raw);
+		next_target.crc_calculated = crc16(next_target.crc_calculated, raw);
+	}
 
 	// end of line
 	if (((c == 10) || (c == 13)) && (newline == 0)) {
 		if (DEBUG_ECHO && (debug_flags & DEBUG_ECHO))
 			serial_writechar(c);
 
-		if (
-		#ifdef	REQUIRE_LINENUMBER
-			((next_target.N >= next_target.N_expected) && (next_target.seen_N == 1)) ||
-			(next_target.seen_M && (next_target.M == 110))
-		#else
-			1
-		#endif
-			) {
-			if (
-				#ifdef	REQUIRE_CHECKSUM
-				((next_target.checksum_calculated == next_target.checksum_read) && (next_target.seen_checksum == 1))
-				#else
-				((next_target.checksum_calculated == next_target.checksum_read) || (next_target.seen_checksum == 0))
-				#endif
-				) {
-				// process
+		switch (check_line()) {
+		case e_line_accept:
+			// process, with ok-ahead flow control the 'ok' has been sent already
+			// and the newline only terminates a response (comm drops empty lines).
+			if (!comm_ok_ahead_active())
 				serial_writestr_P( "ok ");
-				process_gcode_command();
-				serial_writechar('\n');
-
-				// expect next line number
-				if (next_target.seen_N == 1)
-					next_target.N_expected = next_target.N + 1;
-			}
-			else {
-				printf( "rs N%d Expected checksum %d\n", next_target.N_expected, next_target.checksum_calculated);
-// 				request_resend();
+			process_gcode_command();
+			serial_writechar('\n');
+
+			// expect next line number
+			if (next_target.seen_N == 1) {
+				// M110 and lines out of sequence (if not enforced) start a new window
+				if ((next_target.seen_M && next_target.M == 110) || next_target.N != next_target.N_expected)
+					lines_in_window = 0;
+				if (lines_in_window < RESEND_WINDOW)
+					++lines_in_window;
+				next_target.N_expected = next_target.N + 1;
 			}
+			resend_pending = 0;
+			break;
+		case e_line_duplicate:
+			if (!comm_ok_ahead_active())
+				serial_writestr_P( "ok\n");
+			break;
+		case e_line_error:
+			// when streaming ahead, lines following a corrupted one arrive before
+			// the resent line does, only the first error needs to be reported.
+			if (resend_pending && comm_ok_ahead_active() &&
+					(next_target.seen_N == 0 || next_target.N != next_target.N_expected))
+				break;
+			request_resend();
+			resend_pending = 1;
+			break;
 		}
-		else {
-			printf( "rs N%d Expected line number %d\n", next_target.N_expected, next_target.N_expected);
-// 			request_resend();
-		}
+
+		// frees an entry in the command buffer
+		comm_command_done();
 
 		// reset variables
 		next_target.seen_X = next_target.seen_Y = next_target.seen_Z = \
@@ -363,7 +445,7 @@ void gcode_parse_char(uint8_t c) {
 			next_target.seen_P = next_target.seen_T = next_target.seen_N = \
 			next_target.seen_M = next_target.seen_checksum = next_target.seen_semi_comment = \
 			next_target.seen_parens_comment = next_target.checksum_read = \
-			next_target.checksum_calculated = 0;
+			next_target.checksum_calculated = next_target.crc_calculated = 0;
 		// last_field and read_digit are reset above already
 
 		// assume a G1 by default
@@ -391,12 +473,84 @@ void gcode_parse_char(uint8_t c) {
 *                                                                           *
 * Request a resend of the current line - used from various places.          *
 *                                                                           *
-* Relies on the global variable next_target.N being valid.                  *
+* Relies on the global variable next_target.N_expected being valid.         *
 *                                                                           *
 \***************************************************************************/
 
+// With ok-ahead flow control the line has been acknowledged already, the
+// 'rs' cancels that 'ok': the line is not executed and must be resent.
 void request_resend(void) {
-	serial_writestr_P( "rs ");
-	serwrite_uint8( next_target.N);
+	serial_writestr_P( "rs N");
+	serwrite_uint32( next_target.N_expected);
 	serial_writechar( '\n');
 }
+
+/***************************************************************************\
+*                                                                           *
+* Select line number and checksum enforcement (M296).                       *
+*                                                                           *
+\***************************************************************************/
+
+void gcode_parse_set_protocol(int linenumber, int mode) {
+	if (linenumber >= 0)
+		require_linenumber = (linenumber) ? 1 : 0;
+	if (mode >= e_checksum_optional && mode <= e_checksum_crc)
+		checksum_mode = mode;
+	lines_in_window = 0;
+	resend_pending = 0;
+}
+
+/***************************************************************************\
+*                                                                           *
+* Parse a complete line that holds a single M command with optional N, S    *
+* and P words. Comments and the checksum are skipped. This does not touch   *
+* the state of the main parser, so it can be used from other threads.       *
+*                                                                           *
+* Returns 0 if the line holds such a command, -1 otherwise.                 *
+*                                                                           *
+\***************************************************************************/
+
+int gcode_parse_simple(const char* line, SIMPLE_COMMAND* cmd) {
+	const char* p = line;
+	int seen_M = 0;
+
+	memset(cmd, 0, sizeof(*cmd));
+	while (*p && *p != '*' && *p != ';' && *p != '(' && *p != 10 && *p != 13) {
+		char c = *p++;
+		char* end;
+		double value;
+
+		if (c == ' ' || c == '\t')
+			continue;
+		if (c >= 'a' && c <= 'z')
+			c &= ~32;
+		value = strtod(p, &end);
+		if (end == p)
+			return -1;
+		p = end;
+		switch (c) {
+			case 'N':
+				cmd->seen_N = 1;
+				cmd->N = value;
+				break;
+			case 'M':
+				seen_M = 1;
+				cmd->M = value;
+				break;
+			case 'S':
+				cmd->seen_S = 1;
+				cmd->S = value;
+				break;
+			case 'P':
+				cmd->seen_P = 1;
+				cmd->P = value;
+				break;
+			default:
+				return -1;
+		}
+	}
+	if (!seen_M)
+		return -1;
+	cmd->S *= s_word_scale( seen_M, cmd->M);
+	return 0;
+}
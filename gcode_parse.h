@@ -12,13 +12,23 @@ typedef struct {
 	uint32_t					F;
 } TARGET;
 
-// wether to insist on N line numbers
-// if not defined, N's are completely ignored
+// wether to insist on N line numbers by default
+// if not defined, N's are ignored until enabled with M296
 //#define	REQUIRE_LINENUMBER
 
-// wether to insist on a checksum
+// wether to insist on a (XOR) checksum by default
 //#define	REQUIRE_CHECKSUM
 
+/// checksum enforcement, selectable at runtime
+typedef enum {
+	e_checksum_optional = 0,	///< check the XOR checksum only if present
+	e_checksum_xor,			///< require the classic XOR checksum
+	e_checksum_crc,			///< require a CRC-16/XMODEM checksum
+} checksum_mode_e;
+
+/// number of accepted lines remembered to recognize resent duplicates
+#define	RESEND_WINDOW	64
+
 /// this is a very crude decimal-based floating point structure.
 /// a real floating point would at least have signed exponent.\n
 /// resulting value is \f$ mantissa * 10^{-(exponent - 1)} * ((sign * 2) - 1)\f$
@@ -54,7 +64,7 @@ typedef struct {
   };
 
   uint8_t		G;			///< G command number
-  uint8_t		M;			///< M command number
+  uint16_t		M;			///< M command number
   TARGET		target;			///< target position: X, Y, Z, E and F
 
   int16_t		S;			///< S word (various uses)
@@ -65,17 +75,35 @@ typedef struct {
   uint32_t		N;			///< line number
   uint32_t		N_expected;		///< expected line number
 
-  uint8_t		checksum_read;		///< checksum in gcode command
+  uint16_t		checksum_read;		///< checksum in gcode command
   uint8_t		checksum_calculated;	///< checksum we calculated
+  uint16_t		crc_calculated;		///< CRC-16 we calculated
 } GCODE_COMMAND;
 
+/// result of gcode_parse_simple(), a single M command with optional words
+typedef struct {
+  uint8_t		seen_N;
+  uint8_t		seen_S;
+  uint8_t		seen_P;
+  uint32_t		N;			///< line number
+  uint16_t		M;			///< M command number
+  double		S;			///< S word, scaled like next_target.S
+  double		P;			///< P word, not scaled
+} SIMPLE_COMMAND;
+
 /// the command being processed
 extern GCODE_COMMAND next_target;
 
 /// accept the next character and process it
 void gcode_parse_char(uint8_t c);
 
-// uses the global variable next_target.N
+// uses the global variable next_target.N_expected
 void request_resend(void);
 
+/// parse a complete line holding a single M command, independent of the main parser
+int gcode_parse_simple(const char* line, SIMPLE_COMMAND* cmd);
+
+/// select line number and checksum enforcement, a negative value leaves a setting unchanged
+void gcode_parse_set_protocol(int require_linenumber, int checksum_mode);
+
 #endif	/* _GCODE_PARSE_H */
@@ -7,6 +7,7 @@
 #include <math.h>
 #include <unistd.h>
 #include <stdint.h>
+#include <pthread.h>
 
 #include "bebopr.h"
 #include "gcode_process.h"
@@ -20,6 +21,9 @@
 #include "heater.h"
 #include "mendel.h"
 #include "limit_switches.h"
+#include "history.h"
+#include "bed_mesh.h"
+#include "seqlock.h"
 
 /// the current tool
 static uint8_t tool;
@@ -34,6 +38,13 @@ static TARGET gcode_current_pos;
 //  gcode coordinates to machine / PRUSS coordinates.
 static TARGET gcode_home_pos;
 static double gcode_initial_feed;
+//  Copy of gcode_current_pos for the monitor connections (comm thread),
+//  published after each command.
+static seqlatch position_latch;
+static TARGET position_copies[ 2];
+//  Axes (bit 1 << axis_e) with a position referenced by a home switch,
+//  cleared when the motors are disabled.
+static unsigned int gcode_axes_homed = 0;
 /*
  * Local copy of channel tags to prevent a lookup with each access.
  */
@@ -42,6 +53,7 @@ static channel_tag heater_bed = NULL;
 static channel_tag temp_extruder = NULL;
 static channel_tag temp_bed = NULL;
 static channel_tag pwm_extruder = NULL;
+static channel_tag pwm_fan = NULL;
 
 static int extruder_temp_wait = 0;
 static int bed_temp_wait = 0;
@@ -55,10 +67,13 @@ static void wait_for_slow_signals( void)
   if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
     printf( "defer move until temperature is stable!\n");
   }
-  while ( (extruder_temp_wait && !heater_temp_reached( heater_extruder)) ||
+  event* e = temp_get_event();
+  unsigned int seq;
+  while ( seq = event_sequence( e),
+	  (extruder_temp_wait && !heater_temp_reached( heater_extruder)) ||
 	  (bed_temp_wait && !heater_temp_reached( heater_bed)) )
   {
-    usleep( 100000);
+    event_wait( e, seq, NULL);
   }
   extruder_temp_wait = 0;
   bed_temp_wait = 0;
@@ -67,6 +82,271 @@ static void wait_for_slow_signals( void)
   }
 }
 
+/*
+ *  Format the temperatures reported by M105. Without 'select', both
+ *  extruder and bed are reported, otherwise only the selected one.
+ */
+static int format_temperatures( char* s, int size, int select)
+{
+  double celsius;
+  int len = 0;
+  if (select >= 0) {
+    channel_tag temp_source;
+    switch (select) {
+    case 0:  temp_source = heater_extruder; break;
+    case 1:  temp_source = heater_bed; break;
+    default: temp_source = NULL;
+    }
+    if (heater_get_celsius( temp_source, &celsius) == 0) {
+      len = snprintf( s, size, "T:%1.1lf", celsius);
+    }
+  } else {
+    heater_get_celsius( heater_extruder, &celsius);
+    len = snprintf( s, size, "T:%1.1lf", celsius);
+    if (heater_bed != NULL && len < size) {
+      heater_get_celsius( heater_bed, &celsius);
+      len += snprintf( s + len, size - len, " B:%1.1lf", celsius);
+    }
+  }
+  return len;
+}
+
+static int hex_value( double value, double unit, int max)
+{
+  int v = (int)(value / unit + 0.5);
+  return (v < 0) ? 0 : (v > max) ? max : v;
+}
+
+/*
+ *  Format the history of the last 'seconds' of a heater, from the finest
+ *  tier that covers that period. The samples are fixed width hex values,
+ *  oldest first: 3 digits temperature and 2 digits output, in units of
+ *  0.25 celsius and 0.5 %. The setpoint is only sent when it changes,
+ *  as '=' followed by 3 digits in 0.25 celsius. If the reply doesn't fit,
+ *  the oldest samples are left out.
+ */
+static int format_history( char* s, int size, int select, double seconds)
+{
+  // per call, the G-code and comm threads can both be here
+  history_sample samples[ 720];
+  channel_tag heater;
+  int tier;
+  int age;
+  switch (select) {
+  case 0:  heater = heater_extruder; break;
+  case 1:  heater = heater_bed; break;
+  default: heater = NULL;
+  }
+  for (tier = 0 ; tier < history_nr_tiers - 1 ; ++tier) {
+    if (seconds <= history_tiers[ tier].resolution * history_tiers[ tier].length) {
+      break;
+    }
+  }
+  int n = (int)(seconds / history_tiers[ tier].resolution + 0.5);
+  n = history_query( heater, tier, samples, (n < NR_ITEMS( samples)) ? n : NR_ITEMS( samples), &age);
+  if (n < 0) {
+    return snprintf( s, size, "E:no history");
+  }
+  for (int first = 0 ; ; first += (n - first + 9) / 10) {
+    int len = snprintf( s, size, "H:%d R:%d N:%d A:%d D:", select, history_tiers[ tier].resolution, n - first, age);
+    int setpoint = -1;
+    for (int i = first ; i < n && len < size ; ++i) {
+      int sp = hex_value( samples[ i].setpoint, 0.25, 0xFFF);
+      if (sp != setpoint) {
+        setpoint = sp;
+        len += snprintf( s + len, size - len, "=%03x", sp);
+      }
+      if (len < size) {
+        len += snprintf( s + len, size - len, "%03x%02x",
+			 hex_value( samples[ i].celsius, 0.25, 0xFFF), hex_value( samples[ i].duty_cycle, 0.5, 0xFF));
+      }
+    }
+    if (len < size - 1 || first >= n) {
+      return len;
+    }
+  }
+}
+
+static int format_position( char* s, int size, const TARGET* pos)
+{
+  return snprintf( s, size, "current: X=%1.6lf, Y=%1.6lf, Z=%1.6lf, E=%1.6lf, F=%d",
+		   POS2MM( pos->X), POS2MM( pos->Y), POS2MM( pos->Z), POS2MM( pos->E), pos->F);
+}
+
+static void publish_position( void)
+{
+  seqlatch_write( &position_latch, position_copies, &gcode_current_pos, sizeof( gcode_current_pos));
+}
+
+static int format_capabilities( char* s, int size)
+{
+  return snprintf( s, size, "FIRMWARE_NAME: BeBoPr FIRMWARE_URL:https//github.com/modmaker/BeBoPr/ PROTOCOL_VERSION:1.0 MACHINE_TYPE:Mendel EXTRUDER_COUNT:%d TEMP_SENSOR_COUNT:%d HEATER_COUNT:%d", 1, 2, 2);
+}
+
+static int format_endstops( char* s, int size)
+{
+  static const char axis_names[] = { 'x', 'y', 'z' };	// FIXME: this uses knowledge of axis_e
+  int len = 0;
+  for (axis_e axis = x_axis ; axis <= z_axis && len < size ; ++axis) {
+    if (config_axis_has_min_limit_switch( axis)) {
+      len += snprintf( s + len, size - len, "%c_min:%d ", axis_names[ axis], limsw_min( axis));
+    }
+    if (config_axis_has_max_limit_switch( axis) && len < size) {
+      len += snprintf( s + len, size - len, "%c_max:%d ", axis_names[ axis], limsw_max( axis));
+    }
+  }
+  if (len == 0) {
+    len = snprintf( s, size, "no endstops defined");
+  }
+  return len;
+}
+
+/*
+ *  Limit switch statistics: for each switch that changed, the number of edges,
+ *  the number of bounces and the longest burst of bounces in ms. Followed by
+ *  the histogram of the watcher's read times, bin n counts times below 2^n us.
+ */
+static int format_limsw_stats( char* s, int size)
+{
+  limsw_stats stats;
+  int len = 0;
+  int i;
+
+  limsw_get_stats( &stats);
+  for (i = 0 ; i < NR_LIMIT_SWITCHES && len < size ; ++i) {
+    limsw_switch_stats* sw = &stats.sw[ i];
+    if (sw->edges > 0) {
+      len += snprintf( s + len, size - len, "%s:%u/%u/%1.1lf ",
+		       limsw_name( i), sw->edges, sw->bounces, 1000.0 * sw->max_burst);
+    }
+  }
+  for (i = 0 ; i < LIMSW_READ_TIME_BINS && len < size ; ++i) {
+    len += snprintf( s + len, size - len, "%s%u", (i == 0) ? "R:" : ",", stats.read_time[ i]);
+  }
+  return len;
+}
+
+/*
+ *  The last 'count' limit switch edges, oldest first, as
+ *  switch=state@time[s]/read time[us]/PRUSS cycle counter
+ */
+static int format_limsw_events( char* s, int size, int count)
+{
+  limsw_event events[ 32];
+  int len = 0;
+  int i;
+
+  if (count > (int) NR_ITEMS( events)) {
+    count = NR_ITEMS( events);
+  }
+  count = limsw_get_events( events, count);
+  for (i = 0 ; i < count && len < size ; ++i) {
+    limsw_event* e = &events[ i];
+    len += snprintf( s + len, size - len, "%s%s=%d@%ld.%06ld/%u/%u", (i == 0) ? "" : " ",
+		     limsw_name( e->limsw), e->state, (long) e->time.tv_sec, e->time.tv_nsec / 1000,
+		     e->read_time / 1000, e->pru_cycles);
+  }
+  return len;
+}
+
+/*
+ *  M200 reply: the endstop states, optionally the statistics (S1) and the last P edges.
+ */
+static int format_limsw_report( char* s, int size, int stats, int count)
+{
+  int len = format_endstops( s, size);
+  if (stats && len < size) {
+    len += snprintf( s + len, size - len, " ");
+    len += format_limsw_stats( s + len, size - len);
+  }
+  if (count > 0 && len < size) {
+    len += snprintf( s + len, size - len, " E:");
+    len += format_limsw_events( s + len, size - len, count);
+  }
+  return len;
+}
+
+/*
+ *  Set the speed (M220) or extruder (M221) override, S is in promille.
+ *  This is called from both the ordered command path and the priority lane.
+ */
+static void set_override( int mcode, double S)
+{
+  double old;
+  double factor = 0.001 * S;
+  if (factor < 0.001) {
+    factor = 0.001;
+  }
+  if (mcode == 220) {
+    old = traject_set_speed_override( factor);
+  } else {
+    old = traject_set_extruder_override( factor);
+  }
+  if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
+    fprintf( stderr, "M%d: set %s override factor to %1.3lf, old value was %1.3lf\n",
+      mcode, (mcode == 221) ? "extruder" : "speed", factor, old);
+  }
+}
+
+#ifdef PRU_ABS_COORDS
+/*
+ *  With an active bed mesh the move is split where it crosses the mesh
+ *  grid lines and the Z offset of the bed is added at every split point.
+ */
+static void enqueue_compensated( const traject5D* traj)
+{
+  double t[ BED_MESH_MAX_SPLITS];
+  int n = bed_mesh_split( traj->x0, traj->y0, traj->x1, traj->y1, t, NR_ITEMS( t));
+  double xs = traj->x0;
+  double ys = traj->y0;
+  double zs = traj->z0 + bed_mesh_offset( xs, ys);
+  double es = traj->e0;
+
+  for (int i = 0 ; i <= n ; ++i) {
+    double te = (i < n) ? t[ i] : 1.0;
+    double xe = traj->x0 + te * (traj->x1 - traj->x0);
+    double ye = traj->y0 + te * (traj->y1 - traj->y0);
+    double ze = traj->z0 + te * (traj->z1 - traj->z0) + bed_mesh_offset( xe, ye);
+    double ee = traj->e0 + te * (traj->e1 - traj->e0);
+    traject5D part = {
+      .x0 = xs, .y0 = ys, .z0 = zs, .e0 = es,
+      .x1 = xe, .y1 = ye, .z1 = ze, .e1 = ee,
+      .feed = traj->feed,
+    };
+    traject_delta_on_all_axes( &part);
+    xs = xe;
+    ys = ye;
+    zs = ze;
+    es = ee;
+  }
+}
+#endif
+
+/*
+ *  Filament feed rate [mm/s] last queued for the extruder heater's model,
+ *  applied as the PRUSS starts on the move.
+ *  The feeder clears the load once all moves are done, load_lock keeps it
+ *  from doing that while a move is being queued.
+ */
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static double queued_load = 0.0;
+
+static int set_extruder_load( int handle, double load)
+{
+  return heater_set_load( heater_extruder, load);
+}
+
+static int clear_extruder_load( int handle, double load)
+{
+  if (pthread_mutex_trylock( &load_lock) != 0) {
+    return -1;		// a move is being queued, retry later
+  }
+  queued_load = 0.0;
+  heater_set_load( heater_extruder, 0.0);
+  pthread_mutex_unlock( &load_lock);
+  return 0;
+}
+
 /*
  *  make a move to new 'target' position, at the end of this move 'target'
  *  should reflect the actual position.
@@ -104,8 +384,45 @@ static void enqueue_pos( TARGET* target)
       .feed = target->F,
     };
 #endif
+    /*
+     * Tell the extruder heater how much filament this move will feed, so
+     * the model based controller can add the power that takes. The load
+     * is applied when the move starts and cleared when motion stops.
+     */
+    double dx = (double)1.0E-9 * (target->X - gcode_current_pos.X);
+    double dy = (double)1.0E-9 * (target->Y - gcode_current_pos.Y);
+    double dz = (double)1.0E-9 * (target->Z - gcode_current_pos.Z);
+    double de = (double)1.0E-9 * (target->E - gcode_current_pos.E);
+    double distance = sqrt( dx * dx + dy * dy + dz * dz);
+    double feed_rate = target->F / 60.0;
+    double filament_rate = 0.0;
+    if (de > 0.0) {
+      filament_rate = (distance > 0.0) ? de * feed_rate / distance : feed_rate;
+    }
+    pthread_mutex_lock( &load_lock);
+    if (filament_rate != queued_load) {
+      pruss_queue_marker_action( set_extruder_load, 0, filament_rate);
+      queued_load = filament_rate;
+    }
     /* make the move */
+#ifdef PRU_ABS_COORDS
+    if (bed_mesh_active()) {
+      enqueue_compensated( &traj);
+    } else {
+      traject_delta_on_all_axes( &traj);
+    }
+#else
+    if (bed_mesh_active()) {
+      // relative moves are not split, only the net change of the offset is added
+      traj.dz += bed_mesh_offset( 1.0E-9 * (gcode_home_pos.X + target->X), 1.0E-9 * (gcode_home_pos.Y + target->Y))
+	       - bed_mesh_offset( 1.0E-9 * (gcode_home_pos.X + gcode_current_pos.X), 1.0E-9 * (gcode_home_pos.Y + gcode_current_pos.Y));
+    }
     traject_delta_on_all_axes( &traj);
+#endif
+    if (queued_load != 0.0) {
+      pruss_queue_idle_action( clear_extruder_load, 0, 0.0);
+    }
+    pthread_mutex_unlock( &load_lock);
     /*
      * For a 3D printer, the E-axis controls the extruder and for that axis
      * the +/- 2000 mm operating range is not sufficient as this axis moves
@@ -166,9 +483,120 @@ void clip_move( axis_e axis, int32_t* pnext_target, int32_t current_pos, int32_t
 	}
 }
 
+/*
+ * After an abort the axes stopped somewhere along the queued moves,
+ * read back where they are so we can continue without homing again.
+ */
+static void resync_after_abort( void)
+{
+	int32_t pos[ 4];
+
+	traject_abort_clear();
+	for (int axis = 1 ; axis <= 4 ; ++axis) {
+		pruss_get_positions( axis, &pos[ axis - 1], NULL);
+	}
+	gcode_current_pos.X = pos[ 0] - gcode_home_pos.X;
+	gcode_current_pos.Y = pos[ 1] - gcode_home_pos.Y;
+	gcode_current_pos.Z = pos[ 2] - gcode_home_pos.Z;
+	gcode_current_pos.E = pos[ 3] - gcode_home_pos.E;
+	// the steppers include the bed compensation, the G-code position does not
+	gcode_current_pos.Z -= SI2POS( bed_mesh_offset( POS2SI( pos[ 0]), POS2SI( pos[ 1])));
+	if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
+		printf( "resync_after_abort: position is now X=%1.3lf Y=%1.3lf Z=%1.3lf E=%1.3lf\n",
+			POS2MM( gcode_current_pos.X), POS2MM( gcode_current_pos.Y),
+			POS2MM( gcode_current_pos.Z), POS2MM( gcode_current_pos.E));
+	}
+}
+
+/*
+ * Collect the machine positions of the axes selected for homing,
+ * positions[] is NULL for an axis that is not selected.
+ */
+static void select_home_axes( int32_t machine_pos[ 3], int32_t* positions[ 3])
+{
+	if (next_target.seen_X) {
+		machine_pos[ 0] = gcode_current_pos.X + gcode_home_pos.X;
+		positions[ 0] = &machine_pos[ 0];
+	}
+	if (next_target.seen_Y) {
+		machine_pos[ 1] = gcode_current_pos.Y + gcode_home_pos.Y;
+		positions[ 1] = &machine_pos[ 1];
+	}
+	if (next_target.seen_Z) {
+		machine_pos[ 2] = gcode_current_pos.Z + gcode_home_pos.Z;
+		positions[ 2] = &machine_pos[ 2];
+	}
+}
+
+/*
+ * Probe the bed on the configured grid with the Z minimum switch and store
+ * the measured heights as bed mesh. The probing itself is done without
+ * compensation. Returns 0 on success.
+ */
+static int probe_bed( void)
+{
+	double x0, y0, x1, y1;
+	int nx, ny;
+	TARGET t = gcode_current_pos;
+
+	if (!config_probe_grid( &x0, &y0, &x1, &y1, &nx, &ny) || !config_axis_has_min_limit_switch( z_axis)) {
+		printf( "error: no bed probe configured");
+		return -1;
+	}
+	// the grid is in machine coordinates
+	if ((gcode_axes_homed & ((1 << x_axis) | (1 << y_axis) | (1 << z_axis))) !=
+	    ((1 << x_axis) | (1 << y_axis) | (1 << z_axis))) {
+		printf( "error: home the X, Y and Z axes first");
+		return -1;
+	}
+	if (bed_mesh_setup( x0, y0, x1, y1, nx, ny) < 0) {
+		printf( "error: invalid probe grid");
+		return -1;
+	}
+	int32_t clearance = SI2POS( config_probe_clearance());
+	for (int iy = 0 ; iy < ny ; ++iy) {
+		for (int k = 0 ; k < nx ; ++k) {
+			int ix = (iy & 1) ? nx - 1 - k : k;	// serpentine order
+			double x, y;
+			bed_mesh_get_point( ix, iy, &x, &y);
+			// travel at clearance height to the probe point
+			t.X = SI2POS( x) - gcode_home_pos.X;
+			t.Y = SI2POS( y) - gcode_home_pos.Y;
+			t.Z = clearance - gcode_home_pos.Z;
+			t.F = config_probe_travel_feed();
+			enqueue_pos( &t);
+			gcode_current_pos = t;
+			// probe in machine coordinates
+			int32_t z = gcode_home_pos.Z + gcode_current_pos.Z;
+			if (!probe_axis_to_min_switch( z_axis, &z, config_probe_clearance() + config_probe_depth(),
+						       config_probe_feed())) {
+				gcode_current_pos.Z = z - gcode_home_pos.Z;
+				printf( "error: no bed found at X=%1.3lf Y=%1.3lf", SI2MM( x), SI2MM( y));
+				bed_mesh_restore();
+				return -1;
+			}
+			bed_mesh_set_point( ix, iy, POS2SI( z));
+			if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
+				fprintf( stderr, "G29: bed at X=%1.3lf Y=%1.3lf is at Z=%1.3lf [mm]\n",
+					 SI2MM( x), SI2MM( y), POS2MM( z));
+			}
+			gcode_current_pos.Z = z - gcode_home_pos.Z;
+			t = gcode_current_pos;
+			t.Z = clearance - gcode_home_pos.Z;
+			enqueue_pos( &t);
+			gcode_current_pos = t;
+		}
+	}
+	bed_mesh_finish();
+	return 0;
+}
+
 void process_gcode_command() {
 	uint32_t	backup_f;
 
+	if (traject_abort_pending()) {
+		resync_after_abort();
+	}
 	if (next_target.seen_F) {
 		gcode_initial_feed = next_target.target.F;
 	} else {
@@ -271,9 +699,10 @@ void process_gcode_command() {
 				//?
 				//? In this case sit still doing nothing for 200 milliseconds.  During delays the state of the machine (for example the temperatures of its extruders) will still be preserved and controlled.
 				//?
+				//? The dwell is queued behind the preceding moves, processing of the next
+				//? commands continues immediately.
 
-				traject_wait_for_completion();
-				usleep( 1000* next_target.P);
+				traject_dwell( 0.001 * next_target.P);
 				break;
 
 				//	G20 - inches as units
@@ -298,6 +727,26 @@ void process_gcode_command() {
 				next_target.option_inches = 0;
 				break;
 
+				//	G29 - Probe the bed
+			case 29:
+			{
+				//? ==== G29: Probe the bed ====
+				//?
+				//? Example: G29
+				//?
+				//? Measure the height of the bed with the Z minimum switch on the grid configured
+				//? in the firmware and enable compensation with the resulting mesh: moves are split
+				//? at the grid lines and Z is corrected with the bilinear interpolated bed height.
+				//? The reply lists the measured heights in mm. G29 is refused until X, Y and Z have been
+				//? homed with G161 / G162. If probing fails, the previous mesh is kept. See also M420.
+				static char s[ BED_MESH_REPORT_SIZE];
+				traject_wait_for_completion();
+				if (probe_bed() == 0) {
+					bed_mesh_format( s, sizeof( s));
+					printf( "%s", s);
+				}
+				break;
+			}
 				//	G30 - go home via point
 			case 30:
 				//? ==== G30: Go home via point ====
@@ -427,7 +876,6 @@ void process_gcode_command() {
 
 #define FOR_EACH_AXIS_IN_XYZ( code) \
 	do {								\
-		uint32_t feed = next_target.target.F;			\
 		axis_e axis_xyz;					\
 		int pruss_axis_xyz;		   			\
 		int next_target_seen_xyz;				\
@@ -449,6 +897,8 @@ void process_gcode_command() {
 
 				// NOTE: G161/G162 clears any G92 offset !
 				double pos;
+				int32_t machine_pos[ 3];
+				int32_t* home_positions[ 3] = { NULL, NULL, NULL };
 				if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
 					fprintf( stderr, "G161: X(%d)=%d, Y(%d)=%d, Z(%d)=%d, E(%d)=%d, F(%d)=%d\n",
 						next_target.seen_X, next_target.target.X,
@@ -457,17 +907,21 @@ void process_gcode_command() {
 						next_target.seen_E, next_target.target.E,
 						next_target.seen_F, next_target.target.F );
 				}
+				// home all selected axes at the same time, in machine coordinates
+				select_home_axes( machine_pos, home_positions);
+				int failed = home_axes_to_min_limit_switches( home_positions, next_target.target.F);
 				FOR_EACH_AXIS_IN_XYZ(
 					if (next_target_seen_xyz) {
-						// use machine coordinates during homing
-						current_pos_xyz += home_pos_xyz;
-						home_axis_to_min_limit_switch( axis_xyz, &current_pos_xyz, feed);
 						// restore gcode coordinates
-						current_pos_xyz -= home_pos_xyz;
-						if (config_min_switch_pos( axis_xyz, &pos)) {
+						current_pos_xyz = machine_pos[ axis_xyz] - home_pos_xyz;
+						if (failed & (1 << axis_xyz)) {
+							// switch not found, the position is not known
+							gcode_axes_homed &= ~(1 << axis_xyz);
+						} else if (config_min_switch_pos( axis_xyz, &pos)) {
 							home_pos_xyz = 0;
 							current_pos_xyz = SI2POS( pos);
 							pruss_queue_set_position( pruss_axis_xyz, home_pos_xyz + current_pos_xyz);
+							gcode_axes_homed |= 1 << axis_xyz;
 						}
 					} );
 
@@ -481,6 +935,8 @@ void process_gcode_command() {
 				//? Find the maximum limit of the specified axes by searching for the limit switch.
 				// reference 'home' position to (then) current position
 				double pos;
+				int32_t machine_pos[ 3];
+				int32_t* home_positions[ 3] = { NULL, NULL, NULL };
 				if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
 					fprintf( stderr, "G162: X(%d)=%d, Y(%d)=%d, Z(%d)=%d, E(%d)=%d, F(%d)=%d\n",
 						next_target.seen_X, next_target.target.X,
@@ -489,17 +945,21 @@ void process_gcode_command() {
 						next_target.seen_E, next_target.target.E,
 						next_target.seen_F, next_target.target.F );
 				}
+				// home all selected axes at the same time, in machine coordinates
+				select_home_axes( machine_pos, home_positions);
+				int failed = home_axes_to_max_limit_switches( home_positions, next_target.target.F);
 				FOR_EACH_AXIS_IN_XYZ(
 					if (next_target_seen_xyz) {
-						// use machine coordinates during homing
-						current_pos_xyz += home_pos_xyz;
-						home_axis_to_max_limit_switch( axis_xyz, &current_pos_xyz, feed);
 						// restore gcode coordinates
-						current_pos_xyz -= home_pos_xyz;
-						if (config_max_switch_pos( axis_xyz, &pos)) {
+						current_pos_xyz = machine_pos[ axis_xyz] - home_pos_xyz;
+						if (failed & (1 << axis_xyz)) {
+							// switch not found, the position is not known
+							gcode_axes_homed &= ~(1 << axis_xyz);
+						} else if (config_max_switch_pos( axis_xyz, &pos)) {
 							home_pos_xyz = 0;
 							current_pos_xyz = SI2POS( pos);
 							pruss_queue_set_position( pruss_axis_xyz, home_pos_xyz + current_pos_xyz);
+							gcode_axes_homed |= 1 << axis_xyz;
 						}
 					} );
 				break;
@@ -555,10 +1015,65 @@ void process_gcode_command() {
 				e_disable();
 				power_off();
 				for (;;) {
-					sched_yield();
+					pause();
 				}
 				break;
 
+			// M24- resume
+			case 24:
+				//? ==== M24: resume ====
+				//?
+				//? Example: M24
+				//?
+				//? Release the feed hold set by M25, moves continue where they stopped.
+				//? Send it without line number to have it executed immediately by the priority lane,
+				//? a numbered M24 is executed in sequence and waits behind the moves that are held.
+				traject_set_feed_hold( 0);
+				break;
+			// M25- pause
+			case 25:
+				//? ==== M25: pause ====
+				//?
+				//? Example: M25
+				//?
+				//? Stop the moves in progress with a ramp-down and hold the feed until M24.
+				//? The moves that were not executed are kept and replanned from the stop position on resume.
+				//? During homing or probing the current phase is finished first, then the feed is held.
+				//? Send it without line number to have it executed immediately by the priority lane.
+				traject_pause();
+				break;
+			// M420- bed mesh compensation
+			case 420:
+			{
+				//? ==== M420: bed mesh compensation ====
+				//?
+				//? Example: M420 S1
+				//?
+				//? Enable (S1) or disable (S0) compensation with the bed mesh measured by G29
+				//? and report the mesh.
+				static char s[ BED_MESH_REPORT_SIZE];
+				if (next_target.seen_S) {
+					traject_wait_for_completion();
+					if (bed_mesh_enable( next_target.S) < 0) {
+						printf( "error: no bed mesh, run G29 first");
+						break;
+					}
+				}
+				bed_mesh_format( s, sizeof( s));
+				printf( "%s", s);
+				break;
+			}
+			// M410- quick stop
+			case 410:
+				//? ==== M410: quick stop ====
+				//?
+				//? Example: M410
+				//?
+				//? Stop all moves as fast as the acceleration allows and discard the queued moves.
+				//? The position is read back from the steppers, so homing is not needed to continue.
+				//? Send it without line number to have it executed immediately by the priority lane.
+				traject_abort();
+				break;
 			// M6- tool change
 			case 6:
 				//? ==== M6: tool change ====
@@ -588,6 +1103,7 @@ void process_gcode_command() {
 				y_disable();
 				z_disable();
 				e_disable();
+				gcode_axes_homed = 0;
 				break;
 			// M3/M101- extruder on
 			case 3:
@@ -679,28 +1195,36 @@ void process_gcode_command() {
 				//? <tt>ok T:201 B:117</tt>
 				//?
 				//? Teacup supports an optional P parameter as a sensor index to address.
-				double celsius;
+				char s[ 80];
 #				ifdef ENFORCE_ORDER
 					// wait for all moves to complete
 					traject_wait_for_completion();
 #				endif
-				if (next_target.seen_P) {
-					channel_tag temp_source;
-					switch (next_target.P) {
-					case 0:  temp_source = heater_extruder; break;
-					case 1:  temp_source = heater_bed; break;
-					default: temp_source = NULL;
-					}
-					if (heater_get_celsius( temp_source, &celsius) == 0) {
-						printf( "\nT:%1.1lf", celsius);
-					}
-				} else {
-					heater_get_celsius( heater_extruder, &celsius);
-					printf( "\nT:%1.1lf", celsius);
-					if (heater_bed != NULL) {
-						heater_get_celsius( heater_bed, &celsius);
-						printf( " B:%1.1lf", celsius);
-					}
+				if (format_temperatures( s, sizeof( s), (next_target.seen_P) ? next_target.P : -1) > 0) {
+					printf( "\n%s", s);
+				}
+				break;
+			}
+			// M139- get temperature history
+			case 139: {
+				//? ==== M139: Get temperature history ====
+				//?
+				//? Example: M139 P0 S600
+				//?
+				//? Return the temperature history of the last S seconds (default 600) of the
+				//? extruder (P0, default) or bed (P1) heater in one line, like
+				//?
+				//? <tt>ok H:0 R:1 N:600 A:0 D:=3202b4c82b5c8...</tt>
+				//?
+				//? R is the resolution in seconds: 1 for up to 10 minutes, 10 for up to 2 hours.
+				//? N is the number of samples, A the age in seconds of the newest sample. Each
+				//? sample has three hex digits temperature (0.25 celsius units) and two hex digits
+				//? output (0.5% units), oldest first. A setpoint change is sent as '=' followed by
+				//? three hex digits. This command is also answered on monitor connections.
+				static char s[ 4000];
+				if (format_history( s, sizeof( s), (next_target.seen_P) ? next_target.P : 0,
+						    (next_target.seen_S) ? next_target.S : 600.0) > 0) {
+					printf( "\n%s", s);
 				}
 				break;
 			}
@@ -711,15 +1235,11 @@ void process_gcode_command() {
 				//?
 				//? Example: M106
 				//?
-				//? Turn on the cooling fan (if any).
+				//? Turn on the cooling fan (if any). The optional S parameter sets the speed,
+				//? 0-255 (default). The fan changes speed when the preceding moves have finished.
 
-#				ifdef ENFORCE_ORDER
-					// wait for all moves to complete
-					traject_wait_for_completion();
-#				endif
-#				ifdef HEATER_FAN
-					heater_set(HEATER_FAN, 255);
-#				endif
+				traject_set_output( pwm_get_handle( pwm_fan),
+					(next_target.seen_S) ? fmin( fmax( next_target.S / 2.55, 0.0), 100.0) : 100.0);
 				break;
 			// M107- fan off
 			case 9:
@@ -728,15 +1248,9 @@ void process_gcode_command() {
 				//?
 				//? Example: M107
 				//?
-				//? Turn off the cooling fan (if any).
+				//? Turn off the cooling fan (if any) when the preceding moves have finished.
 
-#				ifdef ENFORCE_ORDER
-					// wait for all moves to complete
-					traject_wait_for_completion();
-#				endif
-				#ifdef HEATER_FAN
-					heater_set(HEATER_FAN, 0);
-				#endif
+				traject_set_output( pwm_get_handle( pwm_fan), 0.0);
 				break;
 
 			// M110- set line number
@@ -748,6 +1262,19 @@ void process_gcode_command() {
 				//? Set the current line number to 123.  Thus the expected next line after this command will be 124.
 				//? This is a no-op in Teacup.
 				break;
+			// M296- set line number and checksum enforcement
+			case 296:
+				//? ==== M296: Set line number and checksum enforcement ====
+				//?
+				//? Example: M296 P1 S2
+				//?
+				//? P1 requires a line number on each line and P0 ignores line numbers. S0 checks the classic XOR checksum only
+				//? if one is present, S1 requires the XOR checksum and S2 requires a CRC-16/XMODEM checksum (polynomial 0x1021,
+				//? initial value 0) calculated over the same characters. The new settings apply to the lines following this command.
+				//? With line numbers enforced, lines that were resent but already processed are acknowledged and skipped.
+				gcode_parse_set_protocol( (next_target.seen_P) ? next_target.P : -1,
+							  (next_target.seen_S) ? next_target.S : -1);
+				break;
 			// M111- set debug level
 			#ifdef	DEBUG
 			case 111:
@@ -777,13 +1304,14 @@ void process_gcode_command() {
 				//?
 				//? Set the (raw) extruder heater output to the specified value: 0.0-1.0 gives 0-100% duty cycle.
 				//? Should only be used when there is no heater control loop configured for this output!!!
+				//? The output changes when the preceding moves have finished.
 				if (next_target.seen_S) {
-					pwm_set_output( pwm_extruder, next_target.S);
+					traject_set_output( pwm_get_handle( pwm_extruder), next_target.S);
 				}
 				break;
 			}
 			// M114- report XYZEF to host
-			case 114:
+			case 114: {
 				//? ==== M114: Get Current Position ====
 				//?
 				//? Example: M114
@@ -797,15 +1325,14 @@ void process_gcode_command() {
 					// wait for all moves to complete
 					traject_wait_for_completion();
 #				endif
-				printf(  "current: X=%1.6lf, Y=%1.6lf, Z=%1.6lf, E=%1.6lf, F=%d\n",
-					POS2MM( gcode_current_pos.X), POS2MM( gcode_current_pos.Y),
-					POS2MM( gcode_current_pos.Z), POS2MM( gcode_current_pos.E),
-					gcode_current_pos.F);
+				char s[ 120];
+				format_position( s, sizeof( s), &gcode_current_pos);
+				printf( "%s\n", s);
 				// newline is sent from gcode_parse after we return
-
 				break;
+			}
 			// M115- capabilities string
-			case 115:
+			case 115: {
 				//? ==== M115: Get Firmware Version and Capabilities ====
 				//?
 				//? Example: M115
@@ -816,9 +1343,12 @@ void process_gcode_command() {
 				//? sample data from firmware:
 				//?  FIRMWARE_NAME:Teacup FIRMWARE_URL:http%%3A//github.com/triffid/Teacup_Firmware/ PROTOCOL_VERSION:1.0 MACHINE_TYPE:Mendel EXTRUDER_COUNT:1 TEMP_SENSOR_COUNT:1 HEATER_COUNT:1
 
-				printf( "FIRMWARE_NAME: BeBoPr FIRMWARE_URL:https//github.com/modmaker/BeBoPr/ PROTOCOL_VERSION:1.0 MACHINE_TYPE:Mendel EXTRUDER_COUNT:%d TEMP_SENSOR_COUNT:%d HEATER_COUNT:%d", 1, 2, 2);
+				char s[ 200];
+				format_capabilities( s, sizeof( s));
+				printf( "%s", s);
 				// newline is sent from gcode_parse after we return
 				break;
+			}
 			// M116 - Wait for all temperatures and other slowly-changing variables to arrive at their set values.
 			case 116: {
 				//? ==== M116: Wait ====
@@ -907,6 +1437,87 @@ void process_gcode_command() {
 					power_on();
 				}
 				break;
+			// M303- PID autotune
+			case 303: {
+				//? ==== M303: PID autotune ====
+				//?
+				//? Example: M303 P0 S200
+				//?
+				//? Run a relay autotune on the extruder (P0, default) or bed (P1) heater at S celsius.
+				//? The heater is switched on and off around the setpoint and the measured oscillation
+				//? gives new P, I, D and feed-forward values. These are applied when the autotune
+				//? completes, use M134 to store them. Start with the heater at ambient temperature.
+				pid_settings pid;
+				channel_tag heater;
+				int status;
+				switch ((next_target.seen_P) ? next_target.P : 0) {
+				case 0:  heater = heater_extruder; break;
+				case 1:  heater = heater_bed; break;
+				default: heater = NULL;
+				}
+				if (!next_target.seen_S || heater_autotune_start( heater, next_target.S, 100.0) < 0) {
+					printf( "cannot start autotune");
+					break;
+				}
+				power_on();
+				event* e = heater_get_tune_event();
+				unsigned int seq;
+				while (seq = event_sequence( e), (status = heater_autotune_status( heater, &pid)) == 0) {
+					event_wait( e, seq, NULL);
+				}
+				if (status == 1) {
+					heater_set_pid_values( heater, &pid);
+					printf( "P:%1.3f I:%1.3f D:%1.3f Ilim:%1.3f FF_factor:%1.3f FF_offset:%1.3f",
+						pid.P, pid.I, pid.D, pid.I_limit, pid.FF_factor, pid.FF_offset);
+				} else {
+					printf( "autotune failed");
+				}
+				break;
+			}
+			case 306: {
+				//? ==== M306: Thermal model identification ====
+				//?
+				//? Example: M306 P0 S200
+				//?
+				//? Identify the thermal model of the extruder (P0, default) or bed (P1) heater and
+				//? switch that heater to model based control. The heater runs at full power up to
+				//? S celsius and then cools down, the recorded step response gives the gain, time
+				//? constant and dead time. Start with the heater at ambient temperature.
+				//? M306 P0 S0 switches back to PID control, M306 P0 without S reports the model.
+				thermal_model model;
+				channel_tag heater;
+				int status;
+				switch ((next_target.seen_P) ? next_target.P : 0) {
+				case 0:  heater = heater_extruder; break;
+				case 1:  heater = heater_bed; break;
+				default: heater = NULL;
+				}
+				if (next_target.seen_S && next_target.S == 0.0) {
+					heater_set_model( heater, NULL, 0);
+					break;
+				}
+				if (next_target.seen_S) {
+					if (heater_identify_start( heater, next_target.S) < 0) {
+						printf( "cannot start identification");
+						break;
+					}
+					power_on();
+					event* e = heater_get_tune_event();
+					unsigned int seq;
+					while (seq = event_sequence( e), (status = heater_identify_status( heater, &model)) == 0) {
+						event_wait( e, seq, NULL);
+					}
+					if (status != 1 || heater_set_model( heater, &model, 1) < 0) {
+						printf( "identification failed");
+						break;
+					}
+				} else if (heater_get_model( heater, &model, &status) < 0) {
+					break;
+				}
+				printf( "K:%1.3f tau:%1.1f dead_time:%1.1f ambient:%1.1f load_factor:%1.3f",
+					model.gain, model.tau, model.dead_time, model.ambient, model.load_factor);
+				break;
+			}
 			#ifdef	DEBUG
 			// M136- PRINT PID settings to host
 			case 136: {
@@ -944,6 +1555,7 @@ void process_gcode_command() {
 				z_disable();
 				e_disable();
 				power_off();
+				gcode_axes_homed = 0;
 				break;
 
 			// M200 - report endstop status
@@ -951,34 +1563,21 @@ void process_gcode_command() {
 			{
 				//? ==== M200: report endstop status ====
 				//? Report the current status of the endstops configured in the firmware to the host.
-				int no_limit_switches = 1;
-				if (config_axis_has_min_limit_switch( x_axis)) {
-				    printf( "x_min:%d ", limsw_min( x_axis));
-				    no_limit_switches = 0;
-				}
-				if (config_axis_has_max_limit_switch( x_axis)) {
-				    printf( "x_max:%d ", limsw_max( x_axis));
-				    no_limit_switches = 0;
-				}
-				if (config_axis_has_min_limit_switch( y_axis)) {
-				    printf( "y_min:%d ", limsw_min( y_axis));
-				    no_limit_switches = 0;
-				}
-				if (config_axis_has_max_limit_switch( y_axis)) {
-				    printf( "y_max:%d ", limsw_max( y_axis));
-				    no_limit_switches = 0;
-				}
-				if (config_axis_has_min_limit_switch( z_axis)) {
-				    printf( "z_min:%d ", limsw_min( z_axis));
-				    no_limit_switches = 0;
-				}
-				if (config_axis_has_max_limit_switch( z_axis)) {
-				    printf( "z_max:%d ", limsw_max( z_axis));
-				    no_limit_switches = 0;
-				}
-				if (no_limit_switches) {
-				    printf("no endstops defined");
-				}
+				//?
+				//? Example: M200 S1 P10
+				//?
+				//? With S1 the statistics of each switch that changed follow as
+				//? <tt>x_min:edges/bounces/longest bounce burst in ms</tt>, then the histogram
+				//? of the time the watcher needs from its wakeup until the switch state is read as
+				//? <tt>R:</tt> followed by 16 counts; bin n counts read times below 2^n us. The edges
+				//? are not time stamped by the kernel, so the latency from edge to wakeup is not known.
+				//? With P the last P edges (up to 32) follow after <tt>E:</tt>
+				//? as <tt>x_min=1@seconds/read time in us/PRUSS cycle count</tt>.
+				//? This command is also answered on monitor connections.
+				static char s[ 2000];
+				format_limsw_report( s, sizeof( s), next_target.seen_S && next_target.S,
+						     (next_target.seen_P) ? next_target.P : 0);
+				printf( "%s", s);
 				break;
 			}
 			// M207 - Calibrate reference switch position (Z-axis)
@@ -1002,11 +1601,13 @@ void process_gcode_command() {
 				// use machine coordinates during homing
 				gcode_current_pos.Z += gcode_home_pos.Z;
 				if (config_max_switch_pos( z_axis, &pos)) {
-					home_axis_to_max_limit_switch( z_axis, &gcode_current_pos.Z, next_target.target.F);
-					min_max = 1;
+					if (home_axis_to_max_limit_switch( z_axis, &gcode_current_pos.Z, next_target.target.F) == 0) {
+						min_max = 1;
+					}
 				} else if (config_min_switch_pos( z_axis, &pos)) {
-					home_axis_to_min_limit_switch( z_axis, &gcode_current_pos.Z, next_target.target.F);
-					min_max = -1;
+					if (home_axis_to_min_limit_switch( z_axis, &gcode_current_pos.Z, next_target.target.F) == 0) {
+						min_max = -1;
+					}
 				}
 				// restore gcode coordinates
 				gcode_current_pos.Z -= gcode_home_pos.Z;
@@ -1027,20 +1628,7 @@ void process_gcode_command() {
 			case 221:
 				//? ==== M221: extruder override factor ====
 				if (next_target.seen_S) {
-					double old;
-					double factor = 0.001 * next_target.S;
-					if (factor < 0.001) {
-						factor = 0.001;
-					}
-					if (next_target.M == 220) {
-						old = traject_set_speed_override( factor);
-					} else {
-						old = traject_set_extruder_override( factor);
-					}
-					if (DEBUG_GCODE_PROCESS && (debug_flags & DEBUG_GCODE_PROCESS)) {
-						fprintf( stderr, "M%d: set %s override factor to %1.3lf, old value was %1.3lf\n",
-							next_target.M, (next_target.M == 221) ? "extruder" : "speed", factor, old);
-					}
+					set_override( next_target.M, next_target.S);
 				}
 				break;
 			#ifdef	DEBUG
@@ -1102,8 +1690,131 @@ void process_gcode_command() {
 				// newline is sent from gcode_parse after we return
 		} // switch (next_target.M)
 	} // else if (next_target.seen_M)
+	publish_position();
 } // process_gcode_command()
 
+/*
+ *  Handle a line received from a read-only monitor connection.
+ *  This runs on the comm thread, so only commands that have no side
+ *  effects and don't touch the parser state are accepted.
+ *  The reply is a complete line, its length is returned.
+ */
+int gcode_monitor_query( const char* line, char* reply, int size)
+{
+  SIMPLE_COMMAND cmd;
+  int len = snprintf( reply, size, "ok ");
+
+  if (gcode_parse_simple( line, &cmd) == 0) {
+    switch (cmd.M) {
+    case 105:
+      len += format_temperatures( reply + len, size - len, (cmd.seen_P) ? (int)cmd.P : -1);
+      break;
+    case 114: {
+      TARGET pos;
+      seqlatch_read( &position_latch, position_copies, &pos, sizeof( pos));
+      len += format_position( reply + len, size - len, &pos);
+      break;
+    }
+    case 139:
+      len += format_history( reply + len, size - len, (cmd.seen_P) ? (int)cmd.P : 0, (cmd.seen_S) ? cmd.S : 600.0);
+      break;
+    case 115:
+      len += format_capabilities( reply + len, size - len);
+      break;
+    case 200:
+      len += format_limsw_report( reply + len, size - len, cmd.seen_S && cmd.S, (cmd.seen_P) ? (int)cmd.P : 0);
+      break;
+    default:
+      len = -1;
+    }
+  } else {
+    len = -1;
+  }
+  if (len < 0) {
+    len = snprintf( reply, size, "Error: read-only connection, command ignored");
+  }
+  if (len > size - 2) {
+    len = size - 2;
+  }
+  reply[ len++] = '\n';
+  reply[ len] = '\0';
+  return len;
+}
+
+/*
+ *  Priority lane: handle a real-time command from the stream client
+ *  immediately, ahead of the commands that are queued for the parser.
+ *  This runs on the comm thread. Only a small set of commands that
+ *  don't touch the parser state is accepted. Numbered lines must stay
+ *  in sequence, so these are left to the parser. Only an emergency stop
+ *  is executed right away as well (and again by the parser, which is
+ *  harmless). A numbered M24 waits in sequence, so while the feed is
+ *  held it can't get past the held moves: send the resume without N.
+ *  Returns the length of the reply if the line has been consumed, zero
+ *  if the line must be forwarded to the parser.
+ */
+int gcode_priority_command( const char* line, char* reply, int size)
+{
+  SIMPLE_COMMAND cmd;
+  int len;
+
+  if (gcode_parse_simple( line, &cmd) != 0) {
+    return 0;
+  }
+  switch (cmd.M) {
+  case 112:
+    pruss_stepper_emergency_stop();
+    heater_emergency_stop();
+    x_disable();
+    y_disable();
+    z_disable();
+    e_disable();
+    power_off();
+    fprintf( stderr, "M112: emergency stop executed from priority lane\n");
+    break;
+  case 24:
+  case 25:
+  case 105:
+  case 410:
+  case 220:
+  case 221:
+    break;
+  default:
+    return 0;
+  }
+  if (cmd.seen_N) {
+    return 0;
+  }
+  len = snprintf( reply, size, "ok");
+  switch (cmd.M) {
+  case 24:
+    traject_set_feed_hold( 0);
+    break;
+  case 25:
+    traject_pause();
+    break;
+  case 410:
+    traject_abort();
+    break;
+  case 105:
+    len += snprintf( reply + len, size - len, " ");
+    len += format_temperatures( reply + len, size - len, (cmd.seen_P) ? (int)cmd.P : -1);
+    break;
+  case 220:
+  case 221:
+    if (cmd.seen_S) {
+      set_override( cmd.M, cmd.S);
+    }
+    break;
+  }
+  if (len > size - 2) {
+    len = size - 2;
+  }
+  reply[ len++] = '\n';
+  reply[ len] = '\0';
+  return len;
+}
+
 int gcode_process_init( void)
 {
   int result = mendel_sub_init( "traject", traject_init);
@@ -1121,6 +1832,7 @@ int gcode_process_init( void)
 	    tag_name( temp_extruder), tag_name( temp_bed));
   }
   pwm_extruder    = pwm_lookup_by_name( "pwm_laser_power");
+  pwm_fan         = pwm_lookup_by_name( "pwm_fan");
   // If there's no extruder, or no laser power there's probably a configuration error!
   if ((heater_extruder == NULL || temp_extruder == NULL) && pwm_extruder == NULL) {
     return -1;
@@ -1130,5 +1842,6 @@ int gcode_process_init( void)
   gcode_current_pos.Z = gcode_home_pos.Z = 0;
   gcode_current_pos.E = gcode_home_pos.E = 0;
   gcode_initial_feed  = 3000;
+  publish_position();
   return 0;
 }
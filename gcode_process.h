@@ -10,5 +10,9 @@ extern void process_gcode_command( void);
 extern void gcode_trace_move( void);
 extern void gcode_set_axis_pos( axis_e axis, uint32_t pos);
 extern int gcode_process_init( void);
+// handle a line from a read-only monitor connection (comm thread)
+extern int gcode_monitor_query( const char* line, char* reply, int size);
+// handle a real-time command from the stream client ahead of the queue (comm thread)
+extern int gcode_priority_command( const char* line, char* reply, int size);
 
 #endif	/* _GCODE_PROCESS_H */
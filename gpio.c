@@ -28,15 +28,42 @@
  */
 
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "gpio.h"
 
 
 #define MAX_BUF 100
 
+#define SYSFS_GPIO_ROOT "/sys/class/gpio"
+
+static const char* gpio_root = SYSFS_GPIO_ROOT;
+static int stand_in = 0;		// gpio_root is an ordinary directory
+static gpio_backend_e gpio_backend = e_gpio_sysfs;
+static int gpio_initialized = 0;
+
+/*
+ * AM335x GPIO bank registers, used by the mmap backend
+ */
+#define GPIO_NR_BANKS		4
+#define GPIO_BANK_SIZE		0x1000
+#define GPIO_DATAIN		0x138
+#define GPIO_CLEARDATAOUT	0x190
+#define GPIO_SETDATAOUT		0x194
+
+static const off_t gpio_bank_base[ GPIO_NR_BANKS] = {
+  0x44E07000, 0x4804C000, 0x481AC000, 0x481AE000
+};
+static volatile uint32_t* gpio_bank[ GPIO_NR_BANKS];
+
+// cached value file descriptors for the sysfs backend, -1 if not open
+static int pin_fd[ GPIO_NR_PINS];
+
 
 /****************************************************************
  * gpio_open_value_file
@@ -46,7 +73,7 @@ int gpio_open_file( unsigned int gpio, const char* file)
 {
   char path[ MAX_BUF];
 
-  (void) snprintf( path, sizeof( path), "/sys/class/gpio/gpio%d/%s", gpio, file);
+  (void) snprintf( path, sizeof( path), "%s/gpio%d/%s", gpio_root, gpio, file);
   int fd = open( path, O_RDONLY | O_NONBLOCK );
   if (fd < 0) {
     perror( "gpio_open_value_file - ");
@@ -62,8 +89,8 @@ int gpio_write_value_to_file( const char* file, const char* value)
 {
   char path[ MAX_BUF];
 
-  (void) snprintf( path, sizeof( path), "/sys/class/gpio/%s", file); 
-  int fd = open( path, O_WRONLY);
+  (void) snprintf( path, sizeof( path), "%s/%s", gpio_root, file); 
+  int fd = (stand_in) ? open( path, O_WRONLY | O_CREAT | O_TRUNC, 0644) : open( path, O_WRONLY);
   if (fd < 0) {
     perror( "gpio_set failed");
     return fd;
@@ -97,3 +124,107 @@ int gpio_write_int_value_to_file( const char* file, int value)
   return  gpio_write_value_to_file( file, buffer);
 }
 
+/****************************************************************
+ * fast pin access
+ ****************************************************************/
+
+int gpio_init( gpio_backend_e backend, const char* root)
+{
+  int i;
+
+  for (i = 0 ; i < GPIO_NR_PINS ; ++i) {
+    pin_fd[ i] = -1;
+  }
+  if (root != NULL) {
+    gpio_root = root;
+    stand_in = 1;
+    if (backend == e_gpio_mmap) {
+      fprintf( stderr, "gpio_init: no register access with a stand-in root, using files\n");
+      backend = e_gpio_sysfs;
+    }
+  }
+  if (backend == e_gpio_mmap) {
+    int fd = open( "/dev/mem", O_RDWR | O_SYNC);
+    if (fd < 0) {
+      perror( "gpio_init: cannot open /dev/mem, using sysfs");
+      backend = e_gpio_sysfs;
+    } else {
+      for (i = 0 ; i < GPIO_NR_BANKS ; ++i) {
+        void* p = mmap( NULL, GPIO_BANK_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, gpio_bank_base[ i]);
+        if (p == MAP_FAILED) {
+          perror( "gpio_init: cannot map GPIO bank, using sysfs");
+          backend = e_gpio_sysfs;
+          break;
+        }
+        gpio_bank[ i] = p;
+      }
+      close( fd);	// mappings stay valid
+    }
+  }
+  gpio_backend = backend;
+  gpio_initialized = 1;
+  return 0;
+}
+
+/*
+ * Export a pin and set its direction. With the sysfs backend the value
+ * file is opened once and kept open for all further accesses.
+ */
+int gpio_pin_open( unsigned int gpio, int output)
+{
+  char path[ MAX_BUF];
+
+  if (gpio >= GPIO_NR_PINS) {
+    return -1;
+  }
+  if (!gpio_initialized) {
+    gpio_init( e_gpio_sysfs, NULL);
+  }
+  if (stand_in) {
+    (void) snprintf( path, sizeof( path), "%s/gpio%d", gpio_root, gpio);
+    (void) mkdir( path, 0755);
+  }
+  gpio_write_int_value_to_file( "export", gpio);
+  gpio_write_value_to_pin_file( gpio, "direction", (output) ? "out" : "in");
+  if (gpio_backend == e_gpio_sysfs && pin_fd[ gpio] < 0) {
+    (void) snprintf( path, sizeof( path), "%s/gpio%d/value", gpio_root, gpio);
+    int fd = (stand_in) ? open( path, O_RDWR | O_CREAT, 0644) : open( path, O_RDWR);
+    if (fd < 0) {
+      perror( "gpio_pin_open: cannot open value file");
+      return -1;
+    }
+    pin_fd[ gpio] = fd;
+  }
+  return 0;
+}
+
+int gpio_pin_read( unsigned int gpio)
+{
+  if (gpio >= GPIO_NR_PINS) {
+    return -1;
+  }
+  if (gpio_backend == e_gpio_mmap) {
+    return (gpio_bank[ gpio / 32][ GPIO_DATAIN / 4] >> (gpio % 32)) & 1;
+  }
+  char buf[ 2];
+  if (pin_fd[ gpio] < 0 || pread( pin_fd[ gpio], buf, sizeof( buf), 0) < 1) {
+    return -1;
+  }
+  return (buf[ 0] == '1');
+}
+
+int gpio_pin_write( unsigned int gpio, int value)
+{
+  if (gpio >= GPIO_NR_PINS) {
+    return -1;
+  }
+  if (gpio_backend == e_gpio_mmap) {
+    // set and clear registers, no read-modify-write needed
+    gpio_bank[ gpio / 32][ ((value) ? GPIO_SETDATAOUT : GPIO_CLEARDATAOUT) / 4] = 1 << (gpio % 32);
+    return 0;
+  }
+  if (pin_fd[ gpio] < 0 || pwrite( pin_fd[ gpio], (value) ? "1" : "0", 1, 0) != 1) {
+    return -1;
+  }
+  return 0;
+}
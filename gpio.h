@@ -34,5 +34,24 @@ extern int gpio_open_file( unsigned int gpio, const char* file);
 
 #endif
 
+/*
+ * Fast pin access. Pins are exported and configured once by gpio_pin_open,
+ * after that reads and writes use either a cached sysfs value file or the
+ * GPIO bank registers mapped from /dev/mem.
+ */
+typedef enum {
+  e_gpio_sysfs,		// sysfs value files, kept open
+  e_gpio_mmap,		// GPIO bank registers, direction is still set through sysfs
+} gpio_backend_e;
+
+#define GPIO_NR_PINS	128	// 4 banks of 32 pins
+
+// root replaces /sys/class/gpio if not NULL, files are created as needed
+// so an ordinary directory can stand in for the sysfs tree when testing.
+extern int gpio_init( gpio_backend_e backend, const char* root);
+extern int gpio_pin_open( unsigned int gpio, int output);
+extern int gpio_pin_read( unsigned int gpio);
+extern int gpio_pin_write( unsigned int gpio, int value);
+
 
 #endif
@@ -8,25 +8,89 @@
 #include <string.h>
 #include <time.h>
 #include <errno.h>
+#include <math.h>
 
 #include "heater.h"
 #include "debug.h"
 #include "temp.h"
 #include "beaglebone.h"
 #include "mendel.h"
+#include "bebopr.h"
+#include "heater_log.h"
+#include "history.h"
 
 
+typedef enum {
+  e_autotune_idle = 0,
+  e_autotune_running,
+  e_autotune_done,
+  e_autotune_failed,
+} autotune_state;
+
+/*
+ * State of a relay (Astrom-Hagglund) autotune run: the output is switched
+ * between 'power' and zero around the setpoint, the resulting oscillation
+ * yields the ultimate gain and period.
+ */
+struct autotune {
+  volatile autotune_state state;
+  double		setpoint;
+  double		power;		// relay output when on [%]
+  double		ambient;	// temperature at start
+  int			heating;
+  int			cycle;
+  double		t_start;	// [s]
+  double		t_on;		// start of current cycle [s]
+  double		celsius_max;
+  double		celsius_min;
+  double		sum_period;
+  double		sum_on_time;
+  double		sum_amplitude;
+  int			samples;
+  pid_settings		result;
+};
+
+/*
+ * Step response recording used to identify the thermal model: full
+ * power up to 'max_celsius', then off until the temperature has
+ * dropped halfway back to ambient.
+ */
+struct identify {
+  volatile autotune_state state;
+  double		max_celsius;
+  int			heating;
+  int			count;
+  int			size;
+  float*		celsius;
+  float*		output;
+};
+
+#define MODEL_HISTORY	300	/* samples, 60 s max. dead time at 5 Hz */
+
 struct heater {
   channel_tag		id;
   channel_tag		input;
   channel_tag		output;
+  channel_handle	input_handle;	// resolved once in heater_init
+  channel_handle	output_handle;
   double		setpoint;
   pid_settings		pid_settings;
   double		(*get_temperature)( void);
   double		pid_integral;
   double		celsius_history[ 8];
   unsigned int          history_ix;
-  int			log_fd;
+  int			logging;	// log records posted, used by heater thread only
+  struct autotune	autotune;
+  struct identify	identify;
+  thermal_model		model;
+  volatile int		model_control;
+  volatile double	load;		// current load, e.g. filament feed rate
+  double		output_history[ MODEL_HISTORY];
+  unsigned int		output_ix;
+  double		power;		// [W] at 100%
+  volatile double	request;	// output requested by the controller [%]
+  double		duty_cycle;	// output after the power budget [%]
+  channel_handle	history_handle;
 };
 
 static struct heater* heaters = NULL;
@@ -58,37 +122,46 @@ static double clip( double min, double val, double max)
 // Use control_lock for access to control loop settings
 static pthread_rwlock_t	control_lock;
 
-static int log_file_open( const char* fname)
+// Set by an emergency stop, keeps all heaters off from then on
+static volatile int heaters_shutdown = 0;
+
+// Signalled when an autotune or identification run finishes or fails
+static event tune_event;
+
+/*
+ * Post the state of one control cycle to the log writer, this
+ * never blocks. The writer only logs if the log file exists.
+ */
+static void log_entry( struct heater* p, const struct timespec* ts, double celsius, double error,
+                double out_ff, double out_p, double out_i, double out_d, double duty_cycle)
 {
-  char s[ 270];
-  snprintf( s, sizeof( s), "./pid-%s.log", fname);
-  if (debug_flags & DEBUG_HEATER) {
-    printf( "log_file_open - looking for existing logfile named '%s'\n", s);
-  }
-  int fd = open( s, O_WRONLY|O_APPEND);
-  if (fd < 0) {
-    perror( "Failed to open logile for append, logging disabled");
-    return -1;
-  }
-  if (debug_flags & DEBUG_HEATER) {
-    printf( "log_file_open - appending to file '%s'\n", s);
-  }
-  snprintf( s, sizeof( s), "--------------------------------------------------------------------------------------\n"
-                           "   time   channel         setpoint   temp       ff       p        i        d     out%%\n"
-                           "--------------------------------------------------------------------------------------\n");
-  write( fd, s, strlen( s));
-  return fd;
+  heater_log_record record = {
+    .type       = e_heater_log_data,
+    .name       = tag_name( p->input),
+    .time       = *ts,
+    .setpoint   = p->setpoint,
+    .celsius    = celsius,
+    .error      = error,
+    .out_ff     = out_ff,
+    .out_p      = out_p,
+    .out_i      = out_i,
+    .out_d      = out_d,
+    .duty_cycle = duty_cycle,
+  };
+  heater_log_post( &record);
+  p->logging = 1;
 }
 
-static void log_entry( const char* name, int fd, time_t time, double setpoint, double celsius, double error,
-                double out_ff, double out_p, double out_i, double out_d, int duty_cycle)
+static void log_close( struct heater* p)
 {
-  char s[ 120];
-  snprintf( s, sizeof( s), "%7ld   %-14s   %6.2lf   %6.2lf   %6.2lf   %6.2lf   %6.2lf   %6.2lf   %3d\n",
-          time, name, setpoint, celsius, out_ff, out_p, out_i, out_d, duty_cycle);
-  write( fd, s, strlen( s));
-  if (debug_flags & DEBUG_HEATER) {
-    printf( s);
+  if (p->logging) {
+    heater_log_record record = {
+      .type = e_heater_log_close,
+      .name = tag_name( p->input),
+    };
+    if (heater_log_post( &record) == 0) {
+      p->logging = 0;
+    }
   }
 }
 
@@ -119,6 +192,221 @@ static void ns_sleep( struct timespec* ts, unsigned int ns)
   }
 }
 
+// Samples older than this (in seconds) are not used for control
+#define MAX_SAMPLE_AGE 2.0
+
+static double sample_age( const temp_sample* sample, const struct timespec* now)
+{
+  return (now->tv_sec - sample->adc.timestamp.tv_sec) +
+	 1.0E-9 * (now->tv_nsec - sample->adc.timestamp.tv_nsec);
+}
+
+#define AUTOTUNE_CYCLES		5	/* oscillation cycles measured */
+#define AUTOTUNE_HYSTERESIS	1.0	/* [C] around the setpoint */
+#define AUTOTUNE_MAX_OVERSHOOT	25.0	/* [C] above setpoint aborts */
+#define AUTOTUNE_TIMEOUT	(30 * 60) /* [s] */
+
+static void autotune_finish( struct heater* p)
+{
+  struct autotune* a = &p->autotune;
+  double t_u   = a->sum_period / a->samples;
+  double amp   = a->sum_amplitude / a->samples;
+  double k_u   = 4.0 * (a->power / 2.0) / (M_PI * amp);
+  double u_ss  = a->power * a->sum_on_time / a->sum_period;
+
+  // Ziegler-Nichols
+  a->result     = p->pid_settings;
+  a->result.P   = 0.6 * k_u;
+  a->result.I   = 1.2 * k_u / t_u;
+  a->result.D   = 0.075 * k_u * t_u;
+  // let the integrator supply at most the steady state output
+  a->result.I_limit = u_ss / a->result.I;
+  // feed-forward: output needed to hold the setpoint, proportional to the temperature rise
+  if (a->setpoint - a->ambient > 20.0) {
+    a->result.FF_offset = a->ambient;
+    a->result.FF_factor = u_ss / (a->setpoint - a->ambient);
+  }
+  fprintf( stderr, "heater '%s' autotune: Tu = %1.1lf s, amplitude = %1.2lf C, Ku = %1.3lf, steady state output = %1.1lf %%\n",
+	  tag_name( p->id), t_u, amp, k_u, u_ss);
+  a->state = e_autotune_done;
+  event_signal( &tune_event);
+}
+
+static void autotune_abort( struct heater* p, const char* reason)
+{
+  fprintf( stderr, "heater '%s' autotune failed: %s\n", tag_name( p->id), reason);
+  p->autotune.state = e_autotune_failed;
+  event_signal( &tune_event);
+}
+
+/*
+ * One relay step, called at the PID loop frequency. The first cycle
+ * starts from ambient and is not used for the measurement.
+ */
+static int autotune_step( struct heater* p, double celsius, double now)
+{
+  struct autotune* a = &p->autotune;
+  if (a->cycle == 0 && a->t_start == 0.0) {
+    a->t_start     = now;
+    a->t_on        = now;
+    a->heating     = 1;
+    a->celsius_max = a->celsius_min = celsius;
+  }
+  if (celsius > a->setpoint + AUTOTUNE_MAX_OVERSHOOT) {
+    autotune_abort( p, "temperature too high");
+    return 0;
+  }
+  if (now - a->t_start > AUTOTUNE_TIMEOUT) {
+    autotune_abort( p, "timeout");
+    return 0;
+  }
+  if (celsius > a->celsius_max) {
+    a->celsius_max = celsius;
+  }
+  if (celsius < a->celsius_min) {
+    a->celsius_min = celsius;
+  }
+  if (a->heating && celsius > a->setpoint + AUTOTUNE_HYSTERESIS) {
+    a->heating = 0;
+    if (a->cycle > 0) {
+      a->sum_on_time += now - a->t_on;
+    }
+  } else if (!a->heating && celsius < a->setpoint - AUTOTUNE_HYSTERESIS) {
+    a->heating = 1;
+    if (a->cycle > 0) {
+      a->sum_period    += now - a->t_on;
+      a->sum_amplitude += (a->celsius_max - a->celsius_min) / 2.0;
+      ++a->samples;
+    }
+    ++a->cycle;
+    a->t_on = now;
+    a->celsius_max = a->celsius_min = celsius;
+    if (a->samples >= AUTOTUNE_CYCLES) {
+      autotune_finish( p);
+      return 0;
+    }
+  }
+  return (a->heating) ? (int)a->power : 0;
+}
+
+static double power_budget = 0.0;
+
+/*
+ * Priority for the power budget: a heater under load (the extruder
+ * while printing) comes first, otherwise the most powerful heater,
+ * as that is the slowest to warm up (the bed). Ties go to the lowest
+ * index, so of any two heaters exactly one has priority.
+ */
+static int heater_has_priority( const struct heater* a, const struct heater* b)
+{
+  if ((a->load > 0.0) != (b->load > 0.0)) {
+    return (a->load > 0.0);
+  }
+  if (a->power != b->power) {
+    return (a->power > b->power);
+  }
+  return (a < b);
+}
+
+/*
+ * Limit the output of heater 'p' so that all heaters together stay
+ * within the power budget. Heaters with a higher priority get their
+ * requested output first, using the most recent request of each.
+ */
+static double budget_limit( struct heater* p, double duty_cycle)
+{
+  p->request = duty_cycle;
+  if (power_budget <= 0.0 || p->power <= 0.0) {
+    return duty_cycle;
+  }
+  double available = power_budget;
+  for (int ix = 0 ; ix < num_heater_channels ; ++ix) {
+    struct heater* q = &heaters[ ix];
+    if (q != p && heater_has_priority( q, p)) {
+      available -= 0.01 * q->request * q->power;
+    }
+  }
+  double limit = (available > 0.0) ? 100.0 * available / p->power : 0.0;
+  return (duty_cycle > limit) ? limit : duty_cycle;
+}
+
+/*
+ * Set the heater output and remember it, the model based
+ * controller needs the output history to predict the temperature.
+ */
+static void heater_output( struct heater* p, double duty_cycle)
+{
+  duty_cycle = budget_limit( p, duty_cycle);
+  p->duty_cycle = duty_cycle;
+  p->output_history[ p->output_ix] = duty_cycle;
+  if (++p->output_ix >= MODEL_HISTORY) {
+    p->output_ix = 0;
+  }
+  pwm_set_duty_by_handle( p->output_handle, duty_cycle);
+}
+
+#define IDENTIFY_MAX_TIME	(30 * 60)	/* [s] */
+
+static void identify_abort( struct heater* p, const char* reason)
+{
+  fprintf( stderr, "heater '%s' identification failed: %s\n", tag_name( p->id), reason);
+  p->identify.state = e_autotune_failed;
+  event_signal( &tune_event);
+}
+
+static int identify_step( struct heater* p, double celsius)
+{
+  struct identify* id = &p->identify;
+  if (id->count >= id->size) {
+    identify_abort( p, "timeout");
+    return 0;
+  }
+  if (id->heating && celsius >= id->max_celsius) {
+    id->heating = 0;
+  } else if (!id->heating && celsius < (id->celsius[ 0] + id->max_celsius) / 2.0) {
+    id->state = e_autotune_done;
+    event_signal( &tune_event);
+    return 0;
+  }
+  id->celsius[ id->count] = celsius;
+  id->output[ id->count]  = (id->heating) ? 100.0 : 0.0;
+  ++id->count;
+  return (id->heating) ? 100 : 0;
+}
+
+#define MODEL_HORIZON		5.0	/* [s] */
+
+/*
+ * Model based control: a Smith predictor estimates the temperature
+ * after the dead time from the outputs that haven't shown up yet.
+ * From there the output is chosen that brings the model to the
+ * setpoint within the horizon. With the output clipped, this heats
+ * at full power and lands on the setpoint without overshoot if the
+ * model is accurate. Known load (extrusion) is compensated directly.
+ */
+static double model_output( struct heater* p, double celsius, double* predicted)
+{
+  const thermal_model* m = &p->model;
+  const double dt = 1.0 / PID_LOOP_FREQUENCY;
+  int delay = (int)(m->dead_time / dt + 0.5);
+  double alpha = dt / m->tau;
+  double t_pred = celsius;
+
+  if (delay >= MODEL_HISTORY) {
+    delay = MODEL_HISTORY - 1;
+  }
+  for (int i = delay ; i > 0 ; --i) {
+    double u = p->output_history[ (p->output_ix + MODEL_HISTORY - i) % MODEL_HISTORY];
+    t_pred += alpha * (m->ambient + m->gain * u - t_pred);
+  }
+  double horizon = (MODEL_HORIZON > dt) ? MODEL_HORIZON : dt;
+  double decay = exp( -horizon / m->tau);
+  double t_final = (p->setpoint - t_pred * decay) / (1.0 - decay);
+  double out = (t_final - m->ambient) / m->gain + m->load_factor * p->load;
+  *predicted = t_pred;
+  return clip( 0.0, out, 100.0);
+}
+
 /*
  * This is the worker thread that controls the heaters
  * depending on the setpoint and temperature measured.
@@ -144,17 +432,52 @@ void* heater_thread( void* arg)
     for (int ix = 0 ; ix < num_heater_channels ; ++ix) {
       struct heater* p = &heaters[ ix];
       channel_tag input_channel  = p->input;
-      channel_tag output_channel = p->output;
+      temp_sample sample;
       double celsius;
       // Sleep until the next mark passes, distribute the load
       ns_sleep( &ts, timer_period);
-      if (temp_get_celsius( input_channel, &celsius) < 0) {
+      if (temp_get_sample_by_handle( p->input_handle, &sample) < 0) {
         fprintf( stderr, "heater_thread - failed to read temperature from '%s'\n", tag_name( input_channel));
+        heater_output( p, 0);
+      } else if (sample_age( &sample, &ts) > MAX_SAMPLE_AGE) {
+        // no recent measurement, don't control on stale data
+        if (sample.adc.timestamp.tv_sec != 0 && log_scaler == 0) {
+          fprintf( stderr, "heater_thread - temperature from '%s' is stale\n", tag_name( input_channel));
+        }
+        if (p->autotune.state == e_autotune_running && sample.adc.timestamp.tv_sec != 0) {
+          autotune_abort( p, "no temperature");
+        }
+        if (p->identify.state == e_autotune_running && sample.adc.timestamp.tv_sec != 0) {
+          identify_abort( p, "no temperature");
+        }
+        heater_output( p, 0);
+      } else if (sample.status != 0) {
+        // open or shorted sensor, never heat
+        if (p->autotune.state == e_autotune_running) {
+          autotune_abort( p, "sensor fault");
+        }
+        if (p->identify.state == e_autotune_running) {
+          identify_abort( p, "sensor fault");
+        }
+        heater_output( p, 0);
       } else {
-        if (p->setpoint == 0.0) {
-          // A setpoint of 0.0 means: disable heater
-          // TODO: should this be done over and over again ?
-          pwm_set_output( output_channel, 0);
+        celsius = sample.celsius;
+        if (p->autotune.state == e_autotune_running && !heaters_shutdown) {
+          // relay mode replaces the PID controller
+          heater_output( p, autotune_step( p, celsius, ts.tv_sec + 1.0E-9 * ts.tv_nsec));
+        } else if (p->identify.state == e_autotune_running && !heaters_shutdown) {
+          heater_output( p, identify_step( p, celsius));
+        } else if (p->setpoint == 0.0 || heaters_shutdown) {
+          // A setpoint of 0.0 means: disable heater, repeating this
+          // is cheap as the pwm code skips writes without a change.
+          heater_output( p, 0);
+          log_close( p);
+        } else if (p->model_control) {
+          double predicted;
+          double duty_cycle = model_output( p, celsius, &predicted);
+          log_entry( p, &ts, celsius, p->setpoint - predicted, p->model.load_factor * p->load,
+		  0.0, 0.0, 0.0, duty_cycle);
+          heater_output( p, duty_cycle);
         } else {
           double t_error = p->setpoint - celsius;
           const double dt = 1.0 / PID_LOOP_FREQUENCY;
@@ -179,7 +502,7 @@ void* heater_thread( void* arg)
             // if no history, force heater_d to 0.0
             old_celsius = celsius;
           }
-          double heater_d = (celsius - old_celsius) / ((NR_ITEMS( p->celsius_history) - 1) * dt);
+          double heater_d = (old_celsius - celsius) / ((NR_ITEMS( p->celsius_history) - 1) * dt);
 
           // combine factors
           double out_p = heater_p * p->pid_settings.P;
@@ -187,14 +510,11 @@ void* heater_thread( void* arg)
           double out_d = heater_d * p->pid_settings.D;
           double out_ff= (p->setpoint - p->pid_settings.FF_offset) * p->pid_settings.FF_factor;
           double out   = out_p + out_i + out_d + out_ff;
-          int duty_cycle = (int) clip( 0.0, out, 100.0);
-          // Do not log every cycle, but only once in a while
-          if (log_scaler == 0) {
-            log_entry( tag_name( input_channel), p->log_fd, ts.tv_sec,
-		    p->setpoint, celsius, t_error, out_ff, out_p, out_i, out_d, duty_cycle);
-          }
-          pwm_set_output( output_channel, duty_cycle);
+          double duty_cycle = clip( 0.0, out, 100.0);
+          log_entry( p, &ts, celsius, t_error, out_ff, out_p, out_i, out_d, duty_cycle);
+          heater_output( p, duty_cycle);
         }
+        history_add( p->history_handle, &ts, celsius, p->setpoint, p->duty_cycle);
       }
     }
     // create a log entry every second
@@ -241,6 +561,7 @@ int heater_init( void)
     // First initialize input and output subsystems
     mendel_sub_init( "temp", temp_init);
     mendel_sub_init( "pwm", pwm_init);
+    mendel_sub_init( "heater_log", heater_log_init);
     // No need to lock as there's no thread running yet!
     for (int ch = 0 ; ch < heater_config_items ; ++ch) {
       struct heater*	    pd  = &heaters[ ch];
@@ -257,9 +578,20 @@ int heater_init( void)
       pd->setpoint		= 0.0;
       pd->history_ix		= 0;
       pd->pid_integral		= 0.0;
-      pd->log_fd		= -1;
+      pd->logging		= 0;
+      pd->model			= ps->model;
+      pd->power			= ps->power;
+      pd->model_control		= (ps->model.gain > 0.0 && ps->model.tau > 0.0);
+      pd->input_handle		= temp_get_handle( pd->input);
+      pd->output_handle		= pwm_get_handle( pd->output);
+      pd->history_handle	= history_register( pd->id);
+      if (pd->input_handle == INVALID_HANDLE || pd->output_handle == INVALID_HANDLE) {
+        fprintf( stderr, "heater_init: invalid input or output channel for '%s'\n", tag_name( pd->id));
+      }
       ++num_heater_channels;
     }
+    power_budget = config_heater_power_budget();
+    event_init( &tune_event);
     // Start worker thread
     if (mendel_thread_create( "heater", &worker, NULL, &heater_thread, NULL) != 0) {
       return -1;
@@ -282,11 +614,36 @@ int heater_get_celsius( channel_tag heater, double* pcelsius)
   if (pcelsius != NULL) {
     int ix = heater_index_lookup( heater);
     if (ix >= 0) {
-      return temp_get_celsius( heaters[ ix].input, pcelsius);
+      temp_sample sample;
+      if (temp_get_sample_by_handle( heaters[ ix].input_handle, &sample) == 0) {
+        *pcelsius = sample.celsius;
+        return 0;
+      }
     }
   }
   return -1;
 }
+/*
+ * Turn all heater outputs off immediately and keep them off, regardless
+ * of the setpoints. Used by the emergency stop, can be called from any thread.
+ */
+int heater_emergency_stop( void)
+{
+  heaters_shutdown = 1;
+  for (int ix = 0 ; ix < num_heater_channels ; ++ix) {
+    pwm_stage_output_by_handle( heaters[ ix].output_handle, 0.0);
+    heaters[ ix].request = 0.0;		// no longer taken from the budget
+    // a run in progress will never complete, fail it to release its waiter
+    if (heaters[ ix].autotune.state == e_autotune_running) {
+      autotune_abort( &heaters[ ix], "emergency stop");
+    }
+    if (heaters[ ix].identify.state == e_autotune_running) {
+      identify_abort( &heaters[ ix], "emergency stop");
+    }
+  }
+  return pwm_commit();
+}
+
 /*
  * turn heater channel on or off
  */
@@ -314,20 +671,6 @@ int heater_set_setpoint( channel_tag heater, double setpoint)
     pthread_rwlock_wrlock( &control_lock);
     p->setpoint = setpoint;
     pthread_rwlock_unlock( &control_lock);
-    if (setpoint == 0.0) {
-      // stop logging & close file if open
-      if (p->log_fd >= 0) {
-        close( p->log_fd);
-        if (debug_flags & DEBUG_HEATER) {
-          printf( "heater_set_setpoint - logfile closed.\n");
-        }
-      }
-      p->log_fd = -1;
-    } else {
-      if (p->log_fd == -1) {
-        p->log_fd = log_file_open( tag_name( p->id));
-      }
-    }
     /*
      * Activate setpoint and in-range watch in temperature code
      * TODO: improve settings / add setting for limits
@@ -387,31 +730,264 @@ int heater_get_pid_values( channel_tag heater, pid_settings* pid_settings)
   return -1;
 }
 
+/*
+ * Start a relay autotune run for a heater. The heater's setpoint is
+ * cleared, so the heater is off when the run has finished.
+ */
+int heater_autotune_start( channel_tag heater, double setpoint, double power)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0 && setpoint > 0.0 && power > 0.0 && power <= 100.0) {
+    struct heater* p = &heaters[ ix];
+    struct autotune* a = &p->autotune;
+    temp_sample sample;
+    if (a->state == e_autotune_running || heaters_shutdown ||
+        temp_get_sample_by_handle( p->input_handle, &sample) < 0 || sample.status != 0) {
+      return -1;
+    }
+    heater_set_setpoint( heater, 0.0);
+    memset( a, 0, sizeof( *a));
+    a->setpoint = setpoint;
+    a->power    = power;
+    a->ambient  = sample.celsius;
+    __sync_synchronize();
+    a->state    = e_autotune_running;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Returns 0 while the autotune is running, 1 when it has finished and
+ * the results are stored in 'result', -1 if it failed or wasn't started.
+ * The event returned by heater_get_tune_event() signals a change.
+ */
+int heater_autotune_status( channel_tag heater, pid_settings* result)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0) {
+    struct autotune* a = &heaters[ ix].autotune;
+    switch (a->state) {
+    case e_autotune_running:
+      return 0;
+    case e_autotune_done:
+      if (result != NULL) {
+        *result = a->result;
+      }
+      return 1;
+    default:
+      break;
+    }
+  }
+  return -1;
+}
+
+event* heater_get_tune_event( void)
+{
+  return &tune_event;
+}
+
+/*
+ * Start recording a step response for model identification. The heater
+ * runs at full power up to 'max_celsius', then cools down. The heater's
+ * setpoint is cleared, so the heater is off when the run has finished.
+ */
+int heater_identify_start( channel_tag heater, double max_celsius)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0 && max_celsius > 0.0) {
+    struct heater* p = &heaters[ ix];
+    struct identify* id = &p->identify;
+    temp_sample sample;
+    if (id->state == e_autotune_running || p->autotune.state == e_autotune_running || heaters_shutdown ||
+        temp_get_sample_by_handle( p->input_handle, &sample) < 0 || sample.status != 0 ||
+        sample.celsius >= max_celsius - 10.0) {
+      return -1;
+    }
+    heater_set_setpoint( heater, 0.0);
+    free( id->celsius);
+    free( id->output);
+    id->size        = IDENTIFY_MAX_TIME * PID_LOOP_FREQUENCY;
+    id->celsius     = malloc( id->size * sizeof( *id->celsius));
+    id->output      = malloc( id->size * sizeof( *id->output));
+    if (id->celsius == NULL || id->output == NULL) {
+      return -1;
+    }
+    id->max_celsius = max_celsius;
+    id->heating     = 1;
+    id->count       = 0;
+    __sync_synchronize();
+    id->state       = e_autotune_running;
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Least squares fit of a discrete first order model with dead time
+ *   y[k+1] - y[k] = -a * y[k] + b * u[k-d]   (y: temperature above ambient)
+ * to the recorded step response. Every dead time is tried, the one
+ * with the smallest residual is used.
+ */
+static int identify_fit( const struct identify* id, thermal_model* model)
+{
+  const double dt = 1.0 / PID_LOOP_FREQUENCY;
+  double ambient = id->celsius[ 0];
+  double best_residual = -1.0;
+  int max_delay = id->count / 4;
+
+  if (max_delay >= MODEL_HISTORY) {
+    max_delay = MODEL_HISTORY - 1;
+  }
+  for (int d = 0 ; d <= max_delay ; ++d) {
+    double syy = 0.0, syu = 0.0, suu = 0.0, sdy = 0.0, sdu = 0.0;
+    for (int k = d ; k < id->count - 1 ; ++k) {
+      double y  = id->celsius[ k] - ambient;
+      double u  = id->output[ k - d];
+      double dy = id->celsius[ k + 1] - id->celsius[ k];
+      syy += y * y; syu += y * u; suu += u * u;
+      sdy += dy * y; sdu += dy * u;
+    }
+    double det = syy * suu - syu * syu;
+    if (det <= 0.0) {
+      continue;
+    }
+    double a = -(sdy * suu - sdu * syu) / det;
+    double b = (syy * sdu - syu * sdy) / det;
+    if (a <= 0.0 || b <= 0.0) {
+      continue;
+    }
+    double residual = 0.0;
+    for (int k = d ; k < id->count - 1 ; ++k) {
+      double e = id->celsius[ k + 1] - id->celsius[ k] + a * (id->celsius[ k] - ambient) - b * id->output[ k - d];
+      residual += e * e;
+    }
+    if (best_residual < 0.0 || residual < best_residual) {
+      best_residual     = residual;
+      model->gain       = b / a;
+      model->tau        = dt / a;
+      model->dead_time  = d * dt;
+      model->ambient    = ambient;
+    }
+  }
+  return (best_residual < 0.0) ? -1 : 0;
+}
+
+/*
+ * Returns 0 while the identification is running, 1 when it has finished
+ * and the model is stored in 'result', -1 if it failed or wasn't started.
+ * The load factor is not identified, it is copied from the current model.
+ */
+int heater_identify_status( channel_tag heater, thermal_model* result)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0) {
+    struct heater* p = &heaters[ ix];
+    struct identify* id = &p->identify;
+    switch (id->state) {
+    case e_autotune_running:
+      return 0;
+    case e_autotune_done:
+      if (result != NULL) {
+        *result = p->model;
+        if (identify_fit( id, result) < 0) {
+          fprintf( stderr, "heater '%s' identification failed: no fit\n", tag_name( heater));
+          id->state = e_autotune_failed;
+          return -1;
+        }
+      }
+      return 1;
+    default:
+      break;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Install a thermal model and select model based control (enable != 0)
+ * or PID control (enable == 0) for a heater.
+ */
+int heater_set_model( channel_tag heater, const thermal_model* model, int enable)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0) {
+    struct heater* p = &heaters[ ix];
+    if (model != NULL) {
+      if (model->gain <= 0.0 || model->tau <= 0.0) {
+        return -1;
+      }
+      pthread_rwlock_wrlock( &control_lock);
+      p->model = *model;
+      pthread_rwlock_unlock( &control_lock);
+    }
+    if (enable && p->model.gain <= 0.0) {
+      return -1;
+    }
+    p->model_control = enable;
+    return 0;
+  }
+  return -1;
+}
+
+int heater_get_model( channel_tag heater, thermal_model* model, int* enabled)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0) {
+    struct heater* p = &heaters[ ix];
+    pthread_rwlock_rdlock( &control_lock);
+    if (model != NULL) {
+      *model = p->model;
+    }
+    if (enabled != NULL) {
+      *enabled = p->model_control;
+    }
+    pthread_rwlock_unlock( &control_lock);
+    return 0;
+  }
+  return -1;
+}
+
+/*
+ * Announce the load on a heater (for the extruder: the filament feed
+ * rate in mm/s) so the model based controller can compensate for it
+ * before the temperature drops.
+ */
+int heater_set_load( channel_tag heater, double load)
+{
+  int ix = heater_index_lookup( heater);
+  if (ix >= 0) {
+    heaters[ ix].load = load;
+    return 0;
+  }
+  return -1;
+}
+
 const char* fname = "./heater-pid-factors";
 
 /*
- * Write PID factors to persistent storage
+ * Write PID factors to persistent storage, one record for each heater.
  */
 int heater_save_settings( void)
 {
   int fd;
-  int ret;
+  int ret = 0;
   
-  fd = open( fname, O_WRONLY);
+  fd = open( fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
   if (fd < 0) {
-    perror( "heater: opening of file '%s' failed");
+    fprintf( stderr, "heater: opening of file '%s' failed: %s\n", fname, strerror( errno));
     return -1;
   }
   pthread_rwlock_rdlock( &control_lock);
-  ret = write( fd, heaters, sizeof( heaters));
-  pthread_rwlock_unlock( &control_lock);
-  if (ret < 0) {
-    perror( "heater: writing file '%s' failed");
-    return ret;
-  } else if (ret != sizeof( heaters)) {
-    return -1;
+  for (int ix = 0 ; ix < num_heater_channels && ret == 0 ; ++ix) {
+    if (write( fd, &heaters[ ix].pid_settings, sizeof( pid_settings)) != sizeof( pid_settings)) {
+      fprintf( stderr, "heater: writing file '%s' failed\n", fname);
+      ret = -1;
+    }
   }
-  return 0;
+  pthread_rwlock_unlock( &control_lock);
+  close( fd);
+  return ret;
 }
 
 
@@ -421,23 +997,23 @@ int heater_save_settings( void)
 int heater_load_settings( void)
 {
   int fd;
-  int ret;
+  int ret = 0;
   
-  fd = open( fname, O_WRONLY);
+  fd = open( fname, O_RDONLY);
   if (fd < 0) {
-    perror( "heater: opening of file '%s' failed");
+    fprintf( stderr, "heater: opening of file '%s' failed: %s\n", fname, strerror( errno));
     return -1;
   }
   pthread_rwlock_wrlock( &control_lock);
-  ret = read( fd, heaters, sizeof( heaters));
-  pthread_rwlock_unlock( &control_lock);
-  if (ret < 0) {
-    perror( "heater: reading file '%s' failed");
-    return ret;
-  } else if (ret != sizeof( heaters)) {
-    return -1;
+  for (int ix = 0 ; ix < num_heater_channels && ret == 0 ; ++ix) {
+    if (read( fd, &heaters[ ix].pid_settings, sizeof( pid_settings)) != sizeof( pid_settings)) {
+      fprintf( stderr, "heater: reading file '%s' failed\n", fname);
+      ret = -1;
+    }
   }
-  return 0;
+  pthread_rwlock_unlock( &control_lock);
+  close( fd);
+  return ret;
 }
 
 channel_tag heater_lookup_by_name( const char* name)
@@ -16,12 +16,26 @@ typedef struct {
   double	FF_offset;
 } pid_settings;
 
+/*
+ * First order plus dead time model of a heater, used by the
+ * model based controller. A zero gain means: no model.
+ */
+typedef struct {
+  double	gain;		// temperature rise per % output [C/%]
+  double	tau;		// time constant [s]
+  double	dead_time;	// [s]
+  double	ambient;	// [C]
+  double	load_factor;	// extra output per unit of load (extruder: [%/(mm/s)] filament)
+} thermal_model;
+
 typedef const struct {
   channel_tag		tag;
   channel_tag		analog_input;
   channel_tag		analog_output;
   pid_settings		pid;
   double		setpoint;
+  thermal_model		model;		// optional, enables model based control
+  double		power;		// [W] at 100%, zero: not part of the power budget
 } heater_config_record;
 
 
@@ -40,6 +54,15 @@ extern int heater_enable( channel_tag heater, int state);
 extern int heater_set_raw_pwm( channel_tag heater, double percentage);
 extern int heater_get_celsius( channel_tag heater_channel, double* pcelsius);
 extern int heater_temp_reached( channel_tag heater);
+extern int heater_emergency_stop( void);
+extern int heater_autotune_start( channel_tag heater, double setpoint, double power);
+extern int heater_autotune_status( channel_tag heater, pid_settings* result);
+extern event* heater_get_tune_event( void);
+extern int heater_identify_start( channel_tag heater, double max_celsius);
+extern int heater_identify_status( channel_tag heater, thermal_model* result);
+extern int heater_set_model( channel_tag heater, const thermal_model* model, int enable);
+extern int heater_get_model( channel_tag heater, thermal_model* model, int* enabled);
+extern int heater_set_load( channel_tag heater, double load);
 
 extern channel_tag heater_lookup_by_name( const char* name);
 
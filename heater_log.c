@@ -0,0 +1,255 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "heater_log.h"
+#include "beaglebone.h"
+#include "bebopr.h"
+#include "debug.h"
+#include "mendel.h"
+
+/*
+ * Single producer (the heater thread), single consumer (the writer
+ * thread) ring. Both indices only increase, the producer writes 'head',
+ * the consumer writes 'tail'. The size must be a power of two.
+ */
+#define RING_SIZE	1024
+
+static heater_log_record ring[ RING_SIZE];
+static volatile unsigned int head = 0;
+static volatile unsigned int tail = 0;
+static volatile unsigned int dropped = 0;
+
+int heater_log_post( const heater_log_record* record)
+{
+  unsigned int ix = head;
+  if (ix - tail >= RING_SIZE) {
+    ++dropped;
+    return -1;
+  }
+  ring[ ix % RING_SIZE] = *record;
+  __sync_synchronize();		// record must be complete before it's published
+  head = ix + 1;
+  return 0;
+}
+
+unsigned int heater_log_dropped( void)
+{
+  return dropped;
+}
+
+/*
+ * Everything below runs in the writer thread only.
+ */
+#define MAX_LOG_FILES	4
+#define BATCH_SIZE	4096
+#define WRITER_PERIOD	250	/* ms */
+
+struct log_file {
+  const char*		name;
+  int			fd;
+  off_t			size;
+  int			used;
+  char			buffer[ BATCH_SIZE];
+};
+
+static struct log_file log_files[ MAX_LOG_FILES];
+static pid_t compressor = 0;
+
+static void log_file_name( char* s, size_t size, const char* name, const char* suffix)
+{
+  snprintf( s, size, "./pid-%s.log%s", name, suffix);
+}
+
+static void log_file_header( struct log_file* f)
+{
+  static const char header[] =
+	"---------------------------------------------------------------------------------------------\n"
+	"       time   channel         setpoint   temp       ff       p        i        d       out%\n"
+	"---------------------------------------------------------------------------------------------\n";
+  int len = strlen( header);
+  if (write( f->fd, header, len) == len) {
+    f->size += len;
+  }
+}
+
+/*
+ * Logging is enabled by creating the log file, only an existing
+ * file is appended to.
+ */
+static struct log_file* log_file_open( const char* name)
+{
+  struct log_file* free_slot = NULL;
+  for (int i = 0 ; i < MAX_LOG_FILES ; ++i) {
+    if (log_files[ i].name == name) {
+      return (log_files[ i].fd >= 0) ? &log_files[ i] : NULL;
+    }
+    if (log_files[ i].name == NULL && free_slot == NULL) {
+      free_slot = &log_files[ i];
+    }
+  }
+  if (free_slot == NULL) {
+    return NULL;
+  }
+  char s[ 270];
+  struct stat st;
+  log_file_name( s, sizeof( s), name, "");
+  if (debug_flags & DEBUG_HEATER) {
+    printf( "log_file_open - looking for existing logfile named '%s'\n", s);
+  }
+  free_slot->name = name;	// also remembers a failed open until closed
+  free_slot->used = 0;
+  free_slot->fd   = open( s, O_WRONLY | O_APPEND);
+  if (free_slot->fd < 0) {
+    perror( "Failed to open logile for append, logging disabled");
+    return NULL;
+  }
+  free_slot->size = (fstat( free_slot->fd, &st) == 0) ? st.st_size : 0;
+  if (debug_flags & DEBUG_HEATER) {
+    printf( "log_file_open - appending to file '%s'\n", s);
+  }
+  log_file_header( free_slot);
+  return free_slot;
+}
+
+static void log_file_flush( struct log_file* f)
+{
+  if (f->fd >= 0 && f->used > 0) {
+    if (write( f->fd, f->buffer, f->used) == f->used) {
+      f->size += f->used;
+    } else {
+      fprintf( stderr, "heater_log: write to log for '%s' failed\n", f->name);
+    }
+  }
+  f->used = 0;
+}
+
+/*
+ * Move a full log file out of the way and continue in a new one,
+ * optionally compress the old file in a background process.
+ */
+static void log_file_rotate( struct log_file* f)
+{
+  char s[ 270];
+  char old[ 270];
+  log_file_name( s, sizeof( s), f->name, "");
+  log_file_name( old, sizeof( old), f->name, ".1");
+  close( f->fd);
+  f->fd = -1;
+  if (rename( s, old) < 0) {
+    perror( "heater_log: rotate failed");
+  }
+  f->fd   = open( s, O_WRONLY | O_APPEND | O_CREAT, 0644);
+  f->size = 0;
+  if (f->fd < 0) {
+    perror( "heater_log: cannot create new log file, logging disabled");
+    return;
+  }
+  log_file_header( f);
+  if (config_heater_log_compress() && compressor == 0) {
+    char* argv[] = { "gzip", "-f", old, NULL };
+    if (posix_spawnp( &compressor, "gzip", NULL, NULL, argv, NULL) != 0) {
+      compressor = 0;
+    }
+  }
+}
+
+static void log_file_close( const char* name)
+{
+  for (int i = 0 ; i < MAX_LOG_FILES ; ++i) {
+    struct log_file* f = &log_files[ i];
+    if (f->name == name) {
+      log_file_flush( f);
+      if (f->fd >= 0) {
+        close( f->fd);
+      }
+      f->fd   = -1;
+      f->name = NULL;
+    }
+  }
+}
+
+static void log_record( const heater_log_record* r)
+{
+  if (r->type == e_heater_log_close) {
+    log_file_close( r->name);
+    return;
+  }
+  struct log_file* f = log_file_open( r->name);
+  if (f == NULL) {
+    return;
+  }
+  char s[ 140];
+  int len = snprintf( s, sizeof( s),
+	"%7ld.%03ld   %-14s   %6.2f   %6.2f   %6.2f   %6.2f   %6.2f   %6.2f   %5.1f\n",
+	(long) r->time.tv_sec, r->time.tv_nsec / 1000000, r->name, r->setpoint, r->celsius,
+	r->out_ff, r->out_p, r->out_i, r->out_d, r->duty_cycle);
+  if (debug_flags & DEBUG_HEATER) {
+    printf( "%s", s);
+  }
+  if (f->used + len > BATCH_SIZE) {
+    log_file_flush( f);
+  }
+  memcpy( f->buffer + f->used, s, len);
+  f->used += len;
+}
+
+static void* heater_log_thread( void* arg)
+{
+  unsigned int last_dropped = 0;
+  long max_size = config_heater_log_max_size();
+  struct timespec period = {
+    .tv_sec  = 0,
+    .tv_nsec = WRITER_PERIOD * 1000000,
+  };
+
+  for (int i = 0 ; i < MAX_LOG_FILES ; ++i) {
+    log_files[ i].fd = -1;
+  }
+  while (1) {
+    nanosleep( &period, NULL);
+    while (tail != head) {
+      __sync_synchronize();	// read the record after seeing it published
+      log_record( &ring[ tail % RING_SIZE]);
+      __sync_synchronize();
+      tail = tail + 1;
+    }
+    for (int i = 0 ; i < MAX_LOG_FILES ; ++i) {
+      struct log_file* f = &log_files[ i];
+      log_file_flush( f);
+      if (f->fd >= 0 && max_size > 0 && f->size > max_size) {
+        log_file_rotate( f);
+      }
+    }
+    if (compressor != 0 && waitpid( compressor, NULL, WNOHANG) != 0) {
+      compressor = 0;
+    }
+    if (dropped != last_dropped) {
+      last_dropped = dropped;
+      fprintf( stderr, "heater_log: ring full, %u records dropped so far\n", last_dropped);
+    }
+  }
+  return NULL;
+}
+
+static pthread_t worker;
+
+int heater_log_init( void)
+{
+  if (mendel_thread_create( "heater_log", &worker, NULL, &heater_log_thread, NULL) != 0) {
+    return -1;
+  }
+  struct sched_param param = {
+    .sched_priority = LOG_PRIO
+  };
+  pthread_setschedparam( worker, LOG_SCHED, &param);
+  return 0;
+}
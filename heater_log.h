@@ -0,0 +1,36 @@
+#ifndef _HEATER_LOG_H
+#define _HEATER_LOG_H
+
+#include <time.h>
+
+/*
+ * Logging of the heater control loop. The control thread posts binary
+ * records into a lock-free ring, a low priority thread formats these
+ * and writes them to the log files. Posting never blocks, if the ring
+ * is full the record is dropped and counted.
+ */
+
+typedef enum {
+  e_heater_log_data,
+  e_heater_log_close,		// heater disabled, close its log file
+} heater_log_type;
+
+typedef struct {
+  heater_log_type	type;
+  const char*		name;		// channel name, selects the log file
+  struct timespec	time;
+  float			setpoint;
+  float			celsius;
+  float			error;
+  float			out_ff;
+  float			out_p;
+  float			out_i;
+  float			out_d;
+  float			duty_cycle;
+} heater_log_record;
+
+extern int heater_log_init( void);
+extern int heater_log_post( const heater_log_record* record);
+extern unsigned int heater_log_dropped( void);
+
+#endif
@@ -0,0 +1,169 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "history.h"
+#include "beaglebone.h"
+#include "debug.h"
+
+/*
+ * Tier 0 holds one second averages of the control cycles, every next
+ * tier averages a number of samples of the tier before it.
+ */
+const history_tier history_tiers[] = {
+  { .resolution =  1, .length = 600 },	// 10 minutes
+  { .resolution = 10, .length = 720 },	// 2 hours
+};
+const int history_nr_tiers = NR_ITEMS( history_tiers);
+
+#define MAX_HISTORY_CHANNELS	4
+#define MAX_TIERS		NR_ITEMS( history_tiers)
+
+struct accumulator {
+  double		celsius;
+  double		setpoint;
+  double		duty_cycle;
+  int			count;
+};
+
+struct ring {
+  history_sample*	samples;
+  unsigned int		count;		// free running number of samples added
+  time_t		time;		// time of the newest sample
+};
+
+struct history_channel {
+  channel_tag		id;
+  time_t		second;		// second being accumulated into tier 0
+  struct accumulator	acc[ MAX_TIERS];
+  struct ring		ring[ MAX_TIERS];
+};
+
+static struct history_channel channels[ MAX_HISTORY_CHANNELS];
+static int num_channels = 0;
+
+/*
+ * The lock is only held to add a sample or to copy out a query, the
+ * control thread must not wait long for a (lower priority) reader.
+ */
+static pthread_mutex_t history_lock;
+static pthread_once_t history_once = PTHREAD_ONCE_INIT;
+
+static void history_lock_init( void)
+{
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init( &attr);
+  pthread_mutexattr_setprotocol( &attr, PTHREAD_PRIO_INHERIT);
+  pthread_mutex_init( &history_lock, &attr);
+  pthread_mutexattr_destroy( &attr);
+}
+
+channel_handle history_register( channel_tag channel)
+{
+  pthread_once( &history_once, history_lock_init);
+  if (num_channels >= MAX_HISTORY_CHANNELS) {
+    fprintf( stderr, "history_register: no room for channel '%s'\n", tag_name( channel));
+    return INVALID_HANDLE;
+  }
+  struct history_channel* pd = &channels[ num_channels];
+  memset( pd, 0, sizeof( *pd));
+  for (int tier = 0 ; tier < MAX_TIERS ; ++tier) {
+    pd->ring[ tier].samples = calloc( history_tiers[ tier].length, sizeof( history_sample));
+    if (pd->ring[ tier].samples == NULL) {
+      return INVALID_HANDLE;
+    }
+  }
+  pd->id = channel;
+  return num_channels++;
+}
+
+static void accumulate( struct accumulator* acc, double celsius, double setpoint, double duty_cycle)
+{
+  acc->celsius    += celsius;
+  acc->setpoint   += setpoint;
+  acc->duty_cycle += duty_cycle;
+  ++acc->count;
+}
+
+/*
+ * Move the average of an accumulator into the ring of a tier and
+ * propagate it into the next tier. Called with history_lock held.
+ */
+static void history_push( struct history_channel* pd, int tier, time_t time)
+{
+  struct accumulator* acc = &pd->acc[ tier];
+  struct ring* ring = &pd->ring[ tier];
+  if (acc->count == 0) {
+    return;
+  }
+  history_sample* sample = &ring->samples[ ring->count % history_tiers[ tier].length];
+  sample->celsius    = acc->celsius / acc->count;
+  sample->setpoint   = acc->setpoint / acc->count;
+  sample->duty_cycle = acc->duty_cycle / acc->count;
+  ++ring->count;
+  ring->time = time;
+  memset( acc, 0, sizeof( *acc));
+  if (tier + 1 < MAX_TIERS) {
+    accumulate( &pd->acc[ tier + 1], sample->celsius, sample->setpoint, sample->duty_cycle);
+    if (pd->acc[ tier + 1].count * history_tiers[ tier].resolution >= history_tiers[ tier + 1].resolution) {
+      history_push( pd, tier + 1, time);
+    }
+  }
+}
+
+/*
+ * Add the values of one control cycle, called by the heater thread.
+ */
+void history_add( channel_handle channel, const struct timespec* ts,
+		  double celsius, double setpoint, double duty_cycle)
+{
+  if (channel < 0 || channel >= num_channels) {
+    return;
+  }
+  struct history_channel* pd = &channels[ channel];
+  if (ts->tv_sec != pd->second) {
+    if (pd->acc[ 0].count > 0) {
+      pthread_mutex_lock( &history_lock);
+      history_push( pd, 0, pd->second);
+      pthread_mutex_unlock( &history_lock);
+    }
+    pd->second = ts->tv_sec;
+  }
+  accumulate( &pd->acc[ 0], celsius, setpoint, duty_cycle);
+}
+
+/*
+ * Copy the most recent samples of a tier, oldest first. Returns the
+ * number of samples copied, 'age' is set to the number of seconds
+ * since the newest sample was taken.
+ */
+int history_query( channel_tag channel, int tier, history_sample* samples, int max_samples, int* age)
+{
+  if (tier < 0 || tier >= MAX_TIERS) {
+    return -1;
+  }
+  for (int ix = 0 ; ix < num_channels ; ++ix) {
+    struct history_channel* pd = &channels[ ix];
+    if (pd->id == channel) {
+      struct timespec now;
+      int length = history_tiers[ tier].length;
+      pthread_mutex_lock( &history_lock);
+      struct ring* ring = &pd->ring[ tier];
+      int n = (ring->count < length) ? ring->count : length;
+      if (n > max_samples) {
+        n = max_samples;
+      }
+      for (int i = 0 ; i < n ; ++i) {
+        samples[ i] = ring->samples[ (ring->count - n + i) % length];
+      }
+      clock_gettime( CLOCK_MONOTONIC, &now);
+      if (age != NULL) {
+        *age = (ring->count > 0) ? now.tv_sec - ring->time : 0;
+      }
+      pthread_mutex_unlock( &history_lock);
+      return n;
+    }
+  }
+  return -1;
+}
@@ -0,0 +1,33 @@
+#ifndef _HISTORY_H
+#define _HISTORY_H
+
+#include <time.h>
+
+#include "beaglebone.h"
+
+/*
+ * In-memory history of the heaters: the per cycle values are averaged
+ * into tiers of decreasing resolution, so a monitoring client can fetch
+ * a complete graph with one request instead of polling M105.
+ */
+
+typedef struct {
+  float			celsius;
+  float			setpoint;
+  float			duty_cycle;	// [%]
+} history_sample;
+
+typedef struct {
+  int			resolution;	// [s]
+  int			length;		// number of samples kept
+} history_tier;
+
+extern const history_tier history_tiers[];
+extern const int history_nr_tiers;
+
+extern channel_handle history_register( channel_tag channel);
+extern void history_add( channel_handle channel, const struct timespec* ts,
+			 double celsius, double setpoint, double duty_cycle);
+extern int history_query( channel_tag channel, int tier, history_sample* samples, int max_samples, int* age);
+
+#endif
@@ -22,145 +22,373 @@
 static const double fclk = PRUSS_CLOCK;
 static const char axisNames[] = { '?', 'X', 'Y', 'Z', 'E' };
 
-// new_state is 1 when running towards the switch, 0 when running away from the switch!
-static int step_until_switch_change( axis_e axis, int reverse, int new_state, int pruss_axis,
-				uint32_t c0, uint32_t cmin, int direction, int32_t* position, int32_t ramp)
+// maximum distance [m] traveled to release a switch
+#define HOME_RELEASE_DISTANCE	0.010
+// upper limit [s] for the wait until a bouncing switch is stable
+#define HOME_DEBOUNCE_TIMEOUT	0.500
+
+/*
+ * State of one axis during a (multi-axis) home operation.
+ */
+typedef struct {
+  axis_e	axis;
+  int		pruss_axis;
+  int		reverse;	// towards minimum (1) or maximum switch (0)
+  int		direction;	// absolute direction of current move
+  int		active;		// takes part in the current phase
+  int		failed;		// switch not found, the position is not known
+  uint8_t	mask;		// limit switch bit in the PRUSS input mask
+  uint8_t	invert;		// same bit if switch is active low
+  uint32_t	c0;
+  uint32_t	cmin;
+  int32_t	ramp;
+  int32_t	distance;	// maximum travel during the current phase
+  int32_t*	position;
+  int32_t	old_position;
+} home_axis_state;
+
+static int switch_is_active( const home_axis_state* s)
 {
-  /* Clear internal position information */
-  {
-    int32_t virtPosI;
-    int32_t virtPosI_new;
-    uint8_t mask;
-    uint8_t invert;
-    int     gpiobit;
-    int32_t delta;
-
-    switch (axis) {
-    case x_axis: gpiobit = (reverse) ? XMIN_GPIO : XMAX_GPIO; break;
-    case y_axis: gpiobit = (reverse) ? YMIN_GPIO : YMAX_GPIO; break;
-    case z_axis: gpiobit = (reverse) ? ZMIN_GPIO : ZMAX_GPIO; break;
-    default: return 0;
-    }
-    mask = 1 << ((gpiobit % 16) - 8);	// bit magic, map gpio bit to PRUSS positions
-    if ( ( reverse && config_min_limit_switch_is_active_low( axis)) ||
-         (!reverse && config_max_limit_switch_is_active_low( axis)) ) {
-      invert = mask;
-    } else {
-      invert = 0;
-    }
-    pruss_get_positions( pruss_axis, &virtPosI, NULL);
-    if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
-      printf( "  Home: axis %d, starting at virtPos= %d\n", pruss_axis, virtPosI);
-    }
-    delta = SI2POS( (new_state) ? 0.500 : 0.010);
-    if (delta > ramp) {
-      delta -= ramp;
-    } else {
-      delta = 0;
+  return (s->reverse) ? limsw_min( s->axis) : limsw_max( s->axis);
+}
+
+// Calculate the step timing for a run at 'feed' with acceleration 'a'
+static void set_home_speed( home_axis_state* s, double feed, double a)
+{
+  double si_step_size = config_get_step_size( s->axis);
+  const double c_acc = 282842712.5;	// = fclk * sqrt( 2.0);
+  double si_speed = feed / 60000.0;
+
+  s->cmin = fclk * si_step_size / si_speed ;
+  s->c0   = (uint32_t) (c_acc * sqrt( si_step_size / a));
+  s->ramp = SI2POS( si_speed * si_speed / ( 2 * a));
+  /*
+   * If we can start running faster than the target speed, no acceleration is needed
+   */
+  if (s->c0 < s->cmin) {
+    s->c0 = s->cmin;
+    s->ramp = 0;
+  }
+}
+
+/*
+ * Run all axes in parallel until each one sees its limit switch change state.
+ * new_state is 1 when running towards the switch, 0 when running away from the switch!
+ * All axes share a single execute command with the combined switch mask. If the PRUSS
+ * stops all axes at the first switch change, the axes that did not reach their own
+ * switch yet are simply started again.
+ */
+static int step_until_switch_change( home_axis_state* axes, int nr_axes, int new_state)
+{
+  int pending[ nr_axes];
+  int nr_pending = 0;
+  int i;
+
+  for (i = 0 ; i < nr_axes ; ++i) {
+    pending[ i] = axes[ i].active;
+    nr_pending += pending[ i];
+  }
+  while (nr_pending > 0) {
+    int32_t virtPosI[ nr_axes];
+    int32_t requestedPos[ nr_axes];
+    int32_t delta[ nr_axes];
+    uint8_t mask = 0;
+    uint8_t invert = 0;
+
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      if (!pending[ i]) {
+        continue;
+      }
+      mask   |= s->mask;
+      invert |= s->invert;
+      pruss_get_positions( s->pruss_axis, &virtPosI[ i], NULL);
+      if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
+        printf( "  Home: axis %d, starting at virtPos= %d\n", s->pruss_axis, virtPosI[ i]);
+      }
+      delta[ i] = s->distance;
+      if (delta[ i] > s->ramp) {
+        delta[ i] -= s->ramp;
+      } else {
+        delta[ i] = 0;
+      }
     }
+    invert = (new_state) ? invert : ~invert;
     /*
      * Start a ramp followed by a dwell that will be terminated by a limitswitch state change.
      */
-    pruss_queue_accel( pruss_axis, 0, c0, cmin, *position + direction * ramp);
-    pruss_queue_exec_limited( mask, (new_state) ? invert : ~invert);
-    pruss_queue_dwell( pruss_axis, cmin, *position + direction * (ramp + delta));
-    pruss_queue_exec_limited( mask, (new_state) ? invert : ~invert);
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      if (pending[ i]) {
+        pruss_queue_accel( s->pruss_axis, 0, s->c0, s->cmin, *s->position + s->direction * s->ramp);
+      }
+    }
+    pruss_queue_exec_limited( mask, invert);
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      if (pending[ i]) {
+        pruss_queue_dwell( s->pruss_axis, s->cmin, *s->position + s->direction * (s->ramp + delta[ i]));
+      }
+    }
+    pruss_queue_exec_limited( mask, invert);
     traject_wait_for_completion();
+    // debounce electrical and mechanical, using the time of the last switch edge
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      if (pending[ i]) {
+        limsw_wait_stable( s->axis, !s->reverse, config_limsw_debounce_time(), HOME_DEBOUNCE_TIMEOUT);
+      }
+    }
 
-    pruss_get_positions( pruss_axis, &virtPosI_new, NULL);
-    if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
-      printf( "  Home: axis %d, ended at virtPos= %d\n",
-              pruss_axis, virtPosI_new);
+    int nr_done = 0;
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      int32_t virtPosI_new;
+      if (!pending[ i]) {
+        continue;
+      }
+      pruss_get_positions( s->pruss_axis, &virtPosI_new, &requestedPos[ i]);
+      if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
+        printf( "  Home: axis %d, ended at virtPos= %d\n",
+                s->pruss_axis, virtPosI_new);
+      }
+      int32_t delta_pos = virtPosI_new - virtPosI[ i];
+      *s->position += delta_pos;
+      if (switch_is_active( s) == new_state) {
+        if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
+          printf( "  %c: limit switch %s detected after %1.6lf [mm]\n",
+		  axisNames[ s->pruss_axis], (new_state) ? "activation" : "release", POS2MM( delta_pos));
+        }
+      } else if (virtPosI_new == requestedPos[ i]) {
+        fprintf( stderr, "  %c: limit switch %s not detected after %1.6lf [mm]\n",
+		 axisNames[ s->pruss_axis], (new_state) ? "activation" : "release", POS2MM( delta_pos));
+        // leave the axis out of the next phases
+        s->failed = 1;
+        s->active = 0;
+      } else {
+        continue;	// stopped by another axis, run again
+      }
+      pending[ i] = 0;
+      --nr_pending;
+      ++nr_done;
     }
-    int32_t delta_pos = virtPosI_new - virtPosI;
-    if (DEBUG_HOME && (debug_flags & DEBUG_HOME)) {
-      printf( "  %c: limit switch %s detected after %1.6lf [mm]\n",
-	      axisNames[ pruss_axis], (new_state) ? "activation" : "release", POS2MM( delta_pos));
+    if (nr_done == 0) {
+      // should not happen, prevent an endless loop if the switch state is not seen
+      fprintf( stderr, "  Home: stopped without any limit switch change, giving up\n");
+      return 0;
     }
-    *position += delta_pos;
   }
-  usleep( 500 * 1000);	// debounce electrical and mechanical
   return 1;
 }
 
-// Execute the actual homing operation. The hardware selected with the 'axis'
-// variable must exist or we'll fail miserably, so filter before calling here!
-// reverse determines the direction: towards minimum (1) or maximum switch (0)
-static int run_home_one_axis( axis_e axis, int reverse, int32_t* position, uint32_t feed)
+/*
+ * Move the active axes over their 'distance' without looking at the switches.
+ */
+static void move_axes( home_axis_state* axes, int nr_axes)
 {
-  int direction = (reverse) ? -1 : 1;	// absolute direction of current move
-  int pruss_axis = 0;
-  double si_step_size = config_get_step_size( axis);
-  double a_max = config_get_max_accel( axis);
-  const double c_acc = 282842712.5;	// = fclk * sqrt( 2.0);
-  uint32_t c0;
-  uint32_t cmin;
-  double si_speed;
-  uint32_t ramp;
+  int i;
 
-  switch (axis) {
-  case x_axis: pruss_axis = 1; break;
-  case y_axis: pruss_axis = 2; break;
-  case z_axis: pruss_axis = 3; break;
-  default:
-    fprintf( stderr, "BUG: trying to home illegal axis (%d)!\n", axis);
-    pruss_axis = 0;
+  for (i = 0 ; i < nr_axes ; ++i) {
+    home_axis_state* s = &axes[ i];
+    if (s->active && s->distance > 0) {
+      pruss_queue_dwell( s->pruss_axis, s->cmin, *s->position + s->direction * s->distance);
+      *s->position += s->direction * s->distance;
+    }
   }
-  if (feed > config_get_home_max_feed( axis)) {
-    feed = config_get_home_max_feed( axis);
-    if (debug_flags & DEBUG_HOME) {
-      printf( "  %c: limiting home speed to %d\n", axisNames[ pruss_axis], feed);
+  pruss_queue_exec_limited( 0, 0);
+  traject_wait_for_completion();
+}
+
+// Execute the actual homing operation for one or more axes in parallel.
+// The hardware selected with the 'axis' fields must exist or we'll fail
+// miserably, so filter before calling here!
+// The switch is found with a fast approach at full acceleration, then
+// released. If a probe feed is configured, the axis backs off a little
+// and the switch is approached and released again at that (low) feed.
+// The position where the switch releases becomes the home position.
+static int run_home_axes( home_axis_state* axes, int nr_axes, uint32_t feed)
+{
+  int nr_probe = 0;
+  int i;
+
+  for (i = 0 ; i < nr_axes ; ++i) {
+    home_axis_state* s = &axes[ i];
+    int gpiobit;
+    uint32_t axis_feed = feed;
+
+    switch (s->axis) {
+    case x_axis: s->pruss_axis = 1; gpiobit = (s->reverse) ? XMIN_GPIO : XMAX_GPIO; break;
+    case y_axis: s->pruss_axis = 2; gpiobit = (s->reverse) ? YMIN_GPIO : YMAX_GPIO; break;
+    case z_axis: s->pruss_axis = 3; gpiobit = (s->reverse) ? ZMIN_GPIO : ZMAX_GPIO; break;
+    default:
+      fprintf( stderr, "BUG: trying to home illegal axis (%d)!\n", s->axis);
+      return 0;
+    }
+    s->mask = 1 << ((gpiobit % 16) - 8);	// bit magic, map gpio bit to PRUSS positions
+    if ( ( s->reverse && config_min_limit_switch_is_active_low( s->axis)) ||
+         (!s->reverse && config_max_limit_switch_is_active_low( s->axis)) ) {
+      s->invert = s->mask;
+    } else {
+      s->invert = 0;
+    }
+    if (axis_feed > config_get_max_feed( s->axis)) {
+      axis_feed = config_get_max_feed( s->axis);
+    }
+    if (axis_feed > config_get_home_max_feed( s->axis)) {
+      axis_feed = config_get_home_max_feed( s->axis);
+      if (debug_flags & DEBUG_HOME) {
+        printf( "  %c: limiting home speed to %d\n", axisNames[ s->pruss_axis], axis_feed);
+      }
     }
+    s->active = 1;
+    s->direction = (s->reverse) ? -1 : 1;
+    s->distance = SI2POS( config_get_home_search_distance( s->axis));
+    s->old_position = *s->position;
+    set_home_speed( s, axis_feed, config_get_max_accel( s->axis));
   }
   /*
-   * Calculate settings for acceleration at 25% of maximum
+   * Fast approach, run towards the switch
    */
-  double a = 0.25 * a_max;
-  si_speed = feed / 60000.0;
-  cmin = fclk * si_step_size / si_speed ;
-  c0   = (uint32_t) (c_acc * sqrt( si_step_size / a));
-  ramp = SI2POS( si_speed * si_speed / ( 2 * a));
-  /*
-   * If we can start running faster than the target speed, no acceleration is needed
-   */
-  if (c0 < cmin) {
-    c0 = cmin;
-    ramp = 0;
+  if (!step_until_switch_change( axes, nr_axes, 1)) {
+    return 0;
+  }
+  for (i = 0 ; i < nr_axes ; ++i) {
+    home_axis_state* s = &axes[ i];
+    set_home_speed( s, config_get_home_release_feed( s->axis), 0.25 * config_get_max_accel( s->axis));
+    s->direction = -s->direction;
+    s->distance = SI2POS( HOME_RELEASE_DISTANCE);
   }
   /*
-   * Run towards the switch, reversing direction
+   * Run away from the switch, reversing direction
    */
-  int32_t old_position = *position;
-  if (!step_until_switch_change( axis, reverse, 1, pruss_axis, c0, cmin, direction, position, ramp)) {
+  if (!step_until_switch_change( axes, nr_axes, 0)) {
     return 0;
   }
-  si_speed = config_get_home_release_feed( axis) / 60000.0;
-  c0   = (uint32_t) (c_acc * sqrt( si_step_size / a));
-  cmin = fclk * si_step_size / si_speed ;
-  ramp = SI2POS( si_speed * si_speed / ( 2 * a));
-  if (c0 < cmin) {
-    c0 = cmin;
-    ramp = 0;
-  }
-  direction = -direction;
   /*
-   * Run away from the switch
+   * Back off and repeat at the probe feed for a precise position
    */
-  if (!step_until_switch_change( axis, reverse, 0, pruss_axis, c0, cmin, direction, position, ramp)) {
-    return 0;
+  for (i = 0 ; i < nr_axes ; ++i) {
+    home_axis_state* s = &axes[ i];
+    s->active = !s->failed && (config_get_home_probe_feed( s->axis) > 0.0);
+    s->distance = SI2POS( config_get_home_backoff_distance( s->axis));
+    nr_probe += s->active;
+  }
+  if (nr_probe > 0) {
+    move_axes( axes, nr_axes);
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      set_home_speed( s, config_get_home_probe_feed( s->axis), 0.25 * config_get_max_accel( s->axis));
+      s->direction = -s->direction;
+      s->distance = 2 * s->distance + SI2POS( HOME_RELEASE_DISTANCE);
+    }
+    if (!step_until_switch_change( axes, nr_axes, 1)) {
+      return 0;
+    }
+    for (i = 0 ; i < nr_axes ; ++i) {
+      home_axis_state* s = &axes[ i];
+      s->direction = -s->direction;
+      s->distance = SI2POS( HOME_RELEASE_DISTANCE);
+    }
+    if (!step_until_switch_change( axes, nr_axes, 0)) {
+      return 0;
+    }
+  }
+  for (i = 0 ; i < nr_axes ; ++i) {
+    home_axis_state* s = &axes[ i];
+    fprintf( stderr, "Home operation on %c-axis resulted in netto move of %1.6lf [mm]\n",
+	    axisNames[ s->pruss_axis], POS2MM( *s->position - s->old_position));
   }
-  int32_t new_position = *position;
-  fprintf( stderr, "Home operation on %c-axis resulted in netto move of %1.6lf [mm]\n",
-	  axisNames[ pruss_axis], POS2MM( new_position - old_position));
   return 1;
 }
 
-/// home the selected axis to the selected limit switch.
-static void home_one_axis( axis_e axis, int reverse, int32_t* position, uint32_t feed)
+/// home the selected axes to the selected limit switches, all at the same time.
+/// positions[] holds the X, Y and Z position, NULL for an axis that is not homed.
+/// Returns 0 on success, otherwise a mask with bit (1 << axis) set for each
+/// axis where the switch was not found.
+static int home_axes( int reverse, int32_t* positions[ 3], uint32_t feed)
+{
+  int failed = 0;
+  static const axis_e xyz[ 3] = { x_axis, y_axis, z_axis };
+  home_axis_state axes[ 3];
+  int nr_axes = 0;
+  int i;
+
+  for (i = 0 ; i < 3 ; ++i) {
+    if (positions[ i] == NULL) {
+      continue;
+    }
+    if ((reverse) ? !config_axis_has_min_limit_switch( xyz[ i]) : !config_axis_has_max_limit_switch( xyz[ i])) {
+      continue;
+    }
+    home_axis_state s = {
+      .axis	= xyz[ i],
+      .reverse	= reverse,
+      .position	= positions[ i],
+    };
+    axes[ nr_axes++] = s;
+  }
+  if (nr_axes > 0) {
+    traject_set_homing( 1);
+    traject_wait_for_completion();
+    // move to the limit switches or sensors
+    int ok = run_home_axes( axes, nr_axes, feed);
+    traject_set_homing( 0);
+    for (i = 0 ; i < nr_axes ; ++i) {
+      if (!ok || axes[ i].failed) {
+        failed |= 1 << axes[ i].axis;
+      }
+    }
+  }
+  return failed;
+}
+
+/*
+ * Probe: run the axis towards its minimum switch for at most 'distance' [m]
+ * at 'feed' and stop where the switch activates. Returns 1 if the switch
+ * was found, 0 if not. The axis is left at the trigger position.
+ */
+int probe_axis_to_min_switch( axis_e axis, int32_t* position, double distance, uint32_t feed)
 {
+  home_axis_state s = {
+    .axis	= axis,
+    .reverse	= 1,
+    .direction	= -1,
+    .active	= 1,
+    .distance	= SI2POS( distance),
+    .position	= position,
+  };
+  int gpiobit;
+
+  switch (axis) {
+  case x_axis: s.pruss_axis = 1; gpiobit = XMIN_GPIO; break;
+  case y_axis: s.pruss_axis = 2; gpiobit = YMIN_GPIO; break;
+  case z_axis: s.pruss_axis = 3; gpiobit = ZMIN_GPIO; break;
+  default:
+    return 0;
+  }
+  if (!config_axis_has_min_limit_switch( axis)) {
+    return 0;
+  }
+  s.mask = 1 << ((gpiobit % 16) - 8);	// bit magic, map gpio bit to PRUSS positions
+  s.invert = (config_min_limit_switch_is_active_low( axis)) ? s.mask : 0;
+  set_home_speed( &s, feed, 0.25 * config_get_max_accel( axis));
+  traject_set_homing( 1);
   traject_wait_for_completion();
-  // move to a limit switch or sensor
-  run_home_one_axis( axis, reverse, position, feed);
+  // already triggered, or moved until it activates
+  int found = switch_is_active( &s) ||
+	      (step_until_switch_change( &s, 1, 1) && switch_is_active( &s));
+  traject_set_homing( 0);
+  return found;
+}
+
+int home_axes_to_min_limit_switches( int32_t* positions[ 3], uint32_t feed)
+{
+  return home_axes( 1 /* reverse */, positions, feed);
+}
+
+int home_axes_to_max_limit_switches( int32_t* positions[ 3], uint32_t feed)
+{
+  return home_axes( 0 /* forward */, positions, feed);
 }
 
 /// Position at a switch or sensor, if that switch is present. If not, keep
@@ -168,24 +396,29 @@ static void home_one_axis( axis_e axis, int reverse, int32_t* position, uint32_t
 /// assigning a home position.
 /// If the switch is configured as home / reference, set the current position
 /// from the reference value. Otherwise the current position is not changed.
-void home_axis_to_min_limit_switch( axis_e axis, int32_t* position, uint32_t feed)
+/// Returns 0 on success, -1 if the switch was not found.
+int home_axis_to_min_limit_switch( axis_e axis, int32_t* position, uint32_t feed)
 {
-  if (config_axis_has_min_limit_switch( axis)) {
-    uint32_t max_feed = (uint32_t) config_get_max_feed( axis);
-    if (feed > max_feed) {
-      feed = max_feed;
+  int32_t* positions[ 3] = { NULL, NULL, NULL };
+
+  if (axis <= z_axis) {
+    positions[ axis - x_axis] = position;
+    if (home_axes_to_min_limit_switches( positions, feed) != 0) {
+      return -1;
     }
-    home_one_axis( axis, 1 /* reverse */, position, feed);
   }
+  return 0;
 }
 
-void home_axis_to_max_limit_switch( axis_e axis, int32_t* position, uint32_t feed)
+int home_axis_to_max_limit_switch( axis_e axis, int32_t* position, uint32_t feed)
 {
-  if (config_axis_has_max_limit_switch( axis)) {
-    uint32_t max_feed = (uint32_t) config_get_max_feed( axis);
-    if (feed > max_feed) {
-      feed = max_feed;
+  int32_t* positions[ 3] = { NULL, NULL, NULL };
+
+  if (axis <= z_axis) {
+    positions[ axis - x_axis] = position;
+    if (home_axes_to_max_limit_switches( positions, feed) != 0) {
+      return -1;
     }
-    home_one_axis( axis, 0 /* forward */, position, feed);
   }
+  return 0;
 }
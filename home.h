@@ -3,7 +3,16 @@
 
 #include "bebopr.h"
 
-extern void home_axis_to_min_limit_switch( axis_e axis, int32_t* position, uint32_t feed);
-extern void home_axis_to_max_limit_switch( axis_e axis, int32_t* position, uint32_t feed);
+// Returns 0 on success, -1 if the switch was not found
+extern int home_axis_to_min_limit_switch( axis_e axis, int32_t* position, uint32_t feed);
+extern int home_axis_to_max_limit_switch( axis_e axis, int32_t* position, uint32_t feed);
+
+// Home several axes at once, positions[] holds X, Y and Z, NULL if not selected.
+// Returns 0 on success, otherwise a mask with bit (1 << axis) set for each failed axis
+extern int home_axes_to_min_limit_switches( int32_t* positions[ 3], uint32_t feed);
+extern int home_axes_to_max_limit_switches( int32_t* positions[ 3], uint32_t feed);
+
+// Move towards the minimum switch until it activates, returns 1 if found
+extern int probe_axis_to_min_switch( axis_e axis, int32_t* position, double distance, uint32_t feed);
 
 #endif	/* _HOME_H */
@@ -7,6 +7,7 @@
 #include <poll.h>
 #include <pthread.h>
 #include <errno.h>
+#include <time.h>
 
 #include "limit_switches.h"
 #include "mendel.h"
@@ -14,6 +15,8 @@
 #include "gpio.h"
 #include "debug.h"
 #include "beaglebone.h"
+#include "seqlock.h"
+#include "pruss_stepper.h"
 
 /*
  * Limit switch handling
@@ -30,6 +33,23 @@ static int y_max_state;
 static int z_min_state;
 static int z_max_state;
 
+/*
+ * Edge timing and statistics, indexed like limit_gpios[]. The watcher
+ * thread is the only writer, it publishes the statistics through a
+ * seqlatch and the edges through a ring that is overwritten when full.
+ */
+static seqlatch stats_latch;
+static limsw_stats stats_copies[ 2];
+static limsw_stats stats;		// watcher's working copy
+
+#define LIMSW_EVENT_LOG_SIZE	256
+static limsw_event event_log[ LIMSW_EVENT_LOG_SIZE];
+static volatile unsigned int event_head = 0;
+
+static const char* limsw_names[ NR_LIMIT_SWITCHES] = {
+  "x_min", "x_max", "y_min", "y_max", "z_min", "z_max"
+};
+
 int limsw_max( axis_e axis)
 {
   int active_state = !config_max_limit_switch_is_active_low( axis);
@@ -52,6 +72,132 @@ int limsw_min( axis_e axis)
   }
 }
 
+static double elapsed( const struct timespec* t0, const struct timespec* t1)
+{
+  return (t1->tv_sec - t0->tv_sec) + 1.0E-9 * (t1->tv_nsec - t0->tv_nsec);
+}
+
+int limsw_wait_stable( axis_e axis, int max_switch, double stable_time, double timeout)
+{
+  struct timespec start;
+  struct timespec now;
+  limsw_stats t;
+  int ix;
+
+  switch (axis) {
+  case x_axis: ix = 0; break;
+  case y_axis: ix = 2; break;
+  case z_axis: ix = 4; break;
+  default:     return 0;
+  }
+  if (max_switch) {
+    ++ix;
+  }
+  clock_gettime( CLOCK_MONOTONIC, &start);
+  for (;;) {
+    seqlatch_read( &stats_latch, stats_copies, &t, sizeof( t));
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    double stable = elapsed( &t.sw[ ix].change, &now);
+    if (stable >= stable_time) {
+      return 0;
+    }
+    if (elapsed( &start, &now) >= timeout) {
+      return -1;
+    }
+    // sleep until the switch would be stable, then check for new edges
+    double wait = stable_time - stable;
+    struct timespec delay = {
+      .tv_sec  = (time_t) wait,
+      .tv_nsec = (long) (1.0E9 * (wait - (time_t) wait)),
+    };
+    clock_nanosleep( CLOCK_MONOTONIC, 0, &delay, NULL);
+  }
+}
+
+const char* limsw_name( int limsw)
+{
+  return (limsw >= 0 && limsw < NR_LIMIT_SWITCHES) ? limsw_names[ limsw] : "?";
+}
+
+int limsw_get_events( limsw_event* events, int max)
+{
+  unsigned int head = event_head;
+  unsigned int count;
+  unsigned int first;
+  unsigned int i;
+
+  if (max > LIMSW_EVENT_LOG_SIZE) {
+    max = LIMSW_EVENT_LOG_SIZE;
+  }
+  count = (head < (unsigned int) max) ? head : (unsigned int) max;
+  first = head - count;
+  __sync_synchronize();
+  for (i = 0 ; i < count ; ++i) {
+    events[ i] = event_log[ (first + i) % LIMSW_EVENT_LOG_SIZE];
+  }
+  __sync_synchronize();
+  // drop the entries the watcher may have overwritten while we were copying
+  head = event_head;
+  if (head >= LIMSW_EVENT_LOG_SIZE && head - LIMSW_EVENT_LOG_SIZE + 1 > first) {
+    unsigned int skip = head - LIMSW_EVENT_LOG_SIZE + 1 - first;
+    if (skip > count) {
+      skip = count;
+    }
+    for (i = skip ; i < count ; ++i) {
+      events[ i - skip] = events[ i];
+    }
+    count -= skip;
+  }
+  return count;
+}
+
+void limsw_get_stats( limsw_stats* s)
+{
+  seqlatch_read( &stats_latch, stats_copies, s, sizeof( *s));
+}
+
+/*
+ * Called by the watcher for each edge: log it and update the statistics.
+ * The kernel doesn't time stamp the edges, so only the time the watcher
+ * needs from its wakeup until the state has been read is measured.
+ */
+static void limsw_record_edge( int limsw, int state, const struct timespec* wakeup, uint32_t pru_cycles)
+{
+  struct timespec now;
+  limsw_switch_stats* sw = &stats.sw[ limsw];
+
+  clock_gettime( CLOCK_MONOTONIC, &now);
+  double read_time = elapsed( wakeup, &now);
+  limsw_event* e = &event_log[ event_head % LIMSW_EVENT_LOG_SIZE];
+  e->time	= *wakeup;
+  e->pru_cycles	= pru_cycles;
+  e->read_time	= (uint32_t) (1.0E9 * read_time);
+  e->limsw	= limsw;
+  e->state	= state;
+  __sync_synchronize();
+  ++event_head;
+
+  if (sw->edges > 0 && elapsed( &sw->change, wakeup) < config_limsw_debounce_time()) {
+    ++sw->bounces;
+    double burst = elapsed( &sw->burst_start, wakeup);
+    if (burst > sw->max_burst) {
+      sw->max_burst = burst;
+    }
+  } else {
+    sw->burst_start = *wakeup;
+  }
+  ++sw->edges;
+  sw->change = *wakeup;
+  unsigned int us = (unsigned int) (1.0E6 * read_time);
+  int bin = 0;
+  while (us > 0 && bin < LIMSW_READ_TIME_BINS - 1) {
+    us >>= 1;
+    ++bin;
+  }
+  ++stats.read_time[ bin];
+  seqlatch_write( &stats_latch, stats_copies, &stats, sizeof( stats));
+}
+
 typedef struct {
   int   gpio_pin_nr;
   int   active_low;
@@ -73,6 +219,7 @@ static void* limsw_watcher( void* arg)
   int i;
   unsigned int gpio[ nr_limits];
   int gpio_fd[ nr_limits];
+  int initial[ nr_limits];
   char buf[ 3];
   int len;
 
@@ -82,8 +229,8 @@ static void* limsw_watcher( void* arg)
 
   for (i = 0 ; i < nr_limits ; ++i) {
     gpio[ i]  = limit_gpios[ i];
-    gpio_write_int_value_to_file( "export", gpio[ i]);
-    gpio_write_value_to_pin_file( gpio[ i], "direction", "in");
+    initial[ i] = 1;
+    gpio_pin_open( gpio[ i], 0);
     gpio_write_value_to_pin_file( gpio[ i], "edge", "both");
     gpio_fd[ i] = gpio_open_file( gpio[ i], "value");
     if (gpio_fd[ i] < 0) {
@@ -108,6 +255,12 @@ static void* limsw_watcher( void* arg)
     const int timeout = -1;     /* no timeout */
 
     int rc = poll( *fdset, nr_limits, timeout);      
+    struct timespec wakeup;
+    uint32_t pru_cycles;
+    clock_gettime( CLOCK_MONOTONIC, &wakeup);
+    if (pruss_stepper_cycle_count( &pru_cycles) < 0) {
+      pru_cycles = 0;
+    }
     if (rc < 0) {
       if (errno == EINTR) {
         continue;
@@ -123,7 +276,7 @@ static void* limsw_watcher( void* arg)
     for (i = 0 ; i < nr_limits ; ++i) {
       if ((*fdset)[ i].revents & POLLPRI) {
         int state = 0;
-        len = read( (*fdset)[ i].fd, buf, sizeof( buf));
+        len = pread( (*fdset)[ i].fd, buf, sizeof( buf), 0);	// read from the start re-arms poll()
         if (len == 2 && (buf[ 0] == '0' || buf[ 0] == '1')) {
           // Get initial state info
           state = buf[ 0] - '0';
@@ -141,7 +294,11 @@ static void* limsw_watcher( void* arg)
         case ZMIN_GPIO: z_min_state = state; break;
         case ZMAX_GPIO: z_max_state = state; break;
         }
-        lseek( (*fdset)[ i].fd, 0, SEEK_SET);
+        if (initial[ i]) {
+          initial[ i] = 0;	// the first event only reports the initial state
+        } else {
+          limsw_record_edge( i, state, &wakeup, pru_cycles);
+        }
       }
     }
   }
@@ -1,6 +1,9 @@
 #ifndef _LIMIT_SWITCHES_H
 #define _LIMIT_SWITCHES_H
 
+#include <stdint.h>
+#include <time.h>
+
 #include "traject.h"
 
 // This are the (fixed) assignments for the BeBoPr
@@ -16,6 +19,41 @@
 extern int limsw_max( axis_e axis);
 extern int limsw_min( axis_e axis);
 
+// wait until a switch has been stable for 'stable_time' seconds after its
+// last change, at most 'timeout' seconds. Returns -1 on timeout, 0 otherwise
+extern int limsw_wait_stable( axis_e axis, int max_switch, double stable_time, double timeout);
+
+// Switch index used below: x_min, x_max, y_min, y_max, z_min, z_max
+#define NR_LIMIT_SWITCHES	6
+#define LIMSW_READ_TIME_BINS	16
+
+// One edge seen by the limit switch watcher
+typedef struct {
+  struct timespec	time;		// CLOCK_MONOTONIC at poll() wakeup
+  uint32_t		pru_cycles;	// PRUSS cycle counter at wakeup, 0 if not available
+  uint32_t		read_time;	// [ns] from wakeup until the new state was read
+  uint8_t		limsw;		// switch index
+  uint8_t		state;		// gpio level after the edge
+} limsw_event;
+
+typedef struct {
+  struct timespec	change;		// time of the last edge
+  struct timespec	burst_start;	// first edge of the current burst of bounces
+  unsigned int		edges;
+  unsigned int		bounces;	// edges within the debounce time of the previous edge
+  double		max_burst;	// [s] longest burst of bounces seen
+} limsw_switch_stats;
+
+typedef struct {
+  limsw_switch_stats	sw[ NR_LIMIT_SWITCHES];
+  unsigned int		read_time[ LIMSW_READ_TIME_BINS];	// bin n counts read times below 2^n us
+} limsw_stats;
+
+extern const char* limsw_name( int limsw);
+// copy the last 'max' edges, oldest first, returns the number copied
+extern int limsw_get_events( limsw_event* events, int max);
+extern void limsw_get_stats( limsw_stats* stats);
+
 extern int limsw_init( void);
 
 #endif
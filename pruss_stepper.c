@@ -6,6 +6,8 @@
 #include <string.h> 
 #include <sched.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <time.h>
 
 #include "pruss_stepper.h"
 #define PRU_NR		1
@@ -13,6 +15,8 @@
 #include "beaglebone.h"
 #include "debug.h"
 #include "bebopr.h"
+#include "mendel.h"
+#include "event.h"
 
 // Generic struct for access to 'command' field for all commands.
 typedef struct {
@@ -173,6 +177,477 @@ static int pruss_ecap_init( void)
 
 static int pruss_command( PruCommandUnion* cmd);
 
+/*
+ * The PRU can't interrupt us, so a monitor thread polls for the PRU
+ * queue to drain. It only runs while a thread is waiting for this and
+ * signals drain_event when the queue is empty and all moves are done.
+ */
+#define DRAIN_POLL_PERIOD	1000000	/* ns */
+
+static event drain_event;
+static event drain_arm;
+static volatile int drain_waiters = 0;
+static pthread_t drain_worker;
+
+/*
+ * Host side spool in front of the PRU command FIFO. The G-code thread
+ * appends commands, timed delays and output actions, a feeder thread
+ * moves them into the PRU FIFO. Delays and actions are executed by the
+ * feeder: it waits for the PRU to finish all preceding moves and then
+ * sleeps until the end of the delay or performs the action, so the
+ * G-code thread can continue with the next moves.
+ * The size must be a power of two.
+ */
+#define SPOOL_SIZE	64
+
+typedef enum {
+  e_spool_command,
+  e_spool_delay,
+  e_spool_action,
+  e_spool_marker,
+} spool_entry_type;
+
+typedef struct {
+  spool_entry_type	type;
+  unsigned int		tag;	// of the move a command belongs to
+  int			move;	// part of the move itself, replanned after a pause
+  union {
+    PruCommandUnion	cmd;
+    struct timespec	delay;
+    struct {
+      pruss_sync_action* function;
+      int		handle;
+      double		value;
+    } action;
+  };
+} spool_entry;
+
+static spool_entry spool[ SPOOL_SIZE];
+static volatile unsigned int spool_head = 0;	// written by producer only
+static volatile unsigned int spool_tail = 0;	// written by feeder only
+static event spool_event;			// signalled on every head or tail change
+static pthread_t spool_worker;
+static volatile int spool_running = 0;
+static volatile int spool_busy = 0;		// feeder is processing an entry
+// Set during an abort: the spool is flushed and new entries are discarded
+static volatile int aborting = 0;
+// Set during a pause: the feeder parks and the spool is kept for the replay
+static volatile int holding = 0;
+static volatile int spool_parked = 0;
+// PRUSS memory is mapped, registers can be accessed
+static volatile int pruss_mapped = 0;
+
+/*
+ * Commands are tagged with the move they belong to, see pruss_queue_set_tag.
+ * A copy of each command written into the PRUSS fifo is kept, so an abort
+ * can tell which move the PRUSS was executing and a pause can keep the
+ * commands that were not fetched.
+ */
+static __thread unsigned int spool_tag = 0;
+static __thread int spool_move = 0;
+static spool_entry fifo_entry[ NR_CMD_FIFO_ENTRIES];
+static volatile unsigned int aborted_tag = 0;
+
+/*
+ * Marker actions are performed when the PRUSS fetches the first command
+ * queued after the marker, without waiting for the preceding moves to
+ * finish. The feeder keeps the pending markers and polls the fifo.
+ * Commands are counted as they are written, so the number of commands
+ * fetched by the PRUSS follows from the fill level of the fifo.
+ */
+#define MAX_MARKERS		16
+#define MARKER_POLL_PERIOD	1000000	/* ns */
+
+static unsigned int fifo_written = 0;
+static struct {
+  pruss_sync_action*	function;
+  int			handle;
+  double		value;
+  unsigned int		tag;
+  unsigned int		count;	// fifo_written when the marker was reached
+} markers[ MAX_MARKERS];
+static unsigned int marker_head = 0;	// feeder only
+static unsigned int marker_tail = 0;
+
+/*
+ * Set from the priority command lane when an emergency stop is executed.
+ * The PRU is halted at that point, a thread that tries to queue more
+ * commands is parked here instead of terminating the program.
+ */
+static volatile int emergency_stop = 0;
+
+/*
+ * A pause keeps the entries that were not executed: the spool is left
+ * as it is and the commands from the fifo that are not part of a move
+ * and the pending markers are held. The moves are replanned by the
+ * replay action, that also passes the other entries in their original
+ * order, see pruss_stepper_replay_held.
+ */
+#define HELD_SIZE	(2 * (NR_CMD_FIFO_ENTRIES + MAX_MARKERS))
+
+static spool_entry held[ HELD_SIZE];
+static unsigned int held_count = 0;
+static unsigned int held_next = 0;
+static volatile int replay_pending = 0;
+static struct {
+  pruss_sync_action*	function;
+  int			handle;
+  double		value;
+} replay_action;
+
+static int pruss_drained( void)
+{
+  return pruss_is_halted() ||
+	 ((holding || (spool_head == spool_tail && !replay_pending)) &&
+	  pruss_queue_empty() && !pruss_stepper_busy());
+}
+
+static void* drain_monitor( void* arg)
+{
+  struct timespec period = {
+    .tv_sec  = 0,
+    .tv_nsec = DRAIN_POLL_PERIOD,
+  };
+  while (1) {
+    unsigned int seq = event_sequence( &drain_arm);
+    if (drain_waiters == 0) {
+      event_wait( &drain_arm, seq, NULL);
+    } else {
+      if (pruss_drained()) {
+        event_signal( &drain_event);
+      }
+      clock_nanosleep( CLOCK_MONOTONIC, 0, &period, NULL);
+    }
+  }
+  return NULL;
+}
+
+/*
+ * Block until all queued moves have been executed, returns -1 if the
+ * PRU has halted.
+ */
+int pruss_wait_for_completion( void)
+{
+  unsigned int seq;
+  __sync_fetch_and_add( &drain_waiters, 1);
+  event_signal( &drain_arm);
+  while (seq = event_sequence( &drain_event), !pruss_drained()) {
+    event_wait( &drain_event, seq, NULL);
+  }
+  __sync_fetch_and_sub( &drain_waiters, 1);
+  return (pruss_is_halted()) ? -1 : 0;
+}
+
+static int pruss_write_command( PruCommandUnion* cmd, unsigned int tag, int move);
+
+static unsigned int pruss_fetched_count( void)
+{
+  unsigned int used = (pruss_rd8( IX_IN) + NR_CMD_FIFO_ENTRIES - pruss_rd8( IX_OUT)) % NR_CMD_FIFO_ENTRIES;
+  return fifo_written - used;
+}
+
+// Perform the marker actions for the commands the PRUSS has fetched
+static void spool_markers( void)
+{
+  while (marker_tail != marker_head) {
+    int i = marker_tail % MAX_MARKERS;
+    if (!pruss_is_halted() && (int)(pruss_fetched_count() - markers[ i].count) <= 0) {
+      break;
+    }
+    (void) markers[ i].function( markers[ i].handle, markers[ i].value);
+    ++marker_tail;
+  }
+}
+
+static void spool_add_marker( const spool_entry* e)
+{
+  if (marker_head - marker_tail >= MAX_MARKERS) {
+    // no room, perform the oldest one early
+    int i = marker_tail % MAX_MARKERS;
+    (void) markers[ i].function( markers[ i].handle, markers[ i].value);
+    ++marker_tail;
+  }
+  int i = marker_head % MAX_MARKERS;
+  markers[ i].function	= e->action.function;
+  markers[ i].handle	= e->action.handle;
+  markers[ i].value	= e->action.value;
+  markers[ i].tag	= e->tag;
+  markers[ i].count	= fifo_written;
+  ++marker_head;
+}
+
+// Wait for all preceding moves to finish, returns -1 if paused meanwhile
+static int spool_sync( void)
+{
+  struct timespec poll = {
+    .tv_sec  = 0,
+    .tv_nsec = 100000,
+  };
+  while (!aborting && !holding && !pruss_is_halted() && (!pruss_queue_empty() || pruss_stepper_busy())) {
+    spool_markers();
+    clock_nanosleep( CLOCK_MONOTONIC, 0, &poll, NULL);
+  }
+  spool_markers();
+  return (holding) ? -1 : 0;
+}
+
+// A pause interrupts the delay, the remainder is left in 'delay'
+static int spool_delay( struct timespec* delay)
+{
+  if (spool_sync() < 0) {
+    return -1;
+  }
+  struct timespec deadline;
+  clock_gettime( CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec  += delay->tv_sec;
+  deadline.tv_nsec += delay->tv_nsec;
+  if (deadline.tv_nsec >= 1000000000) {
+    deadline.tv_nsec -= 1000000000;
+    ++deadline.tv_sec;
+  }
+  // sleep on the spool event, so an abort can end the delay
+  while (!aborting && !emergency_stop) {
+    unsigned int seq = event_sequence( &spool_event);
+    struct timespec now, timeout;
+    clock_gettime( CLOCK_MONOTONIC, &now);
+    timeout.tv_sec  = deadline.tv_sec  - now.tv_sec;
+    timeout.tv_nsec = deadline.tv_nsec - now.tv_nsec;
+    if (timeout.tv_nsec < 0) {
+      timeout.tv_nsec += 1000000000;
+      --timeout.tv_sec;
+    }
+    if (timeout.tv_sec < 0 || (timeout.tv_sec == 0 && timeout.tv_nsec == 0)) {
+      break;
+    }
+    if (holding) {
+      *delay = timeout;
+      return -1;
+    }
+    event_wait( &spool_event, seq, &timeout);
+  }
+  return 0;
+}
+
+/*
+ * Execute an entry in the feeder, returns -1 if it was interrupted
+ * by a pause and must be executed again after the pause.
+ */
+static int spool_execute( spool_entry* e)
+{
+  switch (e->type) {
+  case e_spool_command:
+    if (pruss_write_command( &e->cmd, e->tag, e->move) < 0 && holding) {
+      return -1;
+    }
+    break;
+  case e_spool_delay:
+    return spool_delay( &e->delay);
+  case e_spool_action:
+    if (spool_sync() < 0) {
+      return -1;
+    }
+    if (!aborting) {
+      (void) e->action.function( e->action.handle, e->action.value);
+    }
+    break;
+  case e_spool_marker:
+    spool_add_marker( e);
+    break;
+  }
+  return 0;
+}
+
+/*
+ * A single action can be armed to be performed once all queued moves
+ * have finished and nothing more is queued. The feeder polls for this
+ * while the action is armed. If the action returns a negative value,
+ * it is retried at the next poll.
+ */
+#define IDLE_POLL_PERIOD	10000000	/* ns */
+
+static pthread_mutex_t idle_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int idle_armed = 0;
+static struct {
+  pruss_sync_action*	function;
+  int			handle;
+  double		value;
+} idle_action;
+
+static void spool_idle( void)
+{
+  pthread_mutex_lock( &idle_lock);
+  if (idle_armed && spool_tail == spool_head &&
+      idle_action.function( idle_action.handle, idle_action.value) >= 0) {
+    idle_armed = 0;
+  }
+  pthread_mutex_unlock( &idle_lock);
+}
+
+static void* spool_feeder( void* arg)
+{
+  struct timespec idle_poll = {
+    .tv_sec  = 0,
+    .tv_nsec = IDLE_POLL_PERIOD,
+  };
+  struct timespec marker_poll = {
+    .tv_sec  = 0,
+    .tv_nsec = MARKER_POLL_PERIOD,
+  };
+  while (1) {
+    unsigned int seq = event_sequence( &spool_event);
+    if (emergency_stop) {
+      // discard everything, nothing will be executed anymore
+      spool_tail = spool_head;
+      event_signal( &spool_event);
+      sleep( 1);
+      continue;
+    }
+    if (aborting) {
+      marker_tail = marker_head;	// the moves they belong to are gone
+      held_next = held_count;
+      replay_pending = 0;
+      if (spool_tail != spool_head) {
+        spool_tail = spool_head;
+        event_signal( &spool_event);
+      }
+    }
+    if (holding) {
+      spool_parked = 1;
+      event_wait( &spool_event, seq, NULL);
+      continue;
+    }
+    spool_parked = 0;
+    if (replay_pending) {
+      spool_busy = 1;
+      __sync_synchronize();
+      (void) replay_action.function( replay_action.handle, replay_action.value);
+      // anything held that is not passed yet follows the replayed moves
+      while (!holding && held_next < held_count && spool_execute( &held[ held_next]) == 0) {
+        ++held_next;
+      }
+      replay_pending = 0;
+      spool_busy = 0;
+      event_signal( &spool_event);
+      continue;
+    }
+    spool_markers();
+    if (spool_tail == spool_head) {
+      if (idle_armed && pruss_drained()) {
+        spool_idle();
+      }
+      event_wait( &spool_event, seq, (marker_tail != marker_head) ? &marker_poll :
+					(idle_armed) ? &idle_poll : NULL);
+      continue;
+    }
+    spool_busy = 1;
+    __sync_synchronize();	// read the entry after seeing it published
+    spool_entry* e = &spool[ spool_tail % SPOOL_SIZE];
+    if (spool_execute( e) == 0) {
+      __sync_synchronize();
+      spool_tail = spool_tail + 1;
+    }
+    spool_busy = 0;
+    event_signal( &spool_event);
+  }
+  return NULL;
+}
+
+static int spool_put( const spool_entry* entry)
+{
+  unsigned int seq;
+  while (emergency_stop) {
+    sleep( 1);
+  }
+  while (seq = event_sequence( &spool_event),
+	 spool_head - spool_tail >= SPOOL_SIZE && !(holding && spool_move)) {
+    event_wait( &spool_event, seq, NULL);
+  }
+  if (aborting) {
+    return 0;		// discarded until the position is resynchronized
+  }
+  if (holding && spool_move) {
+    return 0;		// the move is in the log, it's replanned after the pause
+  }
+  spool[ spool_head % SPOOL_SIZE] = *entry;
+  spool[ spool_head % SPOOL_SIZE].tag = spool_tag;
+  spool[ spool_head % SPOOL_SIZE].move = spool_move;
+  __sync_synchronize();		// entry must be complete before it's published
+  spool_head = spool_head + 1;
+  event_signal( &spool_event);
+  return 0;
+}
+
+#define MAX_DELAY	(7 * 24 * 3600.0)	/* [s] */
+
+/*
+ * Queue a delay: once all preceding moves are finished, nothing is
+ * executed for 'seconds'. The caller doesn't wait for this.
+ * The range is checked before the conversion, a delay beyond
+ * MAX_DELAY is clipped.
+ */
+int pruss_queue_delay( double seconds)
+{
+  spool_entry entry = {
+    .type	= e_spool_delay,
+    .delay	= { .tv_sec = 0, .tv_nsec = 0 },
+  };
+  if (seconds > MAX_DELAY) {
+    seconds = MAX_DELAY;
+  }
+  if (seconds > 0.0) {
+    entry.delay.tv_sec  = (time_t) seconds;
+    entry.delay.tv_nsec = (long) ((seconds - entry.delay.tv_sec) * 1.0E9);
+  }
+  return spool_put( &entry);
+}
+
+/*
+ * Queue an action, e.g. setting an output, that is to be performed
+ * when all preceding moves have finished. The caller doesn't wait.
+ */
+int pruss_queue_sync_action( pruss_sync_action* function, int handle, double value)
+{
+  spool_entry entry = {
+    .type		= e_spool_action,
+    .action.function	= function,
+    .action.handle	= handle,
+    .action.value	= value,
+  };
+  return spool_put( &entry);
+}
+
+/*
+ * Queue an action that is to be performed when the PRUSS starts on the
+ * commands queued after it. Unlike a sync action, this doesn't wait for
+ * the preceding moves to finish, so the fifo keeps running.
+ */
+int pruss_queue_marker_action( pruss_sync_action* function, int handle, double value)
+{
+  spool_entry entry = {
+    .type		= e_spool_marker,
+    .action.function	= function,
+    .action.handle	= handle,
+    .action.value	= value,
+  };
+  return spool_put( &entry);
+}
+
+/*
+ * Arm an action that is to be performed when the queue has drained,
+ * it replaces a previously armed action. The caller doesn't wait.
+ */
+int pruss_queue_idle_action( pruss_sync_action* function, int handle, double value)
+{
+  pthread_mutex_lock( &idle_lock);
+  idle_action.function	= function;
+  idle_action.handle	= handle;
+  idle_action.value	= value;
+  idle_armed		= 1;
+  pthread_mutex_unlock( &idle_lock);
+  event_signal( &spool_event);
+  return 0;
+}
+
 int pruss_stepper_init( void)
 {
   struct ucode_signature signature;
@@ -180,6 +655,7 @@ int pruss_stepper_init( void)
   if (pruss_init( UCODENAME, &signature) < 0) {
     return -1;
   }
+  pruss_mapped = 1;
   if (signature.ucode_magic == UCODE_MAGIC && signature.fw_version == FW_VERSION) {
     if (debug_flags & DEBUG_PRUSS) {
       printf( "Valid STEPPER microcode found (version %d.%d).\n",
@@ -222,6 +698,16 @@ int pruss_stepper_init( void)
   uint16_t pc = pruss_rd16( PRUSS_PRU_CTRL_STATUS);
   pruss_start_pruss();
 
+  event_init( &spool_event);
+  if (mendel_thread_create( "pruss_spool", &spool_worker, NULL, &spool_feeder, NULL) != 0) {
+    return -1;
+  }
+  struct sched_param spool_param = {
+    .sched_priority = SPOOL_PRIO
+  };
+  pthread_setschedparam( spool_worker, SPOOL_SCHED, &spool_param);
+  spool_running = 1;
+
   if (debug_flags & DEBUG_PRUSS) {
     printf( "PRUSS successfully started at PC=%d.\n", pc);
   }
@@ -237,6 +723,15 @@ int pruss_stepper_init( void)
   if (pruss_command( &pruCmd) < 0) {
     return -1;
   }
+  event_init( &drain_event);
+  event_init( &drain_arm);
+  if (mendel_thread_create( "pruss_drain", &drain_worker, NULL, &drain_monitor, NULL) != 0) {
+    return -1;
+  }
+  struct sched_param param = {
+    .sched_priority = DRAIN_PRIO
+  };
+  pthread_setschedparam( drain_worker, DRAIN_SCHED, &param);
   if (DEBUG_PRUSS) {
     debug_flags &= ~DEBUG_PRUSS;
   }
@@ -385,9 +880,22 @@ int pruss_stepper_halted( void)
   return pruss_is_halted();
 }
 
+/*
+ * Read the PRUSS cycle counter, for time stamping events from other threads.
+ * Returns -1 if the PRUSS is not available or its counter is not enabled.
+ */
+int pruss_stepper_cycle_count( uint32_t* cycles)
+{
+  if (!pruss_mapped || !(pruss_rd32( PRUSS_PRU_CTRL_CONTROL) & PRUSS_PRU_CTRL_CONTROL_COUNTER_ENABLE)) {
+    return -1;
+  }
+  *cycles = pruss_rd32( PRUSS_PRU_CTRL_CYCLE);
+  return 0;
+}
+
 int pruss_wait_for_queue_space( void)
 {
-  while (pruss_queue_full()) {
+  while (pruss_queue_full() && !aborting && !holding) {
     if (pruss_is_halted()) {
       return -1;
     }
@@ -396,6 +904,9 @@ int pruss_wait_for_queue_space( void)
      * Until an interrupt driven interface is implemented, reduce the
      * cpu load and number of poll cycles by sleeping part of the time.
      */
+    if (spool_running && pthread_equal( pthread_self(), spool_worker)) {
+      spool_markers();
+    }
     usleep( 50);
   }
   return 0;
@@ -423,24 +934,305 @@ int pruss_write_command_struct( int ix_in, PruCommandUnion* data)
   return ix_in;
 }
 
+int pruss_stepper_emergency_stop( void)
+{
+  emergency_stop = 1;
+  event_signal( &spool_event);
+  return pruss_halt_pruss();
+}
+
+/*
+ * Keep the commands in the fifo that the PRUSS has not fetched and that
+ * are not part of a move, with the pending markers in between, in front
+ * of what is left from an earlier pause. The feeder must be parked.
+ */
+static void hold_unfetched( int ix_out, unsigned int used)
+{
+  spool_entry kept[ HELD_SIZE];
+  unsigned int fetched = fifo_written - used;
+  unsigned int n = 0;
+  unsigned int c;
+
+  for (c = fetched ; ; ++c) {
+    while (marker_tail != marker_head && n < HELD_SIZE) {
+      int i = marker_tail % MAX_MARKERS;
+      if ((int)(markers[ i].count - c) > 0) {
+        break;
+      }
+      spool_entry marker = {
+        .type			= e_spool_marker,
+        .tag			= markers[ i].tag,
+        .action.function	= markers[ i].function,
+        .action.handle		= markers[ i].handle,
+        .action.value		= markers[ i].value,
+      };
+      kept[ n++] = marker;
+      ++marker_tail;
+    }
+    if (c == fifo_written) {
+      break;
+    }
+    const spool_entry* f = &fifo_entry[ (ix_out + c - fetched) % NR_CMD_FIFO_ENTRIES];
+    if (!f->move && n < HELD_SIZE) {
+      kept[ n++] = *f;
+    }
+  }
+  while (held_next < held_count && n < HELD_SIZE) {
+    kept[ n++] = held[ held_next++];
+  }
+  if (held_next < held_count || marker_tail != marker_head) {
+    fprintf( stderr, "pruss_stepper: too many entries held by the pause, dropping the rest\n");
+    marker_tail = marker_head;
+  }
+  memcpy( held, kept, n * sizeof( spool_entry));
+  held_count = n;
+  held_next = 0;
+}
+
+/*
+ * Stop all motion with a ramp-down from the current speed, for an abort
+ * or a pause. An abort flushes the spool, a pause parks the feeder with
+ * the spool intact and holds what can't be replanned from the fifo.
+ */
+static int stepper_stop( int hold)
+{
+  struct timespec poll = { .tv_sec = 0, .tv_nsec = 100000 };
+  PruCommandUnion stop[ 4];
+  int nr_stops = 0;
+  int axis;
+
+  if (emergency_stop) {
+    return -1;
+  }
+  if (hold) {
+    holding = 1;
+    __sync_synchronize();
+    event_signal( &spool_event);
+    // the feeder stops at the entry it is executing and keeps it
+    while (spool_running && !spool_parked) {
+      clock_nanosleep( CLOCK_MONOTONIC, 0, &poll, NULL);
+    }
+  } else {
+    aborting = 1;
+    __sync_synchronize();
+    event_signal( &spool_event);
+    // let the feeder finish the entry it is writing, it discards the rest
+    while (spool_busy || spool_head != spool_tail) {
+      clock_nanosleep( CLOCK_MONOTONIC, 0, &poll, NULL);
+    }
+    holding = 0;	// a pause in progress is discarded too
+  }
+  int was_halted = pruss_is_halted();
+  if (!was_halted) {
+    pruss_stop_pruss();
+  }
+  for (axis = 1 ; axis <= 4 ; ++axis) {
+    uint32_t base = PRUSS_RAM_OFFSET + (axis - 1) * FullADSize;
+    uint32_t step_cycle_time = pruss_rd32( base + 12);
+    uint32_t virt_pos = pruss_rd32( base + 20);
+    uint32_t step_size = pruss_rd32( base + 24);
+    uint32_t requested_pos = pruss_rd32( base + 32);
+    uint32_t accel_count = pruss_rd32( base + 40);
+    if (requested_pos == virt_pos) {
+      continue;
+    }
+    int dir = ((int32_t)(requested_pos - virt_pos) > 0) ? 1 : -1;
+    // end the move in progress at the current position
+    pruss_wr32( base + 32, virt_pos);
+    if (accel_count > 0) {
+      // ramp down over as many steps as it took to get up to speed
+      int32_t ramp = dir * (int32_t)(accel_count * step_size);
+      PruCommandUnion cmd = {
+        .move.n0	 		= accel_count,
+        .move.command		= CMD_AXIS_MOVE,
+        .move.axis			= axis,
+#ifdef PRU_ABS_COORDS
+        .move.position		= (int32_t)(virt_pos - VIRT_POS_MID_SCALE) + ramp,
+#else
+        .move.position		= ramp,
+#endif
+        .move.c0	 		= step_cycle_time,
+        .move.cn			= step_cycle_time + 1,
+      };
+      stop[ nr_stops++] = cmd;
+    }
+  }
+  // flush the fifo, then queue the ramp-downs
+  int ix_in = pruss_rd8( IX_OUT);
+  unsigned int used = (pruss_rd8( IX_IN) + NR_CMD_FIFO_ENTRIES - ix_in) % NR_CMD_FIFO_ENTRIES;
+  if (hold) {
+    __sync_synchronize();
+    hold_unfetched( ix_in, used);
+  }
+  // flushed commands are never fetched, don't count them as written
+  fifo_written -= used;
+  aborted_tag = fifo_entry[ (ix_in + NR_CMD_FIFO_ENTRIES - 1) % NR_CMD_FIFO_ENTRIES].tag;
+  for (int i = 0 ; i < NR_CMD_FIFO_ENTRIES ; ++i) {
+    fifo_entry[ i].tag = aborted_tag;
+  }
+  pruss_wr8( IX_IN, ix_in);
+  if (nr_stops > 0) {
+    PruCommandUnion exec;
+    exec.command.value		= CMD_AXES_EXECUTE;
+    exec.gen[ 1]		= 0;
+    for (int i = 0 ; i < nr_stops ; ++i) {
+      ix_in = pruss_write_command_struct( ix_in, &stop[ i]);
+    }
+    (void) pruss_write_command_struct( ix_in, &exec);
+    fifo_written += nr_stops + 1;
+  }
+  if (!was_halted) {
+    // Set bit15 in R6 to signal the PRUSS we're resuming from suspend
+    uint32_t reg = pruss_rd32( PRUSS_DBG_OFFSET + 6 * 4);
+    pruss_wr32( PRUSS_DBG_OFFSET + 6 * 4, reg | (1 << 15));
+    pruss_start_pruss();
+  }
+  return 0;
+}
+
+/*
+ * Abort all motion without losing the position: the host spool and the
+ * PRUSS command fifo are flushed and every moving axis is brought to a
+ * stop with a ramp-down from its current speed. Returns as soon as the
+ * ramp-down is started, use pruss_wait_for_completion to wait for the stop.
+ * New commands are discarded until pruss_stepper_abort_clear is called.
+ */
+int pruss_stepper_abort( void)
+{
+  return stepper_stop( 0);
+}
+
+/*
+ * Pause: stop like an abort, but keep everything that was queued.
+ * Entries queued meanwhile are kept too. Continue with pruss_stepper_resume.
+ */
+int pruss_stepper_pause( void)
+{
+  return stepper_stop( 1);
+}
+
+/*
+ * Continue after a pause. The feeder first calls 'replay', that must
+ * queue the moves again from where the axes stopped and pass the entries
+ * that were held with pruss_stepper_replay_held, then continues with the
+ * spool. The caller must wait for the ramp-down to finish first.
+ */
+int pruss_stepper_resume( pruss_sync_action* replay, int handle, double value)
+{
+  replay_action.function	= replay;
+  replay_action.handle		= handle;
+  replay_action.value		= value;
+  replay_pending = (replay != NULL);
+  __sync_synchronize();
+  holding = 0;
+  event_signal( &spool_event);
+  return 0;
+}
+
+/*
+ * Only to be called by the replay action: execute the held entries and
+ * the spooled entries that are not part of a move, up to and including
+ * those tagged 'tag'. The commands of the moves are skipped, these are
+ * queued again by the replay. Returns -1 if paused meanwhile.
+ */
+int pruss_stepper_replay_held( unsigned int tag)
+{
+  while (held_next < held_count && (int)(held[ held_next].tag - tag) <= 0) {
+    if (spool_execute( &held[ held_next]) < 0) {
+      return -1;
+    }
+    ++held_next;
+  }
+  while (spool_tail != spool_head) {
+    __sync_synchronize();
+    spool_entry* e = &spool[ spool_tail % SPOOL_SIZE];
+    if ((int)(e->tag - tag) > 0) {
+      break;
+    }
+    if (!e->move && spool_execute( e) < 0) {
+      return -1;
+    }
+    __sync_synchronize();
+    spool_tail = spool_tail + 1;
+    event_signal( &spool_event);
+  }
+  return 0;
+}
+
+/*
+ * Tag of the last command the PRUSS had fetched when the last abort
+ * was executed, i.e. of the move that was interrupted.
+ */
+unsigned int pruss_stepper_abort_tag( void)
+{
+  return aborted_tag;
+}
+
+/*
+ * Tag the commands queued from now on by the calling thread. While 'move'
+ * is set, they are part of the move itself and are replanned after a pause,
+ * otherwise they are executed again after the move with that tag.
+ */
+void pruss_queue_set_tag( unsigned int tag, int move)
+{
+  spool_tag = tag;
+  spool_move = move;
+}
+
+/*
+ * Accept new commands again after an abort. The caller must have
+ * resynchronized its notion of the position with pruss_get_positions.
+ */
+int pruss_stepper_abort_clear( void)
+{
+  aborting = 0;
+  __sync_synchronize();
+  return 0;
+}
+
 // Write command structure to PRUSS, wait for free buffer is nescessary
-static int pruss_command( PruCommandUnion* cmd)
+static int pruss_write_command( PruCommandUnion* cmd, unsigned int tag, int move)
 {
   int ix_in = pruss_rd8( IX_IN);
   //  int ix_out = pruss_rd8( IX_OUT);
-  if (pruss_wait_for_queue_space() < 0) {
+  while (emergency_stop) {
+    sleep( 1);
+  }
+  if (pruss_wait_for_queue_space() < 0 && !aborting) {
     pruss_stepper_dump_state();
     printf( "ERROR: found pruss halted waiting for queue space for command %d, bailing out!\n",
 	    cmd->command.value);
     exit( EXIT_FAILURE);
   }
+  if (aborting || holding) {
+    return -1;
+  }
   //  printf( "pruss_command - write to SRAM buffer at index %d, out index is %d.\n", ix_in, ix_out);
+  fifo_entry[ ix_in].type = e_spool_command;
+  fifo_entry[ ix_in].cmd  = *cmd;
+  fifo_entry[ ix_in].tag  = tag;
+  fifo_entry[ ix_in].move = move;
   (void) pruss_write_command_struct( ix_in, cmd);
+  ++fifo_written;
   //  ix_in = writeCommandStruct( ix_in, cmd);
   //  ix_out = pruss_rd8( PRUSS_RAM_OFFSET + 129);
   return 0;
 }
 
+// Pass a command through the spool, directly until the feeder runs
+// and for commands queued by an action that is executed by the feeder
+static int pruss_command( PruCommandUnion* cmd)
+{
+  if (spool_running && !pthread_equal( pthread_self(), spool_worker)) {
+    spool_entry entry = {
+      .type	= e_spool_command,
+      .cmd	= *cmd,
+    };
+    return spool_put( &entry);
+  }
+  return pruss_write_command( cmd, spool_tag, spool_move);
+}
+
 /*
  *  PRUSS STEPPER.BIN COMMAND INTERFACE
  */
@@ -557,7 +1349,7 @@ int pruss_queue_decel( int axis, uint32_t nmin, uint32_t cmin, int32_t delta)
 
 int pruss_queue_exec_limited( uint8_t mask, uint8_t invert)
 {
-  if (pruss_is_halted()) {
+  if (pruss_is_halted() && !emergency_stop && !aborting) {
     fprintf( stderr, "FATAL: PRUSS found halted when queueing execute command\n");
     pruss_stepper_dump_state();
     exit( EXIT_FAILURE);
@@ -25,6 +25,21 @@ extern int pruss_queue_set_enable( int on);
 extern int pruss_dump_position( void);
 extern int pruss_stepper_busy( void);
 extern int pruss_stepper_halted( void);
+extern int pruss_stepper_cycle_count( uint32_t* cycles);
+extern int pruss_stepper_emergency_stop( void);
+extern int pruss_stepper_abort( void);
+extern int pruss_stepper_abort_clear( void);
+extern unsigned int pruss_stepper_abort_tag( void);
+extern void pruss_queue_set_tag( unsigned int tag, int move);
+extern int pruss_wait_for_completion( void);
+extern int pruss_queue_delay( double seconds);
+typedef int (pruss_sync_action)( int handle, double value);
+extern int pruss_stepper_pause( void);
+extern int pruss_stepper_resume( pruss_sync_action* replay, int handle, double value);
+extern int pruss_stepper_replay_held( unsigned int tag);
+extern int pruss_queue_sync_action( pruss_sync_action* function, int handle, double value);
+extern int pruss_queue_marker_action( pruss_sync_action* function, int handle, double value);
+extern int pruss_queue_idle_action( pruss_sync_action* function, int handle, double value);
 extern int pruss_get_positions( int axis, int32_t* virtPosI, int32_t* requestedPos);
 
 #endif
@@ -6,6 +6,7 @@
 #include <fcntl.h>
 #include <string.h>
 #include <errno.h>
+#include <pthread.h>
 
 #include "pwm.h"
 #include "debug.h"
@@ -15,8 +16,17 @@ struct pwm_channel_record {
   const char*           device_path;
   unsigned int          frequency;
   int			duty_fd;
+  unsigned long		period_ns;	// zero if only 'duty_percent' is available
+  long			written;	// last value written to duty_fd, -1 if unknown
+  long			pending;	// value to write on the next commit
 };
 
+/*
+ * Outputs are set from several threads, the lock protects the cached
+ * values and keeps the staging of a batch together.
+ */
+static pthread_mutex_t pwm_lock = PTHREAD_MUTEX_INITIALIZER;
+
 static struct pwm_channel_record* pwm_channels;
 static unsigned int num_pwm_channels;
 
@@ -57,6 +67,24 @@ int pwm_config( pwm_config_record* config_data, int nr_config_items)
   return 0;
 }
 
+static int pwm_read_int_from_file( const char* path, const char* fname, long* value)
+{
+  char s[ 100];
+  snprintf( s, sizeof( s), "%s/%s", path, fname);
+  int fd = open( s, O_RDONLY);
+  if (fd < 0) {
+    return -1;
+  }
+  int count = read( fd, s, sizeof( s) - 1);
+  close( fd);
+  if (count <= 0) {
+    return -1;
+  }
+  s[ count] = '\0';
+  *value = strtol( s, NULL, 10);
+  return 0;
+}
+
 static int pwm_write_int_to_file( const char* path, const char* fname, int value)
 {
   char s[ 100];
@@ -91,7 +119,7 @@ void pwm_exit( void)
   for (int ch = 0 ; ch < num_pwm_channels ; ++ch) {
     if (pwm_channels[ ch].duty_fd != -1) {
       struct pwm_channel_record* pd = &pwm_channels[ ch];
-      pwm_set_output( pd->id, 0);
+      pwm_set_output_by_handle( ch, 0);
       pwm_write_int_to_file( pd->device_path, "run", 0);
       pwm_write_int_to_file( pd->device_path, "request", 0);
       close (pd->duty_fd);
@@ -110,11 +138,15 @@ int pwm_init( void)
     for (int ch = 0 ; ch < pwm_config_items ; ++ch) {
       pwm_config_record*         ps = &pwm_config_data[ ch];
       struct pwm_channel_record* pd = &pwm_channels[ ch];
+      long period;
 
       pd->id                = ps->tag;
       pd->device_path       = ps->device_path;
       pd->frequency         = ps->frequency;
       pd->duty_fd           = -1;
+      pd->period_ns         = 0;
+      pd->written           = -1;
+      pd->pending           = -1;
 
       ++num_pwm_channels;
 
@@ -124,12 +156,26 @@ int pwm_init( void)
       if (pd->frequency) {
         pwm_write_int_to_file( pd->device_path, "period_freq", pd->frequency);
       }
-      snprintf( s, sizeof( s), "%s/duty_percent", pd->device_path);
-      pd->duty_fd = open( s, O_WRONLY);
+      // Prefer 'duty_ns' for a finer resolution, it needs the period
+      if (pwm_read_int_from_file( pd->device_path, "period_ns", &period) == 0 && period > 0) {
+        snprintf( s, sizeof( s), "%s/duty_ns", pd->device_path);
+        pd->duty_fd = open( s, O_WRONLY);
+        if (pd->duty_fd >= 0) {
+          pd->period_ns = period;
+        }
+      }
       if (pd->duty_fd < 0) {
-        perror( "pwm_init: failed to open 'duty_percent' file");
+        snprintf( s, sizeof( s), "%s/duty_percent", pd->device_path);
+        pd->duty_fd = open( s, O_WRONLY);
+        if (pd->duty_fd < 0) {
+          perror( "pwm_init: failed to open 'duty_percent' file");
+        }
+      }
+      if (debug_flags & DEBUG_PWM) {
+        printf( "pwm_init: channel '%s' uses %s\n", tag_name( pd->id),
+		(pd->period_ns) ? "duty_ns" : "duty_percent");
       }
-      pwm_set_output( pd->id, 0);
+      pwm_set_output_by_handle( ch, 0);
       pwm_write_int_to_file( pd->device_path, "run", 1);
     }
     return 0;
@@ -138,28 +184,98 @@ int pwm_init( void)
   return -1;
 }
 
+channel_handle pwm_get_handle( channel_tag pwm_channel)
+{
+  return pwm_index_lookup( pwm_channel);
+}
+
 int pwm_set_output( channel_tag pwm_channel, unsigned int percentage)
 {
-  int ix = pwm_index_lookup( pwm_channel);
-  if (ix >= 0 && percentage <= 100) {
-    int fd = pwm_channels[ ix].duty_fd;
-    // Only write to the file if it is (still) available
-    if (fd < 0) {
-      return -1;
-    }
-    char s[ 10];
-    snprintf( s, sizeof( s), "%d", percentage);
-    int count = strlen( s);
-    int result = write( fd, s, count);
-    if (result < 0) {
-      perror( "pwm_set_output: error writing to duty_fd file");
-    } else if (result == count) {
-      return 0;
+  return pwm_set_output_by_handle( pwm_index_lookup( pwm_channel), percentage);
+}
+
+/*
+ * Write the pending value of a channel, but only if it differs from
+ * the value last written. Call with pwm_lock held.
+ */
+static int pwm_write_pending( struct pwm_channel_record* pd)
+{
+  long value = pd->pending;
+  // Only write to the file if it is (still) available
+  if (pd->duty_fd < 0 || value < 0) {
+    return -1;
+  }
+  if (value == pd->written) {
+    return 0;
+  }
+  char s[ 24];
+  snprintf( s, sizeof( s), "%ld", value);
+  int count = strlen( s);
+  int result = pwrite( pd->duty_fd, s, count, 0);
+  if (result == count) {
+    pd->written = value;
+    return 0;
+  }
+  if (result < 0) {
+    perror( "pwm_set_output: error writing to duty_fd file");
+  }
+  // state of the output is unknown, force a write next time
+  pd->written = -1;
+  return -1;
+}
+
+/*
+ * Set the value to be written to a channel by the next pwm_commit.
+ * The percentage is converted to the resolution of the channel.
+ */
+int pwm_stage_output_by_handle( channel_handle ix, double percentage)
+{
+  if (ix >= 0 && ix < num_pwm_channels && percentage >= 0.0 && percentage <= 100.0) {
+    struct pwm_channel_record* pd = &pwm_channels[ ix];
+    pthread_mutex_lock( &pwm_lock);
+    if (pd->period_ns) {
+      pd->pending = (long)(0.01 * percentage * pd->period_ns + 0.5);
+    } else {
+      pd->pending = (long)(percentage + 0.5);
     }
+    pthread_mutex_unlock( &pwm_lock);
+    return 0;
   }
   return -1;
 }
 
+/*
+ * Write all staged values, skipping channels that didn't change.
+ */
+int pwm_commit( void)
+{
+  int result = 0;
+  pthread_mutex_lock( &pwm_lock);
+  for (int ix = 0 ; ix < num_pwm_channels ; ++ix) {
+    if (pwm_channels[ ix].pending >= 0 && pwm_write_pending( &pwm_channels[ ix]) < 0) {
+      result = -1;
+    }
+  }
+  pthread_mutex_unlock( &pwm_lock);
+  return result;
+}
+
+int pwm_set_duty_by_handle( channel_handle ix, double percentage)
+{
+  if (pwm_stage_output_by_handle( ix, percentage) < 0) {
+    return -1;
+  }
+  pthread_mutex_lock( &pwm_lock);
+  int result = pwm_write_pending( &pwm_channels[ ix]);
+  pthread_mutex_unlock( &pwm_lock);
+  return result;
+}
+
+int pwm_set_output_by_handle( channel_handle ix, unsigned int percentage)
+{
+  return pwm_set_duty_by_handle( ix, percentage);
+}
+
 channel_tag pwm_lookup_by_name( const char* name)
 {
   for (int ix = 0 ; ix < num_pwm_channels ; ++ix) {
@@ -14,5 +14,13 @@ extern void pwm_exit( void);
 extern int pwm_config( pwm_config_record* pconfig_data, int nr_config_items);
 extern int pwm_set_output( channel_tag pwm_channel, unsigned int percentage);
 extern channel_tag pwm_lookup_by_name( const char* name);
+extern channel_handle pwm_get_handle( channel_tag pwm_channel);
+extern int pwm_set_output_by_handle( channel_handle pwm_channel, unsigned int percentage);
+// Fractional percentages use the 'duty_ns' interface if available.
+// Writes are skipped if the output doesn't change.
+extern int pwm_set_duty_by_handle( channel_handle pwm_channel, double percentage);
+// Stage outputs for several channels, then write them with one commit.
+extern int pwm_stage_output_by_handle( channel_handle pwm_channel, double percentage);
+extern int pwm_commit( void);
 
 #endif
@@ -0,0 +1,51 @@
+#ifndef _SEQLOCK_H
+#define _SEQLOCK_H
+
+#include <stddef.h>
+#include <string.h>
+
+/*
+ * Lock-free publication of a small data record by a single writer to
+ * any number of readers. The record is kept in two copies and a
+ * sequence counter tells the readers which copy is stable (a 'latch').
+ *
+ * The writer never blocks and readers never wait for the writer: even
+ * if a reader preempted the writer halfway an update, it reads the
+ * copy that is not being modified. A reader only retries if the writer
+ * published a new value while it was copying, so readers at a higher
+ * priority than the writer can't livelock.
+ *
+ * Usage: declare a 'seqlatch' and an array of two records, initialize
+ * both to zero, then use seqlatch_write and seqlatch_read.
+ */
+
+typedef struct {
+  volatile unsigned int seq;
+} seqlatch;
+
+static inline void seqlatch_write( seqlatch* latch, void* copies, const void* value, size_t size)
+{
+  char* p = (char*) copies;
+  ++latch->seq;			// odd: readers use copy 1
+  __sync_synchronize();
+  memcpy( p, value, size);
+  __sync_synchronize();
+  ++latch->seq;			// even: readers use copy 0
+  __sync_synchronize();
+  memcpy( p + size, value, size);
+}
+
+static inline unsigned int seqlatch_read( const seqlatch* latch, const void* copies, void* value, size_t size)
+{
+  const char* p = (const char*) copies;
+  unsigned int seq;
+  do {
+    seq = latch->seq;
+    __sync_synchronize();
+    memcpy( value, p + (seq & 1) * size, size);
+    __sync_synchronize();
+  } while (latch->seq != seq);
+  return seq;
+}
+
+#endif
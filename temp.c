@@ -15,6 +15,9 @@
 #include "beaglebone.h"
 #include "debug.h"
 #include "mendel.h"
+#include "seqlock.h"
+#include "thermistor.h"
+#include "event.h"
 
 /*
  * Temperature sensor interface for BeBoPr rev0.
@@ -30,10 +33,13 @@
 struct temp_channel {
   channel_tag		id;
   channel_tag		source;
+  channel_handle	source_handle;
   temp_conversion_f* 	conversion;
   int 			out_of_range;
   unsigned int 		in_range_time;
-  double 		value;
+  int			status;		// last conversion result
+  seqlatch		latch;		// publishes 'sample' to the readers
+  temp_sample		sample[ 2];
   double 		setpoint;
   double 		range_low;
   double 		range_high;
@@ -55,13 +61,16 @@ static int temp_index_lookup( channel_tag temp_channel)
   return -1;
 }
 
+// Signalled when a channel reaches its target or gets a sensor fault
+static event temp_event;
+
 /*
  * Callback, called from adc processing thread in analog.c
  */
-static int temp_update( channel_tag temp_channel, int analog_value)
+static int temp_update( channel_handle ix, int analog_value)
 {
-  int ix = temp_index_lookup( temp_channel);
-  if (ix >= 0) {
+  if (ix >= 0 && ix < num_temp_channels) {
+    channel_tag temp_channel = temp_channels[ ix].id;
     double celsius;
     int result;
     temp_conversion_f* convert = temp_channels[ ix].conversion;
@@ -75,16 +84,34 @@ static int temp_update( channel_tag temp_channel, int analog_value)
       fprintf( stderr, "temp_update was called for '%s' with value %d => celsius %1.1lf\n",
 	      tag_name( temp_channel), analog_value, celsius);
     }
-    if (result == 0) {
-      temp_channels[ ix].value = celsius;
+    // -1 means no conversion, other negative values report a sensor fault
+    if (result != -1) {
+      temp_sample sample;
+      // runs on the analog thread, so this is the sample the value came from
+      analog_get_sample_by_handle( temp_channels[ ix].source_handle, &sample.adc);
+      sample.celsius = celsius;
+      sample.status  = result;
+      seqlatch_write( &temp_channels[ ix].latch, temp_channels[ ix].sample, &sample, sizeof( sample));
+      if (result != temp_channels[ ix].status) {
+        if (result != 0) {
+          fprintf( stderr, "sensor for '%s' is %s\n", tag_name( temp_channel),
+		  (result == THERMISTOR_OPEN) ? "open" : (result == THERMISTOR_SHORT) ? "shorted" : "faulty");
+        } else {
+          fprintf( stderr, "sensor for '%s' has recovered\n", tag_name( temp_channel));
+        }
+        temp_channels[ ix].status = result;
+        event_signal( &temp_event);
+      }
     }
     if (result == 0 &&
 	temp_channels[ ix].range_low <= celsius &&
 	celsius <= temp_channels[ ix].range_high) {
       if (temp_channels[ ix].out_of_range > 0) {
         temp_channels[ ix].out_of_range -= ANALOG_UPDATE_CYCLE_TIME / 1000;
-        if (temp_channels[ ix].out_of_range == 0) {
+        if (temp_channels[ ix].out_of_range <= 0) {
+          temp_channels[ ix].out_of_range = 0;
           fprintf( stderr, "temperature for '%s' has stabilized\n", tag_name( temp_channel));
+          event_signal( &temp_event);
         }
       }	
     } else {
@@ -120,6 +147,7 @@ int temp_config( temp_config_record* config_data, int nr_config_items)
 int temp_init( void)
 {
   if (temp_config_data != NULL) {
+    event_init( &temp_event);
     mendel_sub_init( "analog", analog_init);
     for (int ix = 0 ; ix < temp_config_items ; ++ix) {
       temp_config_record* ps 	= &temp_config_data[ ix];
@@ -129,7 +157,8 @@ int temp_init( void)
       pd->conversion 		= ps->conversion;
       pd->in_range_time		= ps->in_range_time;
       pd->out_of_range 		= 0;
-      if (analog_set_update_callback( ps->source, temp_update, ps->tag) < 0) {
+      pd->source_handle		= analog_get_handle( ps->source);
+      if (analog_set_update_callback( ps->source, temp_update, ix) < 0) {
         fprintf( stderr, "temp_init: could not connect callback for '%s' to source '%s'\n", ps->tag, ps->source);
       }
       ++num_temp_channels;
@@ -158,15 +187,50 @@ int temp_set_setpoint( channel_tag temp_channel, double setpoint, double delta_l
 int temp_get_celsius( channel_tag temp_channel, double* pcelsius)
 {
   if (pcelsius != NULL) {
-    int ix = temp_index_lookup( temp_channel);
-    if (ix >= 0) {
-      *pcelsius = temp_channels[ ix].value;
+    temp_sample sample;
+    if (temp_get_sample( temp_channel, &sample) == 0) {
+      *pcelsius = sample.celsius;
       return 0;
     }
   }
   return -1;
 }
 
+/*
+ * Get the last converted sample, lock-free so the sampling thread is never
+ * blocked. Before the first conversion, the timestamp is zero.
+ */
+int temp_get_sample( channel_tag temp_channel, temp_sample* psample)
+{
+  return temp_get_sample_by_handle( temp_index_lookup( temp_channel), psample);
+}
+
+channel_handle temp_get_handle( channel_tag temp_channel)
+{
+  return temp_index_lookup( temp_channel);
+}
+
+int temp_get_sample_by_handle( channel_handle ix, temp_sample* psample)
+{
+  if (psample != NULL) {
+    if (ix >= 0 && ix < num_temp_channels) {
+      struct temp_channel* p = &temp_channels[ ix];
+      seqlatch_read( &p->latch, p->sample, psample, sizeof( *psample));
+      return 0;
+    }
+  }
+  return -1;
+}
+
+/*
+ * Event that is signalled whenever temp_achieved may have changed
+ * to true, use this to wait for a temperature without polling.
+ */
+event* temp_get_event( void)
+{
+  return &temp_event;
+}
+
 /// report whether a temp sensor is reading its target temperature
 /// used for M109 and friends
 int temp_achieved( channel_tag temp_channel)
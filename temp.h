@@ -3,6 +3,8 @@
 
 
 #include "beaglebone.h"
+#include "analog.h"
+#include "event.h"
 
 /*
  *  This (temp.[ch]) code links an analog input channel and a conversion function to a temperature sensor.
@@ -12,6 +14,16 @@
 
 typedef int (temp_conversion_f) (int in, double* pout);
 
+/*
+ * A coherent, timestamped temperature sample: the ADC sample
+ * it's based on and the converted temperature.
+ */
+typedef struct {
+  analog_sample		adc;
+  double		celsius;
+  int			status;		// zero, or sensor fault reported by the conversion
+} temp_sample;
+
 typedef const struct {
   channel_tag		tag;
   channel_tag		source;
@@ -25,7 +37,11 @@ extern int temp_config( temp_config_record* config_data, int nr_config_items);
 extern int temp_init( void);
 //extern channel_tag temp_lookup_by_name( const char* id);
 extern int temp_get_celsius( channel_tag channel, double* pcelsius);
+extern int temp_get_sample( channel_tag channel, temp_sample* psample);
+extern channel_handle temp_get_handle( channel_tag channel);
+extern int temp_get_sample_by_handle( channel_handle channel, temp_sample* psample);
 extern int temp_achieved( channel_tag temp_channel);
+extern event* temp_get_event( void);
 extern int temp_set_setpoint( channel_tag channel, double setpoint, double delta_low, double delta_high);
 extern int temp_get_setpoint( channel_tag channel, double* psetpoint);
 
@@ -1,5 +1,7 @@
 
 #include <unistd.h>
+#include <stdio.h>
+#include <math.h>
 
 #include "beaglebone.h"
 #include "thermistor.h"
@@ -141,55 +143,169 @@ static const struct conversion_entry my_330k_bed_thermistor[] = {
 { 1401, 150.0 },
 };
 
-static int convert_using_table( const struct conversion_entry* table, int entries, int adc, double* celsius)
+/*
+ * Every conversion is done with a lookup table that covers the full
+ * ADC range, so converting a sample is a single indexed load. The
+ * tables are generated at startup, either from one of the breakpoint
+ * tables above or from a thermistor model.
+ */
+#define ADC_RANGE	4096	/* 12-bit ADC */
+
+struct thermistor_lut {
+  float		celsius[ ADC_RANGE];
+  unsigned int	open_limit;	/* ADC values at or above this mean an open sensor */
+  unsigned int	short_limit;	/* ADC values below this mean a shorted sensor */
+  int		valid;
+};
+
+/*
+ * Thermistor model with Steinhart-Hart coefficients. The thermistor
+ * is the lower half of a divider with 'r_series' and the divider output
+ * spans the full ADC range.
+ */
+struct thermistor_model {
+  double	a;
+  double	b;
+  double	c;
+  double	r_series;	/* [Ohm] */
+};
+
+static struct thermistor_lut lut_thermistor_100k;
+static struct thermistor_lut lut_epcos_b5760g104f;
+static struct thermistor_lut lut_330k_bed_thermistor;
+static struct thermistor_lut lut_generic_100k_b3950;
+
+/*
+ * Interpolate between the breakpoints, the table is sorted by
+ * decreasing ADC value. Outside the table, the nearest segment
+ * is extrapolated.
+ */
+static double interpolate_table( const struct conversion_entry* table, int entries, int adc)
 {
-  // TODO: implement short to GND and short to +12V detection
-  if (celsius != NULL) {
-    int ix;
-    for (ix = 0 ; ix < entries ; ++ix) {
-      int delta_adc = adc - table[ ix].adc_value;
-      if (delta_adc > 0) {
-        if (ix > 0) {
-          double celsius_ix      = table[ ix].celsius;
-	  unsigned int adc_ix	 = table[ ix].adc_value;
-	  double delta_celsius   = celsius_ix - table[ ix - 1].celsius;
-	  unsigned int delta_adc = table[ ix - 1].adc_value - adc_ix;
-	  double rc              = delta_celsius / delta_adc;
-	  *celsius = celsius_ix - (adc - adc_ix) * rc;
-	} else {
-          // before first entry, must be very cold ;)
-	  *celsius = -273.15;
-	}
-	break;
-      } else if (delta_adc == 0) {
-        *celsius = table[ ix].celsius;
-	break;
-      } else if (ix == entries) {
-        if (adc < 50) {
-          // assume short circuit
-	  *celsius = 999.9;
-	} else {
-	  *celsius = 500.0;
-	}
+  int ix;
+  for (ix = 1 ; ix < entries - 1 ; ++ix) {
+    if (adc >= table[ ix].adc_value) {
+      break;
+    }
+  }
+  double celsius_ix      = table[ ix].celsius;
+  unsigned int adc_ix    = table[ ix].adc_value;
+  double delta_celsius   = celsius_ix - table[ ix - 1].celsius;
+  double delta_adc       = (double)table[ ix - 1].adc_value - adc_ix;
+  return celsius_ix - (adc - (double)adc_ix) * delta_celsius / delta_adc;
+}
+
+/*
+ * Generate a lookup table from a breakpoint table. Values below the
+ * short limit indicate a shorted sensor. Beyond the coldest breakpoint
+ * the first segment is extrapolated, a reading that ends up more than
+ * COLD_MARGIN below the coldest breakpoint indicates an open sensor.
+ */
+#define COLD_MARGIN	25.0	/* [celsius] */
+
+static void lut_from_table( struct thermistor_lut* lut, const struct conversion_entry* table, int entries)
+{
+  unsigned int coldest = table[ 0].adc_value;
+  lut->short_limit = 50;
+  lut->open_limit  = coldest + (ADC_RANGE - coldest) / 2;
+  for (int adc = 0 ; adc < ADC_RANGE ; ++adc) {
+    if (adc < lut->short_limit) {
+      lut->celsius[ adc] = 999.9;
+    } else {
+      double celsius = interpolate_table( table, entries, adc);
+      if (adc > coldest && celsius < table[ 0].celsius - COLD_MARGIN && adc < lut->open_limit) {
+        lut->open_limit = adc;
       }
+      lut->celsius[ adc] = (celsius < -273.15) ? -273.15 : celsius;
     }
-    return 0;
   }
-  return -1;
+  lut->valid = 1;
 }
 
+/*
+ * Generate a lookup table from a thermistor model.
+ * A calculated temperature outside -40 .. 400 celsius indicates a sensor fault.
+ */
+static void lut_from_model( struct thermistor_lut* lut, const struct thermistor_model* model)
+{
+  lut->short_limit = 0;
+  lut->open_limit  = ADC_RANGE;
+  for (int adc = 0 ; adc < ADC_RANGE ; ++adc) {
+    double celsius;
+    if (adc == 0) {
+      celsius = 999.9;
+    } else {
+      double r = model->r_series * adc / (ADC_RANGE - adc);
+      double ln_r = log( r);
+      celsius = 1.0 / (model->a + model->b * ln_r + model->c * ln_r * ln_r * ln_r) - 273.15;
+    }
+    if (celsius > 400.0) {
+      lut->short_limit = adc + 1;
+    } else if (celsius < -40.0 && lut->open_limit == ADC_RANGE) {
+      lut->open_limit = adc;
+    }
+    lut->celsius[ adc] = celsius;
+  }
+  lut->valid = 1;
+}
+
+/*
+ * The beta model is Steinhart-Hart without the cubic term.
+ */
+static void model_from_beta( struct thermistor_model* model, double r25, double beta, double r_series)
+{
+  model->a = 1.0 / 298.15 - log( r25) / beta;
+  model->b = 1.0 / beta;
+  model->c = 0.0;
+  model->r_series = r_series;
+}
+
+static int convert_using_lut( const struct thermistor_lut* lut, int adc, double* celsius)
+{
+  if (celsius == NULL || !lut->valid || adc < 0 || adc >= ADC_RANGE) {
+    return -1;
+  }
+  *celsius = lut->celsius[ adc];
+  if (adc >= lut->open_limit) {
+    return THERMISTOR_OPEN;
+  }
+  if (adc < lut->short_limit) {
+    return THERMISTOR_SHORT;
+  }
+  return 0;
+}
+
+/*
+ * Generate all lookup tables, must be called before the first conversion.
+ */
+int thermistor_init( void)
+{
+  struct thermistor_model model;
+
+  lut_from_table( &lut_thermistor_100k, thermistor_100k, NR_ITEMS( thermistor_100k));
+  lut_from_table( &lut_epcos_b5760g104f, epcos_b5760g104f, NR_ITEMS( epcos_b5760g104f));
+  lut_from_table( &lut_330k_bed_thermistor, my_330k_bed_thermistor, NR_ITEMS( my_330k_bed_thermistor));
+  model_from_beta( &model, 100000.0, 3950.0, 4700.0);
+  lut_from_model( &lut_generic_100k_b3950, &model);
+  return 0;
+}
 
 int bone_thermistor_100k( int adc, double* celsius)
 {
-  return convert_using_table( thermistor_100k, NR_ITEMS( thermistor_100k), adc, celsius);
+  return convert_using_lut( &lut_thermistor_100k, adc, celsius);
 }
 
 int bone_epcos_b5760g104f( int adc, double* celsius)
 {
-  return convert_using_table( epcos_b5760g104f, NR_ITEMS( epcos_b5760g104f), adc, celsius);
+  return convert_using_lut( &lut_epcos_b5760g104f, adc, celsius);
 }
 
 int bone_bed_thermistor_330k( int adc, double* celsius)
 {
-  return convert_using_table( my_330k_bed_thermistor, NR_ITEMS( my_330k_bed_thermistor), adc, celsius);
+  return convert_using_lut( &lut_330k_bed_thermistor, adc, celsius);
+}
+
+int generic_thermistor_100k_b3950( int adc, double* celsius)
+{
+  return convert_using_lut( &lut_generic_100k_b3950, adc, celsius);
 }
@@ -1,8 +1,16 @@
 #ifndef _THERMISTOR_H
 #define _THERMISTOR_H
 
+// conversion results that indicate a sensor fault
+#define THERMISTOR_OPEN		-2
+#define THERMISTOR_SHORT	-3
+
+extern int thermistor_init( void);
+
 extern int bone_thermistor_100k( int adc, double* celsius);
 extern int bone_epcos_b5760g104f( int adc, double* celsius);
 extern int bone_bed_thermistor_330k( int adc, double* celsius);
+// 100k NTC with beta 3950 and a 4k7 pull-up, divider spans the full ADC range
+extern int generic_thermistor_100k_b3950( int adc, double* celsius);
 
 #endif
@@ -4,6 +4,7 @@
 #include <math.h>
 #include <ctype.h>
 #include <sys/time.h>
+#include <pthread.h>
 
 #include "bebopr.h"
 #include "traject.h"
@@ -12,6 +13,8 @@
 #include "beaglebone.h"
 #include "mendel.h"
 #include "limit_switches.h"
+#include "pwm.h"
+#include "event.h"
 
 /*
  *  Settings that are changed during initialization.
@@ -34,8 +37,49 @@ static double ve_max;
 static const double fclk = 200000000.0;
 static const double c_acc = 282842712.5;	// = fclk * sqrt( 2.0);
 
-static double speed_override_factor = 1.0;
+/*
+ *  Overrides and feed hold can be changed at any time from the priority
+ *  command lane (comm thread). Changes that need a PRU command are only
+ *  applied by the thread that queues the moves, see traject_sync_overrides.
+ */
+static volatile double speed_override_factor = 1.0;
+static volatile double extruder_override_request = 1.0;
 static double extruder_override_factor = 1.0;
+static volatile int feed_hold = 0;
+static volatile int abort_pending = 0;
+
+/*
+ *  Pause support: a pause stops the moves with a ramp-down like an abort,
+ *  on resume the remainder of the moves is replanned from the position
+ *  where the axes came to a stop. The replay is an action executed by
+ *  the spool feeder, so it runs even if no more moves are queued.
+ *  Everything else that was queued (origin adjusts, outputs, delays) is
+ *  kept by the pause and passed after the move it was queued behind.
+ *  queue_lock keeps a resume from starting while a move is being queued.
+ */
+static volatile int pause_pending = 0;
+static int homing_active = 0;	// a pause only holds the feed, see traject_set_homing
+static pthread_mutex_t pause_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static event hold_event;	// signalled when the feed hold or a pause ends
+#ifdef PRU_ABS_COORDS
+/*
+ * Log of the last moves handed to the PRUSS, used to find the remainder
+ * of the queue after a pause. It must hold more moves than fit in the
+ * host spool and PRUSS fifo together. The commands of each move are
+ * tagged with its log index.
+ */
+# define MOVE_LOG_SIZE		128
+# define PAUSE_POSITION_TOLERANCE	20.0E-6		/* [m] */
+static traject5D move_log[ MOVE_LOG_SIZE];
+static unsigned int move_log_head = 0;
+static unsigned int replay_first;
+static unsigned int replay_end;
+#endif
+
+static void queue_move( const traject5D* traject);
+
+static void pruss_axis_config( int axis, double step_size, int reverse);
 
 
 /* ---------------------------------- */
@@ -229,19 +273,184 @@ static inline void axis_calc( const char* axis_name, double step_size_, double d
 					a##axis, &v##axis, &dwell_d##axis, &n0##axis, &nmin##axis, \
 					&c0##axis, &cmin##axis, &cdwell##axis, &recipr_t_acc, &recipr_t_move)
 
+#ifdef PRU_ABS_COORDS
+/*
+ * Distance from point p (x, y, z, e) to the line segment of a move.
+ */
+static double distance_to_move( const traject5D* m, const double p[ 4])
+{
+  double d[ 4] = { m->x1 - m->x0, m->y1 - m->y0, m->z1 - m->z0, m->e1 - m->e0 };
+  double r[ 4] = { p[ 0] - m->x0, p[ 1] - m->y0, p[ 2] - m->z0, p[ 3] - m->e0 };
+  double dd = 0.0;
+  double rd = 0.0;
+  int i;
+
+  for (i = 0 ; i < 4 ; ++i) {
+    dd += d[ i] * d[ i];
+    rd += r[ i] * d[ i];
+  }
+  double t = (dd > 0.0) ? rd / dd : 0.0;
+  if (t < 0.0) {
+    t = 0.0;
+  } else if (t > 1.0) {
+    t = 1.0;
+  }
+  double dist2 = 0.0;
+  for (i = 0 ; i < 4 ; ++i) {
+    double e = r[ i] - t * d[ i];
+    dist2 += e * e;
+  }
+  return sqrt( dist2);
+}
+
+/*
+ * Find the move the axes stopped on. The search starts one move before
+ * the one the PRUSS had fetched, moves before that have been executed.
+ * Returns the log index, or -1 if the position is not on any move.
+ */
+static int find_interrupted_move( const double p[ 4])
+{
+  unsigned int first = (move_log_head > MOVE_LOG_SIZE) ? move_log_head - MOVE_LOG_SIZE : 0;
+  unsigned int tag = pruss_stepper_abort_tag();
+  unsigned int i;
+
+  if (tag > first && tag < move_log_head) {
+    first = tag - 1;
+  }
+  for (i = first ; i < move_log_head ; ++i) {
+    if (distance_to_move( &move_log[ i % MOVE_LOG_SIZE], p) < PAUSE_POSITION_TOLERANCE) {
+      return i;
+    }
+  }
+  if (move_log_head > first) {
+    fprintf( stderr, "resume: position not on any of the logged moves, nothing to replay\n");
+  }
+  return -1;
+}
+
+/*
+ * Replay action executed by the spool feeder: queue the rest of the
+ * interrupted move followed by all later moves from the log, each
+ * followed by the other entries that were queued behind it.
+ */
+static int replay_remainder( int handle, double value)
+{
+  // entries from before the interrupted move were not executed either
+  if (pruss_stepper_replay_held( replay_first - 1) < 0) {
+    return -1;
+  }
+  for (unsigned int i = replay_first ; i < replay_end ; ++i) {
+    pruss_queue_set_tag( i, 1);
+    queue_move( &move_log[ i % MOVE_LOG_SIZE]);
+    pruss_queue_set_tag( i, 0);
+    if (pruss_stepper_replay_held( i) < 0) {
+      return -1;		// paused again
+    }
+  }
+  return 0;
+}
+#endif
+
+/*
+ * Restart after a pause: wait for the ramp-down to finish and have the
+ * moves that were not executed replanned, followed by the rest.
+ */
+static void traject_resume_after_pause( void)
+{
+  int32_t pos[ 4];
+  int axis;
+
+  pthread_mutex_lock( &pause_lock);
+  if (pause_pending) {
+    pthread_mutex_lock( &queue_lock);
+    pruss_wait_for_completion();
+    for (axis = 1 ; axis <= 4 ; ++axis) {
+      pruss_get_positions( axis, &pos[ axis - 1], NULL);
+    }
+#ifdef PRU_ABS_COORDS
+    double p[ 4] = { POS2SI( pos[ 0]), POS2SI( pos[ 1]), POS2SI( pos[ 2]), POS2SI( pos[ 3]) };
+    int i = find_interrupted_move( p);
+    if (i >= 0) {
+      if (DEBUG_TRAJECT && (debug_flags & DEBUG_TRAJECT)) {
+        printf( "resume: replaying %u moves from (%1.6lf, %1.6lf, %1.6lf, %1.6lf) [mm]\n",
+		move_log_head - i, SI2MM( p[ 0]), SI2MM( p[ 1]), SI2MM( p[ 2]), SI2MM( p[ 3]));
+      }
+      // the interrupted move now starts where the axes stopped
+      traject5D* m = &move_log[ i % MOVE_LOG_SIZE];
+      m->x0 = p[ 0];
+      m->y0 = p[ 1];
+      m->z0 = p[ 2];
+      m->e0 = p[ 3];
+      replay_first = i;
+    } else {
+      replay_first = move_log_head;	// only the other entries are passed
+    }
+    replay_end = move_log_head;
+    pruss_stepper_resume( replay_remainder, 0, 0.0);
+#endif
+    pause_pending = 0;
+    pthread_mutex_unlock( &queue_lock);
+  }
+  pthread_mutex_unlock( &pause_lock);
+}
+
+/*
+ * Wait while the feed is held or a pause has not been resumed.
+ */
+static void traject_wait_while_paused( void)
+{
+  unsigned int seq;
+  while (seq = event_sequence( &hold_event), feed_hold || pause_pending) {
+    event_wait( &hold_event, seq, NULL);
+  }
+}
+
+/*
+ * Called before each move is queued: wait while the feed is held
+ * and apply a changed extruder override factor.
+ */
+static void traject_sync_overrides( void)
+{
+  traject_wait_while_paused();
+  double factor = extruder_override_request;
+  if (factor != extruder_override_factor) {
+    extruder_override_factor = factor;
+    pruss_axis_config( 4, step_size_e / factor, config_reverse_axis( e_axis));
+  }
+}
+
 /*
  * All dimensions are in SI units and relative
  */
 void traject_delta_on_all_axes( traject5D* traject)
+{
+  if (traject == NULL) {
+    return;
+  }
+  traject_sync_overrides();
+  pthread_mutex_lock( &queue_lock);
+#ifdef PRU_ABS_COORDS
+  // log before queueing, a move cut short by a pause is part of the remainder
+  move_log[ move_log_head % MOVE_LOG_SIZE] = *traject;
+  pruss_queue_set_tag( move_log_head, 1);
+  ++move_log_head;
+#endif
+  queue_move( traject);
+#ifdef PRU_ABS_COORDS
+  // what is queued next keeps the tag and is passed after this move on a replay
+  pruss_queue_set_tag( move_log_head - 1, 0);
+#endif
+  pthread_mutex_unlock( &queue_lock);
+}
+
+static void queue_move( const traject5D* traject)
 {
   static unsigned long int serno = 0;
   static struct timespec t0;
   struct timespec t1;
-  double feed = speed_override_factor * traject->feed;
+  double feed;
 
-  if (traject == NULL) {
-    return;
-  }
+  feed = speed_override_factor * traject->feed;
 #ifdef _POSIX_MONOTONIC_CLOCK
   clockid_t clock = CLOCK_MONOTONIC;
 #else
@@ -567,19 +776,63 @@ static void pruss_axis_config( int axis, double step_size, int reverse)
 
 int traject_wait_for_completion( void)
 {
-  while (!pruss_queue_empty() || pruss_stepper_busy()) {
-    if (pruss_stepper_halted()) {
-      return -1;
-    }
-    sched_yield();
+  int result;
+  do {
+    traject_wait_while_paused();
+    result = pruss_wait_for_completion();
+  } while (pause_pending);	// paused meanwhile, the remainder is still to come
+  return result;
+}
+
+/*
+ * Set a PWM output when the moves queued so far have finished.
+ */
+int traject_set_output( channel_handle pwm_channel, double percentage)
+{
+  if (pwm_channel == INVALID_HANDLE || percentage < 0.0 || percentage > 100.0) {
+    return -1;
   }
-  return 0;
+  return pruss_queue_sync_action( pwm_set_duty_by_handle, pwm_channel, percentage);
 }
 
+/*
+ * Pause motion for 'seconds' after the moves queued so far.
+ */
+int traject_dwell( double seconds)
+{
+  return pruss_queue_delay( seconds);
+}
+
+/*
+ * Stop all motion as fast as the ramps allow. Queued moves are dropped
+ * and new moves are ignored until the position has been resynchronized,
+ * see traject_abort_clear.
+ */
 int traject_abort( void)
 {
-  // FIXME: implementation
-  return 1;
+  if (pruss_stepper_abort() < 0) {
+    return -1;
+  }
+  abort_pending = 1;
+  pause_pending = 0;	// the remainder is discarded too
+  event_signal( &hold_event);
+  return 0;
+}
+
+int traject_abort_pending( void)
+{
+  return abort_pending;
+}
+
+/*
+ * Wait for the axes to stop after an abort, then accept moves again.
+ * The caller must read back the actual positions with pruss_get_positions.
+ */
+int traject_abort_clear( void)
+{
+  pruss_wait_for_completion();
+  abort_pending = 0;
+  return pruss_stepper_abort_clear();
 }
 
 int traject_status_print( void)
@@ -597,14 +850,61 @@ double traject_set_speed_override( double factor)
 
 double traject_set_extruder_override( double factor)
 {
-  double old = extruder_override_factor;
-  extruder_override_factor = factor;
-  pruss_axis_config( 4, step_size_e / factor, config_reverse_axis( e_axis));
+  double old = extruder_override_request;
+  extruder_override_request = factor;
+  return old;
+}
+
+/*
+ * Hold the feed: moves already queued are finished, but no new moves
+ * are started until the hold is released. Releasing the hold after
+ * a pause replays the moves that were interrupted.
+ */
+int traject_set_feed_hold( int hold)
+{
+  int old = feed_hold;
+  if (!hold) {
+    traject_resume_after_pause();
+  }
+  feed_hold = hold;
+  event_signal( &hold_event);
   return old;
 }
 
+/*
+ * Pause: hold the feed and stop the moves in progress with a ramp-down.
+ * Releasing the feed hold continues with the rest of the interrupted
+ * move and the moves that were queued behind it. During homing or
+ * probing only the feed is held.
+ */
+int traject_pause( void)
+{
+  feed_hold = 1;
+#ifdef PRU_ABS_COORDS
+  pthread_mutex_lock( &pause_lock);
+  if (!pause_pending && !homing_active && pruss_stepper_pause() == 0) {
+    pause_pending = 1;
+  }
+  pthread_mutex_unlock( &pause_lock);
+#endif
+  return 0;
+}
+
+/*
+ * Homing and probing queue their commands outside the move log, these
+ * can't be replanned. While set, a pause doesn't stop the moves but only
+ * holds the feed, so it takes effect once the current phase is done.
+ */
+void traject_set_homing( int active)
+{
+  pthread_mutex_lock( &pause_lock);
+  homing_active = active;
+  pthread_mutex_unlock( &pause_lock);
+}
+
 int traject_init( void)
 {
+  event_init( &hold_event);
   /*
    *  Configure 'constants' from configuration
    */
@@ -4,6 +4,7 @@
 #include <stdint.h>
 
 #include "bebopr.h"
+#include "beaglebone.h"
 
 typedef struct {
 #ifdef PRU_ABS_COORDS
@@ -27,11 +28,18 @@ typedef struct {
 extern void traject_delta_on_all_axes( traject5D* delta);
 
 extern int traject_wait_for_completion( void);
+extern int traject_dwell( double seconds);
+extern int traject_set_output( channel_handle pwm_channel, double percentage);
 extern int traject_abort( void);
+extern int traject_abort_pending( void);
+extern int traject_abort_clear( void);
 extern int traject_status_print( void);
 
 extern double traject_set_speed_override( double factor);
 extern double traject_set_extruder_override( double factor);
+extern int traject_set_feed_hold( int hold);
+extern int traject_pause( void);
+extern void traject_set_homing( int active);
 
 extern int traject_init( void);
 